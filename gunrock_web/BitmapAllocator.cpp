@@ -0,0 +1,157 @@
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "include/BitmapAllocator.h"
+
+using namespace std;
+
+BitmapAllocator::BitmapAllocator() {
+  this->numBits = 0;
+  this->blockSize = 0;
+  this->cursor = 0;
+}
+
+void BitmapAllocator::reset(int numBits, int numBlocks, int blockSize) {
+  this->numBits = numBits;
+  this->blockSize = blockSize;
+  this->cursor = 0;
+  bits.assign(numBlocks * blockSize, 0);
+  dirty.assign(numBlocks, false);
+}
+
+unsigned char *BitmapAllocator::data() {
+  return bits.data();
+}
+
+int BitmapAllocator::numBlocks() {
+  return dirty.size();
+}
+
+bool BitmapAllocator::isSet(int bit) {
+  return (bits[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+void BitmapAllocator::set(int bit) {
+  bits[bit / 8] |= 1 << (bit % 8);
+  dirty[bit / 8 / blockSize] = true;
+}
+
+void BitmapAllocator::clear(int bit) {
+  bits[bit / 8] &= ~(1 << (bit % 8));
+  dirty[bit / 8 / blockSize] = true;
+}
+
+int BitmapAllocator::findClear(int from, int to) {
+  int bit = from;
+
+  // test bits one at a time until we reach a word boundary
+  while (bit < to && bit % 64 != 0) {
+    if (!isSet(bit)) {
+      return bit;
+    }
+    bit++;
+  }
+
+  while (bit + 64 <= to) {
+    // skip over fully allocated stretches without looking at each word
+#if defined(__AVX2__)
+    const __m256i allSet256 = _mm256_set1_epi8(-1);
+    while (bit + 256 <= to) {
+      __m256i chunk = _mm256_loadu_si256((const __m256i *) &bits[bit / 8]);
+      if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, allSet256)) != -1) {
+        break;
+      }
+      bit += 256;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i allSet128 = _mm_set1_epi8(-1);
+    while (bit + 128 <= to) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *) &bits[bit / 8]);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, allSet128)) != 0xffff) {
+        break;
+      }
+      bit += 128;
+    }
+    if (bit + 64 > to) {
+      break;
+    }
+#endif
+
+    // bit i of the bitmap is bit i % 8 of byte i / 8, which is bit i % 64
+    // of a little endian 64-bit word
+    uint64_t word;
+    memcpy(&word, &bits[bit / 8], sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    if (word != ~(uint64_t) 0) {
+      return bit + __builtin_ctzll(~word);
+    }
+    bit += 64;
+  }
+
+  while (bit < to) {
+    if (!isSet(bit)) {
+      return bit;
+    }
+    bit++;
+  }
+  return -1;
+}
+
+int BitmapAllocator::allocate() {
+  int bit = findClear(cursor, numBits);
+  if (bit < 0) {
+    bit = findClear(0, cursor);
+  }
+  if (bit < 0) {
+    return -1;
+  }
+  set(bit);
+  cursor = bit + 1 < numBits ? bit + 1 : 0;
+  return bit;
+}
+
+bool BitmapAllocator::allocate(int count, vector<int> &found) {
+  found.clear();
+  int bit = cursor;
+  bool wrapped = false;
+  while ((int) found.size() < count) {
+    bit = findClear(bit, wrapped ? cursor : numBits);
+    if (bit < 0) {
+      if (wrapped) {
+        return false;
+      }
+      wrapped = true;
+      bit = 0;
+      continue;
+    }
+    found.push_back(bit);
+    bit++;
+  }
+
+  for (size_t i = 0; i < found.size(); i++) {
+    set(found[i]);
+  }
+  if (!found.empty()) {
+    cursor = found.back() + 1 < numBits ? found.back() + 1 : 0;
+  }
+  return true;
+}
+
+bool BitmapAllocator::isDirty(int block) {
+  return dirty[block];
+}
+
+void BitmapAllocator::markDirty(int block) {
+  dirty[block] = true;
+}
+
+void BitmapAllocator::markClean(int block) {
+  dirty[block] = false;
+}
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cstring>
+
+#include "include/BlockCache.h"
+
+using namespace std;
+
+BlockCache::BlockCache(int capacity, int blockSize, int numShards) {
+  this->blockSize = blockSize;
+  this->shardCapacity = max(1, (capacity + numShards - 1) / numShards);
+  for (int i = 0; i < numShards; i++) {
+    Shard *shard = new Shard();
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->hits = 0;
+    shard->misses = 0;
+    shards.push_back(shard);
+  }
+}
+
+BlockCache::~BlockCache() {
+  for (size_t i = 0; i < shards.size(); i++) {
+    pthread_mutex_destroy(&shards[i]->lock);
+    delete shards[i];
+  }
+}
+
+BlockCache::Shard *BlockCache::shardFor(int blockNumber) {
+  return shards[blockNumber % shards.size()];
+}
+
+bool BlockCache::lookup(int blockNumber, void *buffer) {
+  Shard *shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard->lock);
+  unordered_map<int, Entry>::iterator iter = shard->entries.find(blockNumber);
+  if (iter == shard->entries.end()) {
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+  }
+
+  shard->hits++;
+  shard->lru.splice(shard->lru.begin(), shard->lru, iter->second.lruPosition);
+  memcpy(buffer, iter->second.data.data(), blockSize);
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+}
+
+bool BlockCache::peek(int blockNumber, void *buffer) {
+  Shard *shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard->lock);
+  unordered_map<int, Entry>::iterator iter = shard->entries.find(blockNumber);
+  bool found = iter != shard->entries.end();
+  if (found) {
+    memcpy(buffer, iter->second.data.data(), blockSize);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return found;
+}
+
+void BlockCache::fill(int blockNumber, const void *buffer) {
+  Shard *shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard->lock);
+  if (shard->entries.find(blockNumber) == shard->entries.end()) {
+    insert(shard, blockNumber, buffer, false);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void BlockCache::update(int blockNumber, const void *buffer, bool dirty) {
+  Shard *shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard->lock);
+  unordered_map<int, Entry>::iterator iter = shard->entries.find(blockNumber);
+  if (iter == shard->entries.end()) {
+    insert(shard, blockNumber, buffer, dirty);
+  } else {
+    memcpy(iter->second.data.data(), buffer, blockSize);
+    iter->second.dirty = dirty;
+    shard->lru.splice(shard->lru.begin(), shard->lru, iter->second.lruPosition);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void BlockCache::markClean(int blockNumber) {
+  Shard *shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard->lock);
+  unordered_map<int, Entry>::iterator iter = shard->entries.find(blockNumber);
+  if (iter != shard->entries.end()) {
+    iter->second.dirty = false;
+  }
+  evict(shard);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+vector<int> BlockCache::dirtyBlocks() {
+  vector<int> blocks;
+  for (size_t i = 0; i < shards.size(); i++) {
+    pthread_mutex_lock(&shards[i]->lock);
+    unordered_map<int, Entry>::iterator iter;
+    for (iter = shards[i]->entries.begin(); iter != shards[i]->entries.end(); iter++) {
+      if (iter->second.dirty) {
+        blocks.push_back(iter->first);
+      }
+    }
+    pthread_mutex_unlock(&shards[i]->lock);
+  }
+  sort(blocks.begin(), blocks.end());
+  return blocks;
+}
+
+int BlockCache::capacity() {
+  return shardCapacity * shards.size();
+}
+
+unsigned long BlockCache::hits() {
+  unsigned long total = 0;
+  for (size_t i = 0; i < shards.size(); i++) {
+    pthread_mutex_lock(&shards[i]->lock);
+    total += shards[i]->hits;
+    pthread_mutex_unlock(&shards[i]->lock);
+  }
+  return total;
+}
+
+unsigned long BlockCache::misses() {
+  unsigned long total = 0;
+  for (size_t i = 0; i < shards.size(); i++) {
+    pthread_mutex_lock(&shards[i]->lock);
+    total += shards[i]->misses;
+    pthread_mutex_unlock(&shards[i]->lock);
+  }
+  return total;
+}
+
+// Callers must hold the shard lock for insert and evict.
+void BlockCache::insert(Shard *shard, int blockNumber, const void *buffer, bool dirty) {
+  shard->lru.push_front(blockNumber);
+  Entry &entry = shard->entries[blockNumber];
+  entry.data.assign((const unsigned char *) buffer, (const unsigned char *) buffer + blockSize);
+  entry.dirty = dirty;
+  entry.lruPosition = shard->lru.begin();
+  evict(shard);
+}
+
+void BlockCache::evict(Shard *shard) {
+  // walk from the cold end and drop clean blocks until we fit again
+  list<int>::iterator iter = shard->lru.end();
+  while ((int) shard->entries.size() > shardCapacity && iter != shard->lru.begin()) {
+    iter--;
+    unordered_map<int, Entry>::iterator entry = shard->entries.find(*iter);
+    if (entry->second.dirty) {
+      continue;
+    }
+    shard->entries.erase(entry);
+    iter = shard->lru.erase(iter);
+  }
+}
@@ -0,0 +1,79 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "BodySource.h"
+#include "MySocket.h"
+
+using namespace std;
+
+BodySource::~BodySource() {
+}
+
+const string *BodySource::contents() {
+  return NULL;
+}
+
+int BodySource::file(off_t *offset) {
+  return -1;
+}
+
+StringBodySource::StringBodySource(string data) {
+  this->data = data;
+  this->consumed = 0;
+}
+
+long StringBodySource::length() {
+  return data.size();
+}
+
+int StringBodySource::read(char *buffer, int size) {
+  size_t count = data.size() - consumed;
+  if (count > (size_t) size) {
+    count = size;
+  }
+  memcpy(buffer, data.data() + consumed, count);
+  consumed += count;
+  return count;
+}
+
+const string *StringBodySource::contents() {
+  return &data;
+}
+
+FileBodySource::FileBodySource(int fd, off_t offset, size_t length) {
+  this->fd = fd;
+  this->offset = offset;
+  this->size = length;
+  this->consumed = 0;
+}
+
+FileBodySource::~FileBodySource() {
+  close(fd);
+}
+
+long FileBodySource::length() {
+  return size;
+}
+
+int FileBodySource::read(char *buffer, int size) {
+  size_t count = this->size - consumed;
+  if (count > (size_t) size) {
+    count = size;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  ssize_t ret = pread(fd, buffer, count, offset + consumed);
+  if (ret <= 0) {
+    // the file got shorter than the length we promised
+    throw SocketReadError();
+  }
+  consumed += ret;
+  return ret;
+}
+
+int FileBodySource::file(off_t *offset) {
+  *offset = this->offset;
+  return fd;
+}
@@ -1,35 +1,150 @@
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <unistd.h>
+#include <limits.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 
 #include "include/Disk.h"
 #include "include/dthread.h"
 
 using namespace std;
 
-Disk::Disk(string imageFile, int blockSize) {
+// A journal record is a JournalHeader, then count block numbers, then the
+// count blocks. The checksum covers the numbers and the blocks, so replay
+// can tell a record that was only partly written before a crash.
+#define JOURNAL_MAGIC 0x64733377
+
+struct JournalHeader {
+  unsigned int magic;
+  unsigned int count;
+  unsigned long long checksum;
+};
+
+// 64 bit FNV-1a
+static unsigned long long journalChecksum(const unsigned char *data, size_t size) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t idx = 0; idx < size; idx++) {
+    hash ^= data[idx];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// A run of consecutive blocks for transferBlocks: count iovecs starting
+// at first, read or written at offset
+struct BlockRun {
+  off_t offset;
+  size_t first;
+  size_t count;
+};
+
+// Fills iov with the buffers in block order and splits it into runs of
+// at most IOV_MAX blocks
+static void blockRuns(const vector<int> &blockNumbers, const vector<void *> &buffers, int blockSize,
+                      vector<struct iovec> &iov, vector<BlockRun> &runs) {
+  vector<pair<int, size_t> > order;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    order.push_back(make_pair(blockNumbers[idx], idx));
+  }
+  sort(order.begin(), order.end());
+
+  for (size_t idx = 0; idx < order.size(); idx++) {
+    struct iovec vec;
+    vec.iov_base = buffers[order[idx].second];
+    vec.iov_len = blockSize;
+    iov.push_back(vec);
+    if (idx == 0 || order[idx].first != order[idx - 1].first + 1 || runs.back().count == IOV_MAX) {
+      BlockRun run = {(off_t) order[idx].first * blockSize, idx, 0};
+      runs.push_back(run);
+    }
+    runs.back().count++;
+  }
+}
+
+static bool hasRepeats(const vector<int> &blockNumbers) {
+  set<int> seen;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (!seen.insert(blockNumbers[idx]).second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// readBlocksAsync's batch, and where its blocks go
+class AsyncRead : public IoBatch {
+ public:
+  vector<int> blockNumbers;
+  vector<void *> buffers;
+  vector<struct iovec> iov;
+  void (*done)(void *arg);
+  void *arg;
+};
+
+Disk::Disk(string imageFile, int blockSize, bool readOnly) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
 
-  struct stat stat;
-  int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
-  if (imageFileDescriptor < 0) {
+  pthread_key_create(&this->currentTxn, NULL);
+  pthread_mutex_init(&this->ownersLock, NULL);
+  pthread_cond_init(&this->ownersChanged, NULL);
+  this->transactionsStarted = 0;
+  this->cache = NULL;
+  this->writeBack = false;
+  this->mapping = NULL;
+  this->mappingWritable = false;
+  pthread_mutex_init(&this->mappingLock, NULL);
+  pthread_mutex_init(&this->syncLock, NULL);
+  this->ringEnabled = false;
+  pthread_key_create(&this->currentRing, NULL);
+  pthread_mutex_init(&this->ringsLock, NULL);
+  this->durability = DURABILITY_ALWAYS;
+  pthread_mutex_init(&this->flushLock, NULL);
+  pthread_cond_init(&this->flushDone, NULL);
+  this->flushInProgress = false;
+  this->flushesRequested = 0;
+  this->flushesCompleted = 0;
+
+  this->journalFileDescriptor = -1;
+  this->unloggedWrites = false;
+  this->journalSize = 0;
+  this->journalSequence = 0;
+  this->durableSequence = 0;
+  pthread_mutex_init(&this->journalLock, NULL);
+  pthread_cond_init(&this->checkpointWanted, NULL);
+  pthread_cond_init(&this->checkpointDone, NULL);
+  this->checkpointInProgress = false;
+  this->stopCheckpointer = false;
+
+  // We keep one descriptor open for the lifetime of the Disk and use
+  // positional I/O on it, so threads can share it without seeking.
+  // Read-only images fall back to O_RDONLY.
+  this->imageFileDescriptor = readOnly ? -1 : open(imageFile.c_str(), O_RDWR);
+  if (this->imageFileDescriptor < 0) {
+    this->imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
+  }
+  if (this->imageFileDescriptor < 0) {
     cerr << "could not open " << imageFile << endl;
     exit(1);
   }
-  int ret = fstat(imageFileDescriptor, &stat);
+
+  struct stat stat;
+  int ret = fstat(this->imageFileDescriptor, &stat);
   if (ret != 0) {
     cerr << "Could not stat image file" << endl;
     exit(1);
   }
-  close(imageFileDescriptor);
   
   this->imageFileSize = stat.st_size;
 
@@ -40,102 +155,1165 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
     exit(1);
   }
-  
+
+  recoverJournal();
 }
 
-int Disk::numberOfBlocks() {
-  return this->imageFileSize / this->blockSize;
+Disk::~Disk() {
+  if (journaling()) {
+    dthread_mutex_lock(&journalLock);
+    stopCheckpointer = true;
+    dthread_cond_signal(&checkpointWanted);
+    dthread_mutex_unlock(&journalLock);
+    pthread_join(checkpointer, NULL);
+
+    // leave the image complete and the journal empty
+    dthread_mutex_lock(&journalLock);
+    checkpoint(false);
+    dthread_mutex_unlock(&journalLock);
+    close(this->journalFileDescriptor);
+  }
+  map<int, JournaledBlock>::iterator block;
+  for (block = checkpointSet.begin(); block != checkpointSet.end(); block++) {
+    delete [] block->second.blockData;
+  }
+  if (this->mapping != NULL) {
+    munmap(this->mapping, this->imageFileSize);
+  }
+  set<IoRing *>::iterator ring;
+  for (ring = rings.begin(); ring != rings.end(); ring++) {
+    delete *ring;
+  }
+  close(this->imageFileDescriptor);
+  pthread_key_delete(this->currentTxn);
+  pthread_mutex_destroy(&this->ownersLock);
+  pthread_cond_destroy(&this->ownersChanged);
+  pthread_mutex_destroy(&this->journalLock);
+  pthread_cond_destroy(&this->checkpointWanted);
+  pthread_cond_destroy(&this->checkpointDone);
+  pthread_mutex_destroy(&this->flushLock);
+  pthread_cond_destroy(&this->flushDone);
+  pthread_mutex_destroy(&this->mappingLock);
+  pthread_mutex_destroy(&this->syncLock);
+  pthread_key_delete(this->currentRing);
+  pthread_mutex_destroy(&this->ringsLock);
+  delete this->cache;
 }
 
-void Disk::readBlock(int blockNumber, void *buffer) {
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+void Disk::enableCache(int capacity, bool writeBack) {
+  if (this->mapping != NULL) {
+    cerr << "A mapped image can't have a block cache" << endl;
+    exit(1);
+  }
+  delete this->cache;
+  this->cache = new BlockCache(capacity, this->blockSize);
+  this->writeBack = writeBack;
+}
+
+BlockCache *Disk::getCache() {
+  return this->cache;
+}
+
+void Disk::enableMapping() {
+  this->mappingWritable = (fcntl(this->imageFileDescriptor, F_GETFL) & O_ACCMODE) != O_RDONLY;
+  int protection = PROT_READ | (this->mappingWritable ? PROT_WRITE : 0);
+  void *addr = mmap(NULL, this->imageFileSize, protection, MAP_SHARED, this->imageFileDescriptor, 0);
+  if (addr == MAP_FAILED) {
+    perror("mmap");
+    cerr << "Could not map " << imageFile << endl;
+    exit(1);
+  }
+  this->mapping = (unsigned char *) addr;
+
+  // the page cache holds the blocks now
+  delete this->cache;
+  this->cache = NULL;
+}
+
+const void *Disk::blockPtr(int blockNumber) {
+  if (mapping == NULL) {
+    return NULL;
+  }
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  int fd = open(this->imageFile.c_str(), O_RDONLY);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
+  if (journaling()) {
+    Txn *txn = currentTransaction();
+    if (txn != NULL && txn->redoSet.count(blockNumber) > 0) {
+      return NULL;
+    }
+    dthread_mutex_lock(&journalLock);
+    bool journaled = checkpointSet.count(blockNumber) > 0;
+    dthread_mutex_unlock(&journalLock);
+    if (journaled) {
+      return NULL;
+    }
+  }
+  return mapping + (size_t) blockNumber * this->blockSize;
+}
+
+// mappingLock is taken for every block written, so it is a plain pthread
+// mutex like BlockCache's rather than a logging dthread one
+void Disk::copyToMapping(int blockNumber, const void *buffer) {
+  if (!mappingWritable) {
+    cerr << "Could not write file, " << imageFile << " is read only" << endl;
     exit(1);
   }
+  memcpy(mapping + (size_t) blockNumber * this->blockSize, buffer, this->blockSize);
+  pthread_mutex_lock(&mappingLock);
+  mappedDirty.insert(blockNumber);
+  pthread_mutex_unlock(&mappingLock);
+}
+
+// msync writes back whole pages, so each run of consecutive dirty blocks
+// is synced from the start of the page it begins in
+void Disk::syncImage(bool dataOnly) {
+  if (mapping == NULL) {
+    if (dataOnly) {
+      fdatasync(this->imageFileDescriptor);
+    } else {
+      fsync(this->imageFileDescriptor);
+    }
+    return;
+  }
+
+  dthread_mutex_lock(&syncLock);
+  set<int> dirty;
+  pthread_mutex_lock(&mappingLock);
+  dirty.swap(mappedDirty);
+  pthread_mutex_unlock(&mappingLock);
+
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  set<int>::iterator iter = dirty.begin();
+  while (iter != dirty.end()) {
+    int first = *iter;
+    int last = first;
+    for (iter++; iter != dirty.end() && *iter == last + 1; iter++) {
+      last++;
+    }
+    size_t start = (size_t) first * this->blockSize;
+    size_t end = (size_t) (last + 1) * this->blockSize;
+    start -= start % pageSize;
+    if (msync(mapping + start, end - start, MS_SYNC) != 0) {
+      perror("msync");
+      cerr << "Could not sync file" << endl;
+      exit(1);
+    }
+  }
+  dthread_mutex_unlock(&syncLock);
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("read::lseek");
-    cerr << "Could not seek to file" << endl;
+bool Disk::enableRing() {
+  this->ringEnabled = true;
+  this->ringEnabled = threadRing() != NULL;
+  return this->ringEnabled;
+}
+
+// Threads keep their ring until the Disk goes away. A thread that can't
+// get one, say because it ran into RLIMIT_MEMLOCK, carries on with
+// preadv and pwritev.
+IoRing *Disk::threadRing() {
+  if (!ringEnabled || mapping != NULL) {
+    return NULL;
+  }
+  IoRing *ring = (IoRing *) pthread_getspecific(currentRing);
+  if (ring == NULL) {
+    ring = IoRing::create(RING_ENTRIES);
+    if (ring == NULL) {
+      return NULL;
+    }
+    pthread_setspecific(currentRing, ring);
+    dthread_mutex_lock(&ringsLock);
+    rings.insert(ring);
+    dthread_mutex_unlock(&ringsLock);
+  }
+  return ring;
+}
+
+void Disk::readBlocksAsync(const vector<int> &blockNumbers, const vector<void *> &buffers,
+                           void (*done)(void *arg), void *arg) {
+  checkBlockNumbers(blockNumbers);
+  IoRing *ring = threadRing();
+  if (ring == NULL) {
+    readBlocks(blockNumbers, buffers);
+    done(arg);
+    return;
+  }
+
+  AsyncRead *read = new AsyncRead();
+  lookupBlocks(blockNumbers, buffers, read->blockNumbers, read->buffers);
+  if (read->blockNumbers.empty()) {
+    delete read;
+    done(arg);
+    return;
+  }
+  read->done = done;
+  read->arg = arg;
+  vector<BlockRun> runs;
+  blockRuns(read->blockNumbers, read->buffers, this->blockSize, read->iov, runs);
+  for (size_t idx = 0; idx < runs.size(); idx++) {
+    read->readv(this->imageFileDescriptor, &read->iov[runs[idx].first], runs[idx].count, runs[idx].offset);
+  }
+  ring->start(read);
+}
+
+int Disk::completionFd() {
+  IoRing *ring = threadRing();
+  return ring == NULL ? -1 : ring->eventFd();
+}
+
+int Disk::reapCompletions() {
+  IoRing *ring = threadRing();
+  if (ring == NULL) {
+    return 0;
+  }
+  ring->poll();
+
+  // done can start more reads, which land on the same list
+  deque<IoBatch *> &finished = ring->finished();
+  int count = 0;
+  while (!finished.empty()) {
+    AsyncRead *read = static_cast<AsyncRead *>(finished.front());
+    finished.pop_front();
+    if (read->error() != 0) {
+      errno = read->error();
+      perror("read::io_uring");
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    if (cache != NULL) {
+      for (size_t idx = 0; idx < read->blockNumbers.size(); idx++) {
+        cache->fill(read->blockNumbers[idx], read->buffers[idx]);
+      }
+    }
+    read->done(read->arg);
+    delete read;
+    count++;
+  }
+  return count;
+}
+
+void Disk::setDurability(DurabilityPolicy durability) {
+  this->durability = durability;
+}
+
+DurabilityPolicy Disk::getDurability() {
+  return this->durability;
+}
+
+int Disk::numberOfBlocks() {
+  return this->imageFileSize / this->blockSize;
+}
+
+void Disk::readBlock(int blockNumber, void *buffer) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
+    cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  ret = read(fd, buffer, this->blockSize);
+  if (lookupJournal(blockNumber, buffer)) {
+    return;
+  }
+  if (cache != NULL && cache->lookup(blockNumber, buffer)) {
+    return;
+  }
+  if (mapping != NULL) {
+    memcpy(buffer, mapping + (size_t) blockNumber * this->blockSize, this->blockSize);
+    return;
+  }
+
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  int ret = pread(this->imageFileDescriptor, buffer, this->blockSize, offset);
   if (ret != this->blockSize) {
+    perror("read::pread");
     cerr << "Could not read file" << endl;
     exit(1);
   }
 
-  close(fd);
+  if (cache != NULL) {
+    cache->fill(blockNumber, buffer);
+  }
 }
 
 void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  if (isInTransaction) {
+  Txn *txn = currentTransaction();
+  if (txn != NULL && !acquireBlock(txn, blockNumber)) {
+    return;
+  }
+
+  if (journaling()) {
+    if (txn == NULL) {
+      // a write outside of a transaction commits on its own
+      Txn single(this, 0);
+      logBlock(&single, blockNumber, buffer);
+      commitJournal(&single);
+      sync();
+    } else {
+      logBlock(txn, blockNumber, buffer);
+    }
+    return;
+  }
+
+  if (txn != NULL) {
     struct UndoRecord undoRecord;
     undoRecord.blockNumber = blockNumber;
     undoRecord.blockData = new unsigned char[blockSize];
     this->readBlock(blockNumber, undoRecord.blockData);
-    undoLog.push_front(undoRecord);
+    txn->undoLog.push_front(undoRecord);
+
+    if (cache != NULL && writeBack) {
+      cache->update(blockNumber, buffer, true);
+      return;
+    }
   }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+
+  pwriteBlock(blockNumber, buffer);
+  if (cache != NULL) {
+    cache->update(blockNumber, buffer, false);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("write::lseek");
-    cerr << "Could not seek to file" << endl;
+  if (durability == DURABILITY_ALWAYS) {
+    syncImage(false);
+  } else if (txn == NULL) {
+    // a write outside of a transaction commits on its own
+    flush();
+  }
+}
+
+void Disk::writeUnloggedBlock(int blockNumber, void *buffer) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
+    cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  ret = write(fd, buffer, this->blockSize);
+  if (journaling()) {
+    // A block the journal still has a record of could have that record
+    // replayed over it after a crash, so it has to go through the
+    // journal too
+    dthread_mutex_lock(&journalLock);
+    bool journaled = journaledBlocks.count(blockNumber) > 0;
+    dthread_mutex_unlock(&journalLock);
+    if (journaled) {
+      writeBlock(blockNumber, buffer);
+      return;
+    }
+  }
+
+  pwriteBlock(blockNumber, buffer);
+  if (cache != NULL) {
+    cache->update(blockNumber, buffer, false);
+  }
+  if (durability == DURABILITY_ALWAYS) {
+    syncImage(false);
+  } else if (journaling()) {
+    // Only once the block is in the image, so a commit that clears the
+    // flag and syncs in between can't leave the next commit, the one
+    // that makes the block reachable, thinking there's nothing to sync
+    dthread_mutex_lock(&journalLock);
+    unloggedWrites = true;
+    dthread_mutex_unlock(&journalLock);
+  }
+}
+
+void Disk::readBlocks(const vector<int> &blockNumbers, const vector<void *> &buffers) {
+  checkBlockNumbers(blockNumbers);
+
+  vector<int> missing;
+  vector<void *> missingBuffers;
+  lookupBlocks(blockNumbers, buffers, missing, missingBuffers);
+  transferBlocks(missing, missingBuffers, false);
+  if (cache != NULL) {
+    for (size_t idx = 0; idx < missing.size(); idx++) {
+      cache->fill(missing[idx], missingBuffers[idx]);
+    }
+  }
+}
+
+void Disk::lookupBlocks(const vector<int> &blockNumbers, const vector<void *> &buffers,
+                        vector<int> &missing, vector<void *> &missingBuffers) {
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (lookupJournal(blockNumbers[idx], buffers[idx])) {
+      continue;
+    }
+    if (cache == NULL || !cache->lookup(blockNumbers[idx], buffers[idx])) {
+      missing.push_back(blockNumbers[idx]);
+      missingBuffers.push_back(buffers[idx]);
+    }
+  }
+}
+
+void Disk::writeBlocks(const vector<int> &blockNumbers, const vector<const void *> &buffers) {
+  checkBlockNumbers(blockNumbers);
+  if (blockNumbers.empty()) {
+    return;
+  }
+
+  // taking the blocks in order keeps two transactions writing the same
+  // set from each holding some of it
+  Txn *txn = currentTransaction();
+  if (txn != NULL) {
+    vector<int> sorted(blockNumbers);
+    sort(sorted.begin(), sorted.end());
+    for (size_t idx = 0; idx < sorted.size(); idx++) {
+      if (!acquireBlock(txn, sorted[idx])) {
+        return;
+      }
+    }
+  }
+
+  if (journaling()) {
+    Txn single(this, 0);
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      logBlock(txn != NULL ? txn : &single, blockNumbers[idx], buffers[idx]);
+    }
+    if (txn == NULL) {
+      commitJournal(&single);
+      sync();
+    }
+    return;
+  }
+
+  if (txn != NULL) {
+    vector<void *> oldData;
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      oldData.push_back(new unsigned char[blockSize]);
+    }
+    this->readBlocks(blockNumbers, oldData);
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      struct UndoRecord undoRecord;
+      undoRecord.blockNumber = blockNumbers[idx];
+      undoRecord.blockData = (unsigned char *) oldData[idx];
+      txn->undoLog.push_front(undoRecord);
+    }
+
+    if (cache != NULL && writeBack) {
+      for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+        cache->update(blockNumbers[idx], buffers[idx], true);
+      }
+      return;
+    }
+  }
+
+  vector<void *> data;
+  for (size_t idx = 0; idx < buffers.size(); idx++) {
+    data.push_back(const_cast<void *>(buffers[idx]));
+  }
+  transferBlocks(blockNumbers, data, true, durability == DURABILITY_ALWAYS);
+  if (cache != NULL) {
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      cache->update(blockNumbers[idx], buffers[idx], false);
+    }
+  }
+
+  if (durability != DURABILITY_ALWAYS && txn == NULL) {
+    flush();
+  }
+}
+
+void Disk::checkBlockNumbers(const vector<int> &blockNumbers) {
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (blockNumbers[idx] < 0 || blockNumbers[idx] >= this->numberOfBlocks()) {
+      cerr << "Invalid block number " << blockNumbers[idx] << endl;
+      exit(1);
+    }
+  }
+}
+
+// Sorting by block number (and by position for repeats, so the last copy
+// of a block listed twice is written last) lines up the runs of
+// consecutive blocks, each of which becomes a single preadv or pwritev.
+void Disk::transferBlocks(const vector<int> &blockNumbers, const vector<void *> &buffers,
+                          bool write, bool sync) {
+  bool dataOnly = durability != DURABILITY_ALWAYS;
+  // in list order, so the last copy of a repeated block wins here too
+  if (mapping != NULL) {
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      if (write) {
+        copyToMapping(blockNumbers[idx], buffers[idx]);
+      } else {
+        memcpy(buffers[idx], mapping + (size_t) blockNumbers[idx] * this->blockSize, this->blockSize);
+      }
+    }
+    if (sync) {
+      syncImage(dataOnly);
+    }
+    return;
+  }
+
+  vector<struct iovec> iov;
+  vector<BlockRun> runs;
+  blockRuns(blockNumbers, buffers, this->blockSize, iov, runs);
+
+  // Runs of a batch run in any order, so a block listed twice can't be
+  // left to them
+  IoRing *ring = threadRing();
+  if (ring != NULL && !(write && hasRepeats(blockNumbers))) {
+    IoBatch batch;
+    for (size_t idx = 0; idx < runs.size(); idx++) {
+      if (write) {
+        batch.writev(this->imageFileDescriptor, &iov[runs[idx].first], runs[idx].count, runs[idx].offset);
+      } else {
+        batch.readv(this->imageFileDescriptor, &iov[runs[idx].first], runs[idx].count, runs[idx].offset);
+      }
+    }
+    if (sync) {
+      batch.fsync(this->imageFileDescriptor, dataOnly);
+    }
+    ring->run(&batch);
+    if (batch.error() != 0) {
+      errno = batch.error();
+      perror(write ? "write::io_uring" : "read::io_uring");
+      cerr << (write ? "Could not write file" : "Could not read file") << endl;
+      exit(1);
+    }
+    return;
+  }
+
+  for (size_t idx = 0; idx < runs.size(); idx++) {
+    ssize_t expected = (ssize_t) runs[idx].count * this->blockSize;
+    ssize_t ret;
+    if (write) {
+      ret = pwritev(this->imageFileDescriptor, &iov[runs[idx].first], runs[idx].count, runs[idx].offset);
+    } else {
+      ret = preadv(this->imageFileDescriptor, &iov[runs[idx].first], runs[idx].count, runs[idx].offset);
+    }
+    if (ret != expected) {
+      perror(write ? "write::pwritev" : "read::preadv");
+      cerr << (write ? "Could not write file" : "Could not read file") << endl;
+      exit(1);
+    }
+  }
+  if (sync) {
+    syncImage(dataOnly);
+  }
+}
+
+void Disk::pwriteBlock(int blockNumber, void *buffer) {
+  if (mapping != NULL) {
+    copyToMapping(blockNumber, buffer);
+    return;
+  }
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  int ret = pwrite(this->imageFileDescriptor, buffer, this->blockSize, offset);
   if (ret != this->blockSize) {
+    perror("write::pwrite");
     cerr << "Could not write file" << endl;
     exit(1);
   }
-  fsync(fd);
-  close(fd);
 }
 
-void Disk::beginTransaction() {
-  if (isInTransaction) {
+// Only this transaction's blocks, another one's dirty blocks aren't
+// committed yet
+void Disk::writeDirtyBlocks(Txn *txn, bool sync) {
+  vector<int> blocks;
+  vector<void *> buffers;
+  set<int>::iterator iter;
+  for (iter = txn->ownedBlocks.begin(); iter != txn->ownedBlocks.end(); iter++) {
+    unsigned char *buffer = new unsigned char[blockSize];
+    if (cache->peek(*iter, buffer)) {
+      blocks.push_back(*iter);
+      buffers.push_back(buffer);
+    } else {
+      delete [] buffer;
+    }
+  }
+  transferBlocks(blocks, buffers, true, sync);
+  for (size_t idx = 0; idx < blocks.size(); idx++) {
+    cache->markClean(blocks[idx]);
+    delete [] (unsigned char *) buffers[idx];
+  }
+}
+
+// With a journal, a commit is durable once its journal record is
+void Disk::flush() {
+  if (durability == DURABILITY_COMMIT && journaling()) {
+    flushJournal(true);
+  } else if (durability == DURABILITY_COMMIT) {
+    syncImage(true);
+  } else if (durability == DURABILITY_GROUP) {
+    groupFlush();
+  }
+}
+
+// Every caller's writes have already reached the file when it takes a
+// ticket, so one fdatasync started after ticket N makes every commit up
+// to N durable. Whoever finds no flush running becomes the leader and
+// flushes on behalf of all tickets handed out so far; everyone else waits
+// for a flush that started after they arrived.
+void Disk::groupFlush() {
+  dthread_mutex_lock(&flushLock);
+  unsigned long ticket = ++flushesRequested;
+  while (flushesCompleted < ticket) {
+    if (flushInProgress) {
+      dthread_cond_wait(&flushDone, &flushLock);
+      continue;
+    }
+    flushInProgress = true;
+    unsigned long target = flushesRequested;
+    dthread_mutex_unlock(&flushLock);
+    if (journaling()) {
+      flushJournal(true);
+    } else {
+      syncImage(true);
+    }
+    dthread_mutex_lock(&flushLock);
+    flushInProgress = false;
+    flushesCompleted = target;
+    dthread_cond_broadcast(&flushDone);
+  }
+  dthread_mutex_unlock(&flushLock);
+}
+
+void Disk::addObserver(DiskObserver *observer) {
+  observers.push_back(observer);
+}
+
+Disk::Txn::Txn(Disk *disk, unsigned long id) {
+  this->disk = disk;
+  this->txnId = id;
+  this->waitingFor = -1;
+  this->aborted = false;
+}
+
+unsigned long Disk::Txn::id() {
+  return txnId;
+}
+
+bool Disk::Txn::commit(bool flush) {
+  if (disk->currentTransaction() != this) {
+    cerr << "Transaction " << txnId << " can only be committed by the thread that began it" << endl;
+    exit(1);
+  }
+  return disk->commit(flush);
+}
+
+void Disk::Txn::rollback() {
+  if (disk->currentTransaction() != this) {
+    cerr << "Transaction " << txnId << " can only be rolled back by the thread that began it" << endl;
+    exit(1);
+  }
+  disk->rollback();
+}
+
+Disk::Txn *Disk::beginTransaction() {
+  if (currentTransaction() != NULL) {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
-  isInTransaction = true;
+  dthread_mutex_lock(&ownersLock);
+  Txn *txn = new Txn(this, ++transactionsStarted);
+  dthread_mutex_unlock(&ownersLock);
+  pthread_setspecific(currentTxn, txn);
+  return txn;
 }
 
-void Disk::commit() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    delete [] iter->blockData;
+Disk::Txn *Disk::currentTransaction() {
+  return (Txn *) pthread_getspecific(currentTxn);
+}
+
+bool Disk::acquireBlock(Txn *txn, int blockNumber) {
+  // only txn's own thread changes its ownedBlocks, and nothing sets
+  // aborted while that thread is out here
+  if (txn->aborted) {
+    return false;
   }
-  undoLog.clear();
+  if (txn->ownedBlocks.count(blockNumber) > 0) {
+    return true;
+  }
+
+  dthread_mutex_lock(&ownersLock);
+  while (!txn->aborted) {
+    map<int, Txn *>::iterator owner = blockOwners.find(blockNumber);
+    if (owner == blockOwners.end()) {
+      blockOwners[blockNumber] = txn;
+      txn->ownedBlocks.insert(blockNumber);
+      break;
+    }
+
+    // Waiting would close a cycle when the chain of waits from the owner
+    // comes back to txn. The youngest transaction on it is aborted, unless
+    // one already is and is on its way to release its blocks.
+    Txn *youngest = txn;
+    bool cycle = false;
+    for (map<int, Txn *>::iterator next = owner; next != blockOwners.end();
+         next = blockOwners.find(next->second->waitingFor)) {
+      if (next->second == txn) {
+        cycle = true;
+        break;
+      }
+      if (next->second->aborted) {
+        break;
+      }
+      if (next->second->txnId > youngest->txnId) {
+        youngest = next->second;
+      }
+    }
+    if (cycle) {
+      youngest->aborted = true;
+      if (youngest == txn) {
+        break;
+      }
+      dthread_cond_broadcast(&ownersChanged);
+    }
+    txn->waitingFor = blockNumber;
+    dthread_cond_wait(&ownersChanged, &ownersLock);
+    txn->waitingFor = -1;
+  }
+  bool acquired = !txn->aborted;
+  dthread_mutex_unlock(&ownersLock);
+  return acquired;
+}
+
+void Disk::endTransaction(Txn *txn) {
+  dthread_mutex_lock(&ownersLock);
+  set<int>::iterator iter;
+  for (iter = txn->ownedBlocks.begin(); iter != txn->ownedBlocks.end(); iter++) {
+    blockOwners.erase(*iter);
+  }
+  if (!txn->ownedBlocks.empty()) {
+    dthread_cond_broadcast(&ownersChanged);
+  }
+  dthread_mutex_unlock(&ownersLock);
+
+  pthread_setspecific(currentTxn, NULL);
+  delete txn;
+}
+
+bool Disk::commit(bool flush) {
+  Txn *txn = currentTransaction();
+  if (txn == NULL) {
+    cerr << "There is no transaction to commit" << endl;
+    exit(1);
+  }
+  if (txn->aborted) {
+    rollback();
+    return false;
+  }
+
+  for (size_t idx = 0; idx < observers.size(); idx++) {
+    observers[idx]->beforeCommit();
+  }
+
+  // writing a write-back cache's blocks can take the flush along, unless
+  // it's a group commit's to share
+  bool synced = false;
+  if (journaling()) {
+    commitJournal(txn);
+  } else {
+    deque<struct UndoRecord>::iterator iter;
+    for (iter = txn->undoLog.begin(); iter != txn->undoLog.end(); iter++) {
+      delete [] iter->blockData;
+    }
+    txn->undoLog.clear();
+    if (cache != NULL && writeBack) {
+      synced = flush && (durability == DURABILITY_ALWAYS || durability == DURABILITY_COMMIT);
+      writeDirtyBlocks(txn, synced);
+    }
+  }
+  endTransaction(txn);
+
+  if (flush && !synced) {
+    sync();
+  }
+  return true;
+}
+
+void Disk::sync() {
+  if (durability == DURABILITY_ALWAYS && journaling()) {
+    flushJournal(false);
+  } else if (durability == DURABILITY_ALWAYS) {
+    syncImage(false);
+  } else {
+    flush();
+  }
+}
+
+bool Disk::inTransaction() {
+  return currentTransaction() != NULL;
 }
 
 void Disk::rollback() {
-  isInTransaction = false;
+  Txn *txn = currentTransaction();
+  if (txn == NULL) {
+    cerr << "There is no transaction to roll back" << endl;
+    exit(1);
+  }
+
   deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    this->writeBlock(iter->blockNumber, iter->blockData);
-    delete [] iter->blockData;
+  if (journaling()) {
+    // nothing from this transaction left memory, except blocks written
+    // with writeUnloggedBlock, which nothing points to
+    map<int, unsigned char *>::iterator block;
+    for (block = txn->redoSet.begin(); block != txn->redoSet.end(); block++) {
+      delete [] block->second;
+    }
+    txn->redoSet.clear();
+  } else if (cache != NULL && writeBack) {
+    // Nothing from this transaction reached the image, so the oldest undo
+    // record of each block (applied last) matches what is on disk.
+    for (iter = txn->undoLog.begin(); iter != txn->undoLog.end(); iter++) {
+      cache->update(iter->blockNumber, iter->blockData, false);
+      delete [] iter->blockData;
+    }
+    txn->undoLog.clear();
+  } else {
+    for (iter = txn->undoLog.begin(); iter != txn->undoLog.end(); iter++) {
+      this->pwriteBlock(iter->blockNumber, iter->blockData);
+      if (cache != NULL) {
+        cache->update(iter->blockNumber, iter->blockData, false);
+      }
+      delete [] iter->blockData;
+    }
+    txn->undoLog.clear();
+    if (durability == DURABILITY_ALWAYS) {
+      syncImage(false);
+    } else {
+      flush();
+    }
+  }
+  endTransaction(txn);
+
+  for (size_t idx = 0; idx < observers.size(); idx++) {
+    observers[idx]->afterRollback();
+  }
+}
+
+void Disk::enableJournal() {
+  this->journalFileDescriptor = open(journalFile().c_str(), O_RDWR | O_CREAT, 0644);
+  if (this->journalFileDescriptor < 0) {
+    cerr << "could not open " << journalFile() << endl;
+    exit(1);
+  }
+  // held until the Disk closes the journal, so nobody else replays or
+  // empties it meanwhile
+  if (flock(this->journalFileDescriptor, LOCK_EX | LOCK_NB) != 0) {
+    cerr << journalFile() << " is in use by another process" << endl;
+    exit(1);
+  }
+
+  if (dthread_create(&checkpointer, NULL, checkpointMain, this) != 0) {
+    cerr << "Could not start the journal checkpoint thread" << endl;
+    exit(1);
+  }
+}
+
+void Disk::flushJournal(bool dataOnly) {
+  // every record up to here has been written, so the flush covers it
+  dthread_mutex_lock(&journalLock);
+  unsigned long sequence = journalSequence;
+  dthread_mutex_unlock(&journalLock);
+
+  if (dataOnly) {
+    fdatasync(this->journalFileDescriptor);
+  } else {
+    fsync(this->journalFileDescriptor);
+  }
+
+  dthread_mutex_lock(&journalLock);
+  if (sequence > durableSequence) {
+    durableSequence = sequence;
+    if (journalSize >= JOURNAL_CHECKPOINT_BYTES) {
+      dthread_cond_signal(&checkpointWanted);
+    }
+  }
+  dthread_mutex_unlock(&journalLock);
+}
+
+bool Disk::journaling() {
+  return this->journalFileDescriptor >= 0;
+}
+
+string Disk::journalFile() {
+  return this->imageFile + ".journal";
+}
+
+void Disk::recoverJournal() {
+  bool readOnly = (fcntl(this->imageFileDescriptor, F_GETFL) & O_ACCMODE) == O_RDONLY;
+  int fd = open(journalFile().c_str(), readOnly ? O_RDONLY : O_RDWR);
+  if (fd < 0) {
+    return;
+  }
+  struct stat stat;
+  if (fstat(fd, &stat) != 0 || stat.st_size == 0) {
+    close(fd);
+    return;
+  }
+  if (readOnly) {
+    this->journalFileDescriptor = fd;
+    replayJournal(false);
+    this->journalFileDescriptor = -1;
+    close(fd);
+    return;
+  }
+  // the journal of a Disk that is running is that Disk's to replay
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    cerr << journalFile() << " is in use by another process, leaving it alone" << endl;
+    close(fd);
+    return;
+  }
+
+  this->journalFileDescriptor = fd;
+  replayJournal(true);
+  this->journalFileDescriptor = -1;
+  close(fd);
+}
+
+bool Disk::lookupJournal(int blockNumber, void *buffer) {
+  // a read-only Disk keeps the blocks of a journal it can't replay
+  if (!journaling() && checkpointSet.empty()) {
+    return false;
+  }
+
+  Txn *txn = currentTransaction();
+  if (txn != NULL) {
+    map<int, unsigned char *>::iterator found = txn->redoSet.find(blockNumber);
+    if (found != txn->redoSet.end()) {
+      memcpy(buffer, found->second, blockSize);
+      return true;
+    }
+  }
+
+  dthread_mutex_lock(&journalLock);
+  map<int, JournaledBlock>::iterator found = checkpointSet.find(blockNumber);
+  bool hit = found != checkpointSet.end();
+  if (hit) {
+    memcpy(buffer, found->second.blockData, blockSize);
+  }
+  dthread_mutex_unlock(&journalLock);
+  return hit;
+}
+
+void Disk::logBlock(Txn *txn, int blockNumber, const void *buffer) {
+  map<int, unsigned char *>::iterator found = txn->redoSet.find(blockNumber);
+  if (found == txn->redoSet.end()) {
+    found = txn->redoSet.insert(make_pair(blockNumber, new unsigned char[blockSize])).first;
+  }
+  memcpy(found->second, buffer, blockSize);
+}
+
+// Appends txn's record. The caller flushes it.
+void Disk::commitJournal(Txn *txn) {
+  map<int, unsigned char *> &redoSet = txn->redoSet;
+
+  // Blocks written with writeUnloggedBlock have to reach the image before
+  // a journal record that makes them reachable reaches the journal
+  dthread_mutex_lock(&journalLock);
+  bool unlogged = unloggedWrites;
+  unloggedWrites = false;
+  dthread_mutex_unlock(&journalLock);
+  if (unlogged && durability != DURABILITY_NONE) {
+    syncImage(true);
+  }
+  if (redoSet.empty()) {
+    return;
+  }
+
+  size_t count = redoSet.size();
+  vector<unsigned char> record(sizeof(JournalHeader) + count * (sizeof(int) + blockSize));
+  unsigned char *numbers = record.data() + sizeof(JournalHeader);
+  unsigned char *blocks = numbers + count * sizeof(int);
+  map<int, unsigned char *>::iterator iter;
+  size_t idx = 0;
+  for (iter = redoSet.begin(); iter != redoSet.end(); iter++, idx++) {
+    memcpy(numbers + idx * sizeof(int), &iter->first, sizeof(int));
+    memcpy(blocks + idx * blockSize, iter->second, blockSize);
+  }
+  JournalHeader header;
+  header.magic = JOURNAL_MAGIC;
+  header.count = count;
+  header.checksum = journalChecksum(numbers, record.size() - sizeof(JournalHeader));
+  memcpy(record.data(), &header, sizeof(header));
+
+  dthread_mutex_lock(&journalLock);
+  ssize_t ret = pwrite(this->journalFileDescriptor, record.data(), record.size(), journalSize);
+  if (ret != (ssize_t) record.size()) {
+    perror("write::pwrite");
+    cerr << "Could not write journal" << endl;
+    exit(1);
+  }
+  journalSize += record.size();
+
+  unsigned long sequence = ++journalSequence;
+  for (iter = redoSet.begin(); iter != redoSet.end(); iter++) {
+    journaledBlocks.insert(iter->first);
+    map<int, JournaledBlock>::iterator found = checkpointSet.find(iter->first);
+    if (found != checkpointSet.end()) {
+      delete [] found->second.blockData;
+    }
+    JournaledBlock block;
+    block.blockData = iter->second;
+    block.sequence = sequence;
+    checkpointSet[iter->first] = block;
+    if (cache != NULL) {
+      cache->update(iter->first, iter->second, false);
+    }
+  }
+  redoSet.clear();
+
+  if (journalSize >= JOURNAL_LIMIT_BYTES) {
+    checkpoint(false);
+  } else if (journalSize >= JOURNAL_CHECKPOINT_BYTES) {
+    dthread_cond_signal(&checkpointWanted);
+  }
+  dthread_mutex_unlock(&journalLock);
+}
+
+// Applies every complete record, in order, then empties the journal.
+// Records are only ever appended, so the first bad one is where a crash
+// cut the last commit short.
+void Disk::replayJournal(bool toImage) {
+  off_t offset = 0;
+  int replayed = 0;
+  while (true) {
+    JournalHeader header;
+    if (pread(this->journalFileDescriptor, &header, sizeof(header), offset) != (ssize_t) sizeof(header) ||
+        header.magic != JOURNAL_MAGIC || header.count == 0 ||
+        header.count > (unsigned int) numberOfBlocks()) {
+      break;
+    }
+    vector<unsigned char> body(header.count * (sizeof(int) + blockSize));
+    if (pread(this->journalFileDescriptor, body.data(), body.size(), offset + sizeof(header)) != (ssize_t) body.size() ||
+        journalChecksum(body.data(), body.size()) != header.checksum) {
+      break;
+    }
+
+    vector<int> blockNumbers(header.count);
+    memcpy(blockNumbers.data(), body.data(), header.count * sizeof(int));
+    vector<void *> buffers;
+    for (unsigned int idx = 0; idx < header.count; idx++) {
+      buffers.push_back(body.data() + header.count * sizeof(int) + idx * blockSize);
+    }
+    checkBlockNumbers(blockNumbers);
+    offset += sizeof(header) + body.size();
+    replayed++;
+    if (!toImage) {
+      for (unsigned int idx = 0; idx < header.count; idx++) {
+        JournaledBlock &block = checkpointSet[blockNumbers[idx]];
+        delete [] block.blockData;
+        block.blockData = new unsigned char[blockSize];
+        memcpy(block.blockData, buffers[idx], blockSize);
+        block.sequence = replayed;
+      }
+      continue;
+    }
+    transferBlocks(blockNumbers, buffers, true);
+    if (cache != NULL) {
+      for (unsigned int idx = 0; idx < header.count; idx++) {
+        cache->update(blockNumbers[idx], buffers[idx], false);
+      }
+    }
+  }
+
+  if (!toImage) {
+    return;
+  }
+  if (replayed > 0) {
+    cerr << "Replayed " << replayed << " transactions from the journal" << endl;
+    syncImage(false);
+  }
+  if (ftruncate(this->journalFileDescriptor, 0) != 0) {
+    perror("ftruncate");
+    cerr << "Could not empty the journal" << endl;
+    exit(1);
+  }
+  fsync(this->journalFileDescriptor);
+  journalSize = 0;
+}
+
+bool Disk::checkpoint(bool background) {
+  while (checkpointInProgress) {
+    dthread_cond_wait(&checkpointDone, &journalLock);
+  }
+  checkpointInProgress = true;
+
+  // A block copied into the image before its record is durable can't be
+  // redone if the copy is cut short. Without a flush policy nothing is
+  // durable anyway.
+  if (durability == DURABILITY_NONE) {
+    durableSequence = journalSequence;
+  } else if (!background && durableSequence < journalSequence) {
+    fdatasync(this->journalFileDescriptor);
+    durableSequence = journalSequence;
+  }
+
+  // Write copies, so commits can replace the blocks meanwhile
+  vector<int> blockNumbers;
+  vector<void *> buffers;
+  vector<unsigned long> sequences;
+  map<int, JournaledBlock>::iterator iter;
+  for (iter = checkpointSet.begin(); iter != checkpointSet.end(); iter++) {
+    if (iter->second.sequence > durableSequence) {
+      continue;
+    }
+    unsigned char *copy = new unsigned char[blockSize];
+    memcpy(copy, iter->second.blockData, blockSize);
+    blockNumbers.push_back(iter->first);
+    buffers.push_back(copy);
+    sequences.push_back(iter->second.sequence);
+  }
+
+  if (!blockNumbers.empty()) {
+    if (background) {
+      dthread_mutex_unlock(&journalLock);
+    }
+    transferBlocks(blockNumbers, buffers, true);
+    if (durability != DURABILITY_NONE) {
+      syncImage(true);
+    }
+    if (background) {
+      dthread_mutex_lock(&journalLock);
+    }
+  }
+
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    iter = checkpointSet.find(blockNumbers[idx]);
+    if (iter->second.sequence == sequences[idx]) {
+      delete [] iter->second.blockData;
+      checkpointSet.erase(iter);
+    }
+    delete [] (unsigned char *) buffers[idx];
+  }
+
+  // The journal can only be emptied once all of it is in the image, and
+  // that has to be durable before anything overwrites a journaled block
+  // in place
+  if (checkpointSet.empty() && journalSize > 0) {
+    if (ftruncate(this->journalFileDescriptor, 0) != 0) {
+      perror("ftruncate");
+      cerr << "Could not empty the journal" << endl;
+      exit(1);
+    }
+    if (durability != DURABILITY_NONE) {
+      fsync(this->journalFileDescriptor);
+    }
+    journalSize = 0;
+    journaledBlocks.clear();
+  }
+
+  checkpointInProgress = false;
+  dthread_cond_broadcast(&checkpointDone);
+  return !blockNumbers.empty();
+}
+
+void *Disk::checkpointMain(void *arg) {
+  ((Disk *) arg)->checkpointLoop();
+  return NULL;
+}
+
+void Disk::checkpointLoop() {
+  dthread_mutex_lock(&journalLock);
+  while (!stopCheckpointer) {
+    // with nothing durable to copy, wait for the next flush
+    if (journalSize < JOURNAL_CHECKPOINT_BYTES || !checkpoint(true)) {
+      dthread_cond_wait(&checkpointWanted, &journalLock);
+    }
   }
-  undoLog.clear();
+  dthread_mutex_unlock(&journalLock);
 }
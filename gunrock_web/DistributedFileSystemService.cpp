@@ -12,16 +12,194 @@
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
+#include "HttpUtils.h"
 #include "ufs.h"
 #include "WwwFormEncodedDict.h"
 
 using namespace std;
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+// A GET with more ranges than this, or ranges that add up to more than the
+// file, gets the whole file instead
+#define MAX_BYTE_RANGES 16
+
+DistributedFileSystemService::DistributedFileSystemService(Disk *disk) : HttpService("/ds3/") {
+  this->fileSystem = new LocalFileSystem(disk);
+  pthread_rwlock_init(&this->lock, NULL);
 }  
 
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
+  locked(&DistributedFileSystemService::getLocked, request, response, false);
+}
+
+void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  locked(&DistributedFileSystemService::putLocked, request, response, true);
+  this->fileSystem->disk->sync();
+}
+
+void DistributedFileSystemService::post(HTTPRequest *request, HTTPResponse *response) {
+  locked(&DistributedFileSystemService::putLocked, request, response, true);
+  this->fileSystem->disk->sync();
+}
+
+void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
+  locked(&DistributedFileSystemService::delLocked, request, response, true);
+  this->fileSystem->disk->sync();
+}
+
+FileSystemBodySource::FileSystemBodySource(DistributedFileSystemService *service, int inodeNumber, const inode_t &inode) {
+  this->service = service;
+  this->inodeNumber = inodeNumber;
+  this->inode = inode;
+  this->size = 0;
+  this->part = 0;
+  this->consumed = 0;
+}
+
+void FileSystemBodySource::addRange(long offset, long length) {
+  if (length > 0) {
+    Part range = {offset, length, ""};
+    parts.push_back(range);
+    size += length;
+  }
+}
+
+void FileSystemBodySource::addText(const string &text) {
+  if (!text.empty()) {
+    Part part = {-1, (long) text.size(), text};
+    parts.push_back(part);
+    size += text.size();
+  }
+}
+
+long FileSystemBodySource::length() {
+  return size;
+}
+
+int FileSystemBodySource::read(char *buffer, int size) {
+  if (part >= parts.size()) {
+    return 0;
+  }
+
+  LocalFileSystem *fileSystem = service->fileSystem;
+  int count = 0;
+  pthread_rwlock_rdlock(&service->lock);
+  try {
+    inode_t current;
+    if (fileSystem->stat(inodeNumber, &current) != 0 || memcmp(&current, &inode, sizeof(inode)) != 0) {
+      throw SocketReadError();
+    }
+
+    while (count < size && part < parts.size()) {
+      Part &next = parts[part];
+      int bytes = min((long) (size - count), next.length - consumed);
+      if (next.offset < 0) {
+        memcpy(buffer + count, next.text.data() + consumed, bytes);
+      } else {
+        bytes = fileSystem->pread(inodeNumber, buffer + count, bytes, next.offset + consumed);
+        if (bytes <= 0) {
+          throw SocketReadError();
+        }
+      }
+      count += bytes;
+      consumed += bytes;
+      if (consumed == next.length) {
+        part++;
+        consumed = 0;
+      }
+    }
+  } catch (...) {
+    pthread_rwlock_unlock(&service->lock);
+    throw;
+  }
+  pthread_rwlock_unlock(&service->lock);
+  return count;
+}
+
+FileSystemBodySink::FileSystemBodySink(DistributedFileSystemService *service) {
+  this->service = service;
+  this->used = 0;
+}
+
+FileSystemBodySink::~FileSystemBodySink() {
+  if (!session.blocks.empty()) {
+    pthread_rwlock_wrlock(&service->lock);
+    service->fileSystem->abortWrite(session);
+    pthread_rwlock_unlock(&service->lock);
+  }
+}
+
+void FileSystemBodySink::write(const char *data, int size) {
+  while (size > 0) {
+    int bytes = min(size, UFS_BLOCK_SIZE - used);
+    memcpy(block + used, data, bytes);
+    used += bytes;
+    data += bytes;
+    size -= bytes;
+
+    if (used == UFS_BLOCK_SIZE) {
+      // Once the upload has failed the rest of the body is only drained.
+      // appendBlock only allocates a block and writes it while nothing
+      // points at it, so the lock is only taken shared, to keep a rollback
+      // from reloading the bitmaps underneath it. Other requests go on
+      // while the body streams in.
+      if (session.error == 0) {
+        pthread_rwlock_rdlock(&service->lock);
+        service->fileSystem->appendBlock(session, block, used);
+        pthread_rwlock_unlock(&service->lock);
+      }
+      used = 0;
+    }
+  }
+}
+
+int FileSystemBodySink::commit(int inodeNumber) {
+  if (used > 0) {
+    service->fileSystem->appendBlock(session, block, used);
+    used = 0;
+  }
+  return service->fileSystem->commitWrite(inodeNumber, session);
+}
+
+BodySink *DistributedFileSystemService::openBodySink(HTTPRequest *request) {
+  // a PUT of part of a file is written in place, from the whole body
+  if (!request->isPut() || request->hasHeader("Content-Range")) {
+    return NULL;
+  }
+  return new FileSystemBodySink(this);
+}
+
+long DistributedFileSystemService::responseSize(string path) {
+  // a write holding the lock would hold up accepting connections
+  if (pthread_rwlock_tryrdlock(&this->lock) != 0) {
+    return -1;
+  }
+  inode_t inode;
+  int inodeNumber = this->fileSystem->resolvePath(path.substr(this->pathPrefix().length()));
+  long size = 0; // errors have no body
+  if (inodeNumber >= 0 && this->fileSystem->stat(inodeNumber, &inode) == 0) {
+    // a directory listing is about as big as the directory
+    size = inode.size;
+  }
+  pthread_rwlock_unlock(&this->lock);
+  return size;
+}
+
+void DistributedFileSystemService::locked(RequestHandler handler, HTTPRequest *request, HTTPResponse *response, bool exclusive) {
+  if (exclusive) {
+    pthread_rwlock_wrlock(&this->lock);
+  } else {
+    pthread_rwlock_rdlock(&this->lock);
+  }
+  try {
+    (this->*handler)(request, response);
+  } catch (...) {
+    pthread_rwlock_unlock(&this->lock);
+    throw;
+  }
+  pthread_rwlock_unlock(&this->lock);
+}
+
+void DistributedFileSystemService::getLocked(HTTPRequest *request, HTTPResponse *response) {
     string fullPath = request->getPath();  // Full path including /ds3/
     string path = fullPath.substr(5);  // Remove /ds3/ part
     
@@ -29,24 +207,9 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
         throw ClientError::badRequest();
     }
     
-    // Split path into components
-    vector<string> components;
-    stringstream ss(path);
-    string item;
-    while (getline(ss, item, '/')) {
-        components.push_back(item);
-    }
-
-    int parentInodeNumber = 0;  // root directory inode number
-    int inodeNumber = -1;
-    
-    // Traverse the path to find the inode number of the requested file/directory
-    for (size_t i = 0; i < components.size(); ++i) {
-        inodeNumber = this->fileSystem->lookup(parentInodeNumber, components[i]);
-        if (inodeNumber < 0) {
-            throw ClientError::notFound();
-        }
-        parentInodeNumber = inodeNumber;
+    int inodeNumber = this->fileSystem->resolvePath(path);
+    if (inodeNumber < 0) {
+        throw ClientError::notFound();
     }
 
     inode_t inode;
@@ -56,16 +219,8 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
     }
 
     if (inode.type == UFS_REGULAR_FILE) {
-        // Handle file read
-        char *buffer = new char[inode.size];
-        int bytesRead = this->fileSystem->read(inodeNumber, buffer, inode.size);
-        if (bytesRead < 0) {
-            delete[] buffer;
-            throw ClientError::notFound();
-        }
-        response->setStatus(200);  // HTTP 200 OK
-        response->setBody(string(buffer, bytesRead));
-        delete[] buffer;
+        // Handle file read, the blocks are read as the response goes out
+        getFile(request, response, inodeNumber, inode);
     } else if (inode.type == UFS_DIRECTORY) {
         // Handle directory listing
         stringstream directoryContent;
@@ -99,7 +254,61 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
 }
 
 
-void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+void DistributedFileSystemService::getFile(HTTPRequest *request, HTTPResponse *response, int inodeNumber, const inode_t &inode) {
+    FileSystemBodySource *source = new FileSystemBodySource(this, inodeNumber, inode);
+    response->setBodySource(source);
+    response->setHeader("Accept-Ranges", "bytes");
+
+    // Any Range header we can't use gets the whole file
+    vector<pair<long, long> > ranges;
+    bool ranged = false;
+    try {
+        ranged = HttpUtils::byteRanges(request->getHeader("Range"), inode.size, ranges);
+    } catch (...) {
+        // no Range header
+    }
+    long rangeBytes = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        rangeBytes += ranges[i].second - ranges[i].first + 1;
+    }
+    if (!ranged || ranges.size() > MAX_BYTE_RANGES || rangeBytes > inode.size) {
+        response->setStatus(200);  // HTTP 200 OK
+        source->addRange(0, inode.size);
+        return;
+    }
+
+    stringstream contentRange;
+    if (ranges.empty()) {
+        contentRange << "bytes */" << inode.size;
+        response->setStatus(416);
+        response->setHeader("Content-Range", contentRange.str());
+        return;
+    }
+
+    response->setStatus(206);
+    if (ranges.size() == 1) {
+        contentRange << "bytes " << ranges[0].first << "-" << ranges[0].second << "/" << inode.size;
+        response->setHeader("Content-Range", contentRange.str());
+        source->addRange(ranges[0].first, rangeBytes);
+        return;
+    }
+
+    // Several ranges go out as a multipart body, each with its own headers
+    stringstream boundary;
+    boundary << "ds3-byteranges-" << hex << random();
+    for (size_t i = 0; i < ranges.size(); i++) {
+        stringstream partHead;
+        partHead << "\r\n--" << boundary.str() << "\r\n"
+                 << "Content-Type: " << response->getContentType() << "\r\n"
+                 << "Content-Range: bytes " << ranges[i].first << "-" << ranges[i].second << "/" << inode.size << "\r\n\r\n";
+        source->addText(partHead.str());
+        source->addRange(ranges[i].first, ranges[i].second - ranges[i].first + 1);
+    }
+    source->addText("\r\n--" + boundary.str() + "--\r\n");
+    response->setContentType("multipart/byteranges; boundary=" + boundary.str());
+}
+
+void DistributedFileSystemService::putLocked(HTTPRequest *request, HTTPResponse *response) {
     string fullPath = request->getPath();  // Full path including /ds3/
     string path = fullPath.substr(5);  // Remove /ds3/ part
     
@@ -118,47 +327,50 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
     string fileName = components.back();
     components.pop_back();  // Remove fileName from components
     
-    // Ensure the file name is not empty
-    if (fileName.empty()) {
+    // Ensure the file name and the directory names are not empty
+    if (fileName.empty() || find(components.begin(), components.end(), "") != components.end()) {
         throw ClientError::badRequest();
     }
 
     // Begin a transaction
     this->fileSystem->disk->beginTransaction();
 
-    // Create directories as needed
-    int parentInodeNumber = 0;  // root directory inode number
-    for (const string &dir : components) {
-        int result = this->fileSystem->lookup(parentInodeNumber, dir);
-        if (result == -ENOTFOUND) {
-            result = this->fileSystem->create(parentInodeNumber, UFS_DIRECTORY, dir);
-            if (result < 0) {
-                this->fileSystem->disk->rollback();
-                throw ClientError::insufficientStorage();
-            }
-        } else if (result < 0) {
-            this->fileSystem->disk->rollback();
-            throw ClientError::notFound();
-        }
-        parentInodeNumber = result;
-    }
-
-    // Check for conflicts with existing files
-    int fileInodeNumber = this->fileSystem->lookup(parentInodeNumber, fileName);
+    // Overwriting a file that exists resolves in one dentry cache probe
+    int fileInodeNumber = this->fileSystem->resolvePath(path);
     if (fileInodeNumber >= 0) {
+        // Check for conflicts with existing directories
         inode_t inode;
         int result = this->fileSystem->stat(fileInodeNumber, &inode);
         if (result == 0 && inode.type == UFS_DIRECTORY) {
             this->fileSystem->disk->rollback();
             throw ClientError::conflict();
         }
+    } else if (fileInodeNumber == -EINVALIDINODE) {
+        // part of the path is a file, so the directories can't be created
+        this->fileSystem->disk->rollback();
+        throw ClientError::conflict();
     } else if (fileInodeNumber != -ENOTFOUND) {
         this->fileSystem->disk->rollback();
         throw ClientError::notFound();
-    }
+    } else {
+        // Create directories as needed
+        int parentInodeNumber = 0;  // root directory inode number
+        for (const string &dir : components) {
+            int result = this->fileSystem->lookup(parentInodeNumber, dir);
+            if (result == -ENOTFOUND) {
+                result = this->fileSystem->create(parentInodeNumber, UFS_DIRECTORY, dir);
+                if (result < 0) {
+                    this->fileSystem->disk->rollback();
+                    throw ClientError::insufficientStorage();
+                }
+            } else if (result < 0) {
+                this->fileSystem->disk->rollback();
+                throw ClientError::notFound();
+            }
+            parentInodeNumber = result;
+        }
 
-    // Create or overwrite the file
-    if (fileInodeNumber == -ENOTFOUND) {
+        // Create the file
         fileInodeNumber = this->fileSystem->create(parentInodeNumber, UFS_REGULAR_FILE, fileName);
         if (fileInodeNumber < 0) {
             this->fileSystem->disk->rollback();
@@ -166,9 +378,18 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
         }
     }
 
-    // Write the file content
-    const string &fileContent = request->getBody();
-    int writeResult = this->fileSystem->write(fileInodeNumber, fileContent.c_str(), fileContent.size());
+    // Write the file content. A body that was streamed in is already on
+    // disk and only has to be committed.
+    int writeResult;
+    FileSystemBodySink *sink = dynamic_cast<FileSystemBodySink *>(request->getBodySink());
+    if (request->isPost() || request->hasHeader("Content-Range")) {
+        writeResult = patchFile(request, fileInodeNumber);
+    } else if (sink != NULL) {
+        writeResult = sink->commit(fileInodeNumber);
+    } else {
+        const string &fileContent = request->getBody();
+        writeResult = this->fileSystem->write(fileInodeNumber, fileContent.c_str(), fileContent.size());
+    }
     if (writeResult < 0) {
         this->fileSystem->disk->rollback();
         if (writeResult == -ENOTENOUGHSPACE) {
@@ -178,41 +399,77 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
         }
     }
 
-    // Commit the transaction
-    this->fileSystem->disk->commit();
+    // Commit the transaction. put() flushes it once the lock is released.
+    if (!this->fileSystem->disk->commit(false)) {
+        throw ClientError::conflict();
+    }
     response->setStatus(201);  // HTTP 201 Created
     response->setBody("File created/updated successfully");
 }
 
-void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
+int DistributedFileSystemService::patchFile(HTTPRequest *request, int inodeNumber) {
+    const string &body = request->getBody();
+    if (request->isPost()) {
+        return this->fileSystem->append(inodeNumber, body.c_str(), body.size());
+    }
+
+    long first, last, total;
+    if (!HttpUtils::contentRange(request->getHeader("Content-Range"), first, last, total)) {
+        return -EINVALIDSIZE;
+    }
+    if (first >= 0) {
+        if (last - first + 1 != (long) body.size() || last >= this->fileSystem->maxFileSize()) {
+            return -EINVALIDSIZE;
+        }
+        int result = this->fileSystem->pwrite(inodeNumber, body.c_str(), body.size(), first);
+        if (result < 0) {
+            return result;
+        }
+    } else if (!body.empty()) {
+        return -EINVALIDSIZE;
+    }
+
+    // "bytes */0" truncates, a total with a range sets the size afterwards
+    if (total >= 0) {
+        if (total > this->fileSystem->maxFileSize()) {
+            return -EINVALIDSIZE;
+        }
+        return this->fileSystem->truncate(inodeNumber, total);
+    }
+    return 0;
+}
+
+void DistributedFileSystemService::delLocked(HTTPRequest *request, HTTPResponse *response) {
     string fullPath = request->getPath();
     string path = fullPath.substr(5);
     if (path.empty()) {
         throw ClientError::badRequest();
     }
-    
-
-    vector<string> diffComponent;
-    stringstream ss(path);
-    string item;
 
-    while (getline(ss, item, '/')) {
-        diffComponent.push_back(item);
+    // Split off the name to remove, the rest is the parent directory
+    size_t end = path.find_last_not_of('/');
+    if (end == string::npos) {
+        throw ClientError::badRequest();
     }
+    size_t start = path.rfind('/', end);
+    start = start == string::npos ? 0 : start + 1;
+    string name = path.substr(start, end - start + 1);
+    string parentPath = path.substr(0, start);
 
-    int parentInodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
-    int inodeNum = -1;
- 
-    for (size_t i = 0; i < diffComponent.size() - 1; ++i) {
-        inodeNum = this->fileSystem->lookup(parentInodeNumber, diffComponent[i]);
-        if (inodeNum < 0) {
-            throw ClientError::notFound();
-        }
-        parentInodeNumber = inodeNum;
+    int parentInodeNumber = this->fileSystem->resolvePath(parentPath);
+    if (parentInodeNumber < 0) {
+        throw ClientError::notFound();
     }
 
-    int checkIt = this->fileSystem->unlink(parentInodeNumber, diffComponent[diffComponent.size()-1]);
+    // unlink updates bitmaps, the directory and its inode, so run it as
+    // a single transaction: one flush on commit, nothing left half done
+    this->fileSystem->disk->beginTransaction();
+    int checkIt = this->fileSystem->unlink(parentInodeNumber, name);
     if (checkIt < 0) {
+      this->fileSystem->disk->rollback();
       throw ClientError::badRequest();
     }
+    if (!this->fileSystem->disk->commit(false)) {
+      throw ClientError::conflict();
+    }
 }
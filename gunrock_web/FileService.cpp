@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <map>
@@ -32,35 +33,25 @@ bool FileService::endswith(string str, string suffix) {
 
 void FileService::get(HTTPRequest *request, HTTPResponse *response) {
   string path = this->m_basedir + request->getPath();
-  string fileContents = this->readFile(path);
-  if (fileContents.size() == 0) {
-    throw ClientError::notFound();
-  } else {
-    if (this->endswith(path, ".css")) {
-      response->setContentType("text/css");
-    } else if (this->endswith(path, ".js")) {
-      response->setContentType("text/javascript");
-    }
-    response->setBody(fileContents);
-  }
-}
-
-string FileService::readFile(string path) {
   int fd = open(path.c_str(), O_RDONLY);
   if (fd < 0) {
-    return "";
+    throw ClientError::notFound();
   }
 
-  string result;
-  int ret;
-  char buffer[4096];
-  while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
-    result.append(buffer, ret);
+  // the body goes from the page cache to the socket with sendfile, we
+  // only need its length up front
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    throw ClientError::notFound();
   }
 
-  close(fd);
-  
-  return result;
+  if (this->endswith(path, ".css")) {
+    response->setContentType("text/css");
+  } else if (this->endswith(path, ".js")) {
+    response->setContentType("text/javascript");
+  }
+  response->setBodyFile(fd, st.st_size);
 }
 
 void FileService::head(HTTPRequest *request, HTTPResponse *response) {
@@ -68,3 +59,11 @@ void FileService::head(HTTPRequest *request, HTTPResponse *response) {
   this->get(request, response);
   response->setBody("");
 }
+
+long FileService::responseSize(string path) {
+  struct stat st;
+  if (stat((this->m_basedir + path).c_str(), &st) != 0) {
+    return 0; // a 404 has no body
+  }
+  return st.st_size;
+}
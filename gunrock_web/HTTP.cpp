@@ -80,6 +80,10 @@ int HTTP::headers_complete_cb(http_parser *parser)
     HTTP *http = (HTTP *) parser->data;
     http->addHeaderField();
     http->m_headerDone = true;
+    if(http->m_httpType == HTTP_REQUEST) {
+        // known now so the body can be handled while it arrives
+        http->m_method = parser->method;
+    }
 
     if(http->m_httpType == HTTP_RESPONSE) {
         char buf[64];
@@ -119,7 +123,11 @@ int HTTP::headers_complete_cb(http_parser *parser)
 int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_body.append(at, length);
+    if(http->m_bodySink != NULL) {
+        http->m_bodySink->write(at, length);
+    } else {
+        http->m_body.append(at, length);
+    }
 
     return 0;
 }
@@ -127,10 +135,22 @@ int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 int HTTP::message_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
-    assert((http->getState() == HTTP::VALUE) || 
+    // a request with no headers at all completes straight from HEADER
+    assert((http->getState() == HTTP::HEADER) ||
+           (http->getState() == HTTP::VALUE) ||
            (http->getState() == HTTP::BODY));
     http->setState(HTTP::DONE);
+    http->m_keepAlive = http_should_keep_alive(parser);
     http->messageComplete(parser->method);
+
+    if(http->m_httpType == HTTP_REQUEST) {
+        // Stop at the end of this request so bytes from a pipelined request
+        // behind it are left for the next HTTP object. Like the response
+        // case in headers_complete_cb, the parser doesn't count the byte it
+        // is on when a callback stops it.
+        http->m_extraParsedBytes = 1;
+        return -1;
+    }
     return 0;
 }
 
@@ -146,6 +166,7 @@ HTTP::HTTP(http_parser_type httpType)
     m_state = INIT;
     http_parser_init(&m_parser, httpType);
     m_doneParsing = false;
+    m_keepAlive = false;
     m_httpType = httpType;
     m_headerDone = false;
 
@@ -164,6 +185,7 @@ HTTP::HTTP(http_parser_type httpType)
 
     m_field = NULL;
     m_value = NULL;
+    m_bodySink = NULL;
     m_extraParsedBytes = 0;
 }
 
@@ -199,6 +221,15 @@ string HTTP::getBody()
     return m_body;
 }
 
+void HTTP::setBodySink(BodySink *sink)
+{
+    m_bodySink = sink;
+    if(m_body.size() > 0) {
+        sink->write(m_body.data(), m_body.size());
+        m_body.clear();
+    }
+}
+
 string HTTP::getUrl()
 {
     return m_url;
@@ -228,6 +259,11 @@ bool HTTP::isDone()
     return m_doneParsing;
 }
 
+bool HTTP::keepAlive()
+{
+    return m_keepAlive;
+}
+
 string HTTP::getReplyHeader()
 {
     string reply;
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <strings.h>
 
 #include "HttpUtils.h"
 #include "StringUtils.h"
@@ -18,6 +19,8 @@ HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
     m_sock = sock;
     m_http = new HTTP();
     m_serverPort = serverPort;
+    m_bodySinkFactory = NULL;
+    m_bodySink = NULL;
     m_totalBytesRead = 0;
     m_totalBytesWritten = 0;
 }
@@ -25,6 +28,7 @@ HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
 HTTPRequest::~HTTPRequest()
 {
     delete m_http;
+    delete m_bodySink;
 }
 
 void HTTPRequest::printDebugInfo()
@@ -52,8 +56,8 @@ string HTTPRequest::getHeader(string key) {
   vector<pair<string *, string *> >::iterator iter;
   vector<pair<string *, string *> > headers = m_http->getHeaders();
   for (iter = headers.begin(); iter != headers.end(); iter++) {
-    string header_key = *(iter->first);
-    if (header_key == key) {
+    // header names are case insensitive
+    if (strcasecmp(iter->first->c_str(), key.c_str()) == 0) {
       return *(iter->second);
     }
   }
@@ -61,6 +65,15 @@ string HTTPRequest::getHeader(string key) {
   throw "could not find header";
 }
 
+bool HTTPRequest::hasHeader(string key) {
+  try {
+    getHeader(key);
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
 bool HTTPRequest::hasAuthToken() {
   try {
     getHeader("x-auth-token");
@@ -84,42 +97,72 @@ vector<string> HTTPRequest::getPathComponents() {
 
 bool HTTPRequest::readRequest()
 {
-    assert(!m_http->isDone());
+    string buffered;
+    return readRequest(buffered);
+}
 
-    string readData;
-    while(!m_http->isDone()) {
-        readData = m_sock->read();
-	onRead(readData.c_str(), readData.size());
+bool HTTPRequest::readRequest(string &buffered)
+{
+    // start with whatever the previous request on this connection read
+    // past its own end
+    while(!parse(buffered)) {
+        buffered = m_sock->read();
     }
 
     return true;
 }
 
-void HTTPRequest::onRead(const char *buffer, unsigned int len)
+bool HTTPRequest::parse(string &buffered)
+{
+    assert(!m_http->isDone());
+
+    if(buffered.size() > 0) {
+        unsigned int used = onRead(buffered.c_str(), buffered.size());
+        buffered.erase(0, used);
+    }
+    return m_http->isDone();
+}
+
+bool HTTPRequest::keepAlive()
+{
+    return m_http->keepAlive();
+}
+
+unsigned int HTTPRequest::onRead(const char *buffer, unsigned int len)
 {
     m_totalBytesRead += len;
 
     unsigned int bytesRead = 0;
     assert(len > 0);
 
-    while(bytesRead < len) {
-        assert(!m_http->isDone());
+    while(bytesRead < len && !m_http->isDone()) {
         int ret = m_http->addData((const unsigned char *) (buffer + bytesRead), len - bytesRead);
-        assert(ret > 0);
+        if(ret <= 0) {
+            // the parser gave up on this data, there is no request to serve
+            throw SocketReadError();
+        }
         bytesRead += ret;
-        
-        // This is a workaround for a parsing bug that sometimes
-        // crops up with connect commands.  The parser will think
-        // it is done before it reads the last newline of some
-        // properly formatted connect requests
-        if(m_http->isDone() && (bytesRead < len)) {
-            if(m_http->isConnect() && ((len-bytesRead) == 1) && (buffer[bytesRead] == '\n')) {
-                break;
-            } else {
-                assert(false);
+
+        if(m_bodySinkFactory != NULL && m_http->isHeaderDone()) {
+            m_bodySink = m_bodySinkFactory(this);
+            m_bodySinkFactory = NULL;
+            if(m_bodySink != NULL) {
+                m_http->setBodySink(m_bodySink);
             }
         }
     }
+
+    // This is a workaround for a parsing bug that sometimes
+    // crops up with connect commands.  The parser will think
+    // it is done before it reads the last newline of some
+    // properly formatted connect requests
+    if(m_http->isDone() && m_http->isConnect() && ((len-bytesRead) == 1) && (buffer[bytesRead] == '\n')) {
+        bytesRead++;
+    }
+
+    // anything past bytesRead belongs to the next request
+    m_totalBytesRead -= len - bytesRead;
+    return bytesRead;
 }
 
 string HTTPRequest::getHost()
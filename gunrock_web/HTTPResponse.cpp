@@ -1,5 +1,7 @@
 #include <sstream>
 
+#include <stdio.h>
+
 #include "HTTPResponse.h"
 
 using namespace std;
@@ -9,6 +11,12 @@ HTTPResponse::HTTPResponse() {
   this->contentType = "text/html; charset=ISO-8859-1";
   this->headers["Server"] = "Gunrock Web";
   this->status = 200;
+  this->source = new StringBodySource("");
+  this->finished = false;
+}
+
+HTTPResponse::~HTTPResponse() {
+  delete source;
 }
 
 void HTTPResponse::withStreaming() {
@@ -20,7 +28,17 @@ void HTTPResponse::setHeader(string name, string value) {
 }
 
 void HTTPResponse::setBody(string data) {
-  body = data;
+  setBodySource(new StringBodySource(data));
+}
+
+void HTTPResponse::setBodyFile(int fd, size_t length) {
+  setBodySource(new FileBodySource(fd, 0, length));
+}
+
+void HTTPResponse::setBodySource(BodySource *source) {
+  delete this->source;
+  this->source = source;
+  this->finished = false;
 }
 
 int HTTPResponse::getStatus() {
@@ -31,6 +49,10 @@ void HTTPResponse::setContentType(string contentType) {
   this->contentType = contentType;
 }
 
+string HTTPResponse::getContentType() {
+  return contentType;
+}
+
 void HTTPResponse::setStatus(int status) {
   this->status = status;
 }
@@ -38,19 +60,27 @@ void HTTPResponse::setStatus(int status) {
 string HTTPResponse::statusToString() {
   if (status == 200) {
     return "OK";
+  } else if (status == 206) {
+    return "Partial Content";
+  } else if (status == 416) {
+    return "Range Not Satisfiable";
   } else {
     return "Unknown";
   }
 }
 
-string HTTPResponse::response() {
+bool HTTPResponse::isChunked() {
+  return streaming || source->length() < 0;
+}
+
+string HTTPResponse::head() {
   stringstream out;
   setHeader("Content-Type", contentType);
-  if (streaming) {
+  if (isChunked()) {
     setHeader("Transfer-Encoding", "chunked");
   } else {
     stringstream len;
-    len << body.size();
+    len << source->length();
     setHeader("Content-Length", len.str());
   }
 
@@ -60,9 +90,70 @@ string HTTPResponse::response() {
     out << iter->first << ": " << iter->second << "\r\n";
   }
   out << "\r\n";
-  if (body.size() > 0 && !streaming) {
-    out << body;
-  }
 
   return out.str();
 }
+
+bool HTTPResponse::nextChunk(string &chunk) {
+  if (finished) {
+    return false;
+  }
+
+  if (!isChunked()) {
+    chunk.resize(BODY_CHUNK_SIZE);
+    int count = source->read(&chunk[0], BODY_CHUNK_SIZE);
+    chunk.resize(count);
+    finished = count == 0;
+    return !finished;
+  }
+
+  // Leave room in front for the chunk size so the body can be read
+  // straight into place. Chunk sizes may have leading zeros, so it is
+  // always written as 8 hex digits.
+  const int sizeLength = 10; // "%08x\r\n"
+  chunk.resize(sizeLength + BODY_CHUNK_SIZE + 2);
+  int count = source->read(&chunk[sizeLength], BODY_CHUNK_SIZE);
+  if (count == 0) {
+    // the last chunk is empty and has no trailers after it
+    chunk = "0\r\n\r\n";
+    finished = true;
+    return true;
+  }
+
+  char size[sizeLength + 1];
+  snprintf(size, sizeof(size), "%08x\r\n", count);
+  chunk.replace(0, sizeLength, size, sizeLength);
+  chunk.resize(sizeLength + count);
+  chunk += "\r\n";
+  return true;
+}
+
+string HTTPResponse::response() {
+  string out = head();
+  string chunk;
+  while (nextChunk(chunk)) {
+    out += chunk;
+  }
+  return out;
+}
+
+void HTTPResponse::write(MySocket *sock) {
+  string headers = head();
+  const string *contents = isChunked() ? NULL : source->contents();
+  off_t offset;
+  int fd = isChunked() ? -1 : source->file(&offset);
+
+  if (contents != NULL) {
+    sock->write(headers, *contents);
+  } else if (fd >= 0) {
+    // MSG_MORE lets the headers share a packet with the start of the file
+    sock->write(headers, "", source->length() > 0);
+    sock->sendFile(fd, offset, source->length());
+  } else {
+    sock->write(headers, "", source->length() != 0);
+    string chunk;
+    while (nextChunk(chunk)) {
+      sock->write(chunk);
+    }
+  }
+}
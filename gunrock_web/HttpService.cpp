@@ -46,3 +46,10 @@ void HttpService::move(HTTPRequest *request, HTTPResponse *response) {
   throw ClientError::methodNotAllowed();
 }
 
+long HttpService::responseSize(string path) {
+  return -1;
+}
+
+BodySink *HttpService::openBodySink(HTTPRequest *request) {
+  return NULL;
+}
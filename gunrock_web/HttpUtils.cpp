@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <stdlib.h>
+
+#include <algorithm>
 
 #include "HttpUtils.h"
 
@@ -69,3 +72,97 @@ vector<string> HttpUtils::split(const string &s, char delim) {
   }
   return result;
 }
+
+// true for a non-empty string of decimal digits
+static bool isNumber(const string &s) {
+  return s.size() > 0 && s.find_first_not_of("0123456789") == string::npos;
+}
+
+bool HttpUtils::byteRanges(string header, long size, vector<pair<long, long> > &ranges) {
+  const string unit = "bytes=";
+  if (header.compare(0, unit.size(), unit) != 0) {
+    return false;
+  }
+
+  vector<string> specs = split(header.substr(unit.size()), ',');
+  if (specs.size() == 0) {
+    return false;
+  }
+  for (unsigned int idx = 0; idx < specs.size(); idx++) {
+    string spec = specs[idx];
+    size_t start = spec.find_first_not_of(" \t");
+    size_t end = spec.find_last_not_of(" \t");
+    if (start == string::npos) {
+      continue;
+    }
+    spec = spec.substr(start, end - start + 1);
+
+    size_t dash = spec.find('-');
+    if (dash == string::npos) {
+      return false;
+    }
+    string first = spec.substr(0, dash);
+    string last = spec.substr(dash + 1);
+    // numbers too big for a long come out as LONG_MAX, which is past the
+    // end of any body
+    if (first.empty()) {
+      // the last n bytes
+      if (!isNumber(last)) {
+        return false;
+      }
+      long count = strtol(last.c_str(), NULL, 10);
+      if (count > 0 && size > 0) {
+        ranges.push_back(make_pair(max(0L, size - count), size - 1));
+      }
+    } else {
+      if (!isNumber(first) || (!last.empty() && !isNumber(last))) {
+        return false;
+      }
+      long from = strtol(first.c_str(), NULL, 10);
+      long to = last.empty() ? size - 1 : strtol(last.c_str(), NULL, 10);
+      if (!last.empty() && to < from) {
+        return false;
+      }
+      if (from < size) {
+        ranges.push_back(make_pair(from, min(to, size - 1)));
+      }
+    }
+  }
+  return true;
+}
+
+bool HttpUtils::contentRange(string header, long &first, long &last, long &total) {
+  const string unit = "bytes ";
+  if (header.compare(0, unit.size(), unit) != 0) {
+    return false;
+  }
+
+  string value = header.substr(unit.size());
+  size_t slash = value.find('/');
+  if (slash == string::npos) {
+    return false;
+  }
+  string range = value.substr(0, slash);
+  string length = value.substr(slash + 1);
+
+  if (length == "*") {
+    total = -1;
+  } else if (isNumber(length)) {
+    total = strtol(length.c_str(), NULL, 10);
+  } else {
+    return false;
+  }
+
+  if (range == "*") {
+    // only a new total, which has to be there
+    first = last = -1;
+    return total >= 0;
+  }
+  size_t dash = range.find('-');
+  if (dash == string::npos || !isNumber(range.substr(0, dash)) || !isNumber(range.substr(dash + 1))) {
+    return false;
+  }
+  first = strtol(range.substr(0, dash).c_str(), NULL, 10);
+  last = strtol(range.substr(dash + 1).c_str(), NULL, 10);
+  return first <= last && (total < 0 || last < total);
+}
@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <iostream>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "include/IoRing.h"
+
+using namespace std;
+
+// the operation codes are the kernel's, other systems never submit them
+#ifndef HAVE_IO_URING
+#define IORING_OP_READV 1
+#define IORING_OP_WRITEV 2
+#define IORING_OP_FSYNC 3
+#endif
+
+IoBatch::IoBatch() {
+  this->pending = 0;
+  this->async = false;
+}
+
+IoBatch::~IoBatch() {
+}
+
+static long iovLength(const struct iovec *iov, int count) {
+  long length = 0;
+  for (int idx = 0; idx < count; idx++) {
+    length += iov[idx].iov_len;
+  }
+  return length;
+}
+
+void IoBatch::readv(int fd, const struct iovec *iov, int count, off_t offset) {
+  IoOp op = {IORING_OP_READV, fd, iov, count, offset, false, iovLength(iov, count), 0, this};
+  ops.push_back(op);
+}
+
+void IoBatch::writev(int fd, const struct iovec *iov, int count, off_t offset) {
+  IoOp op = {IORING_OP_WRITEV, fd, iov, count, offset, false, iovLength(iov, count), 0, this};
+  ops.push_back(op);
+}
+
+void IoBatch::fsync(int fd, bool dataOnly) {
+  IoOp op = {IORING_OP_FSYNC, fd, NULL, 0, 0, dataOnly, 0, 0, this};
+  ops.push_back(op);
+}
+
+bool IoBatch::empty() {
+  return ops.empty();
+}
+
+bool IoBatch::done() {
+  return pending == 0;
+}
+
+int IoBatch::error() {
+  for (size_t idx = 0; idx < ops.size(); idx++) {
+    if (ops[idx].result < 0) {
+      return -ops[idx].result;
+    }
+    if (ops[idx].result != ops[idx].expected) {
+      return EIO;
+    }
+  }
+  return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+IoRing::IoRing() {
+  this->ringFd = -1;
+  this->completionFd = -1;
+  this->entries = 0;
+  this->queued = 0;
+  this->sqRing = MAP_FAILED;
+  this->sqRingSize = 0;
+  this->cqRing = MAP_FAILED;
+  this->cqRingSize = 0;
+  this->sqes = MAP_FAILED;
+  this->sqesSize = 0;
+}
+
+// Every operation IoBatch can queue has to be there, and the kernel has
+// to hold on to completions that don't fit in the completion queue
+// rather than drop them, since a thread can have any number of batches
+// in flight.
+static bool probeRing(int ringFd, const struct io_uring_params &params) {
+  if ((params.features & IORING_FEAT_NODROP) == 0) {
+    return false;
+  }
+
+  int numOps = 256;
+  size_t size = sizeof(struct io_uring_probe) + numOps * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+  bool supported = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, numOps) == 0;
+  int needed[] = {IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_FSYNC};
+  for (size_t idx = 0; supported && idx < sizeof(needed) / sizeof(needed[0]); idx++) {
+    supported = needed[idx] <= probe->last_op && (probe->ops[needed[idx]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+IoRing *IoRing::create(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  IoRing *ring = new IoRing();
+  ring->ringFd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->ringFd < 0 || !probeRing(ring->ringFd, params)) {
+    delete ring;
+    return NULL;
+  }
+  ring->entries = params.sq_entries;
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // newer kernels put both queues in one mapping
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sqRingSize = max(ring->sqRingSize, ring->cqRingSize);
+  }
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ringFd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    delete ring;
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  } else {
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ringFd, IORING_OFF_CQ_RING);
+  }
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->ringFd, IORING_OFF_SQES);
+  if (ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    delete ring;
+    return NULL;
+  }
+
+  unsigned char *sq = (unsigned char *) ring->sqRing;
+  ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+  unsigned char *cq = (unsigned char *) ring->cqRing;
+  ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+  ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = cq + params.cq_off.cqes;
+  // submission queue entry i always sits in slot i
+  for (unsigned idx = 0; idx < params.sq_entries; idx++) {
+    ring->sqArray[idx] = idx;
+  }
+
+  ring->completionFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring->completionFd < 0 ||
+      syscall(__NR_io_uring_register, ring->ringFd, IORING_REGISTER_EVENTFD, &ring->completionFd, 1) != 0) {
+    delete ring;
+    return NULL;
+  }
+  return ring;
+}
+
+IoRing::~IoRing() {
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqesSize);
+  }
+  if (cqRing != MAP_FAILED && cqRing != sqRing) {
+    munmap(cqRing, cqRingSize);
+  }
+  if (sqRing != MAP_FAILED) {
+    munmap(sqRing, sqRingSize);
+  }
+  if (completionFd >= 0) {
+    close(completionFd);
+  }
+  if (ringFd >= 0) {
+    close(ringFd);
+  }
+}
+
+void IoRing::run(IoBatch *batch) {
+  batch->async = false;
+  submit(batch);
+  while (!batch->done()) {
+    enter(1);
+  }
+}
+
+void IoRing::start(IoBatch *batch) {
+  batch->async = true;
+  submit(batch);
+  enter(0);
+  if (batch->done() && batch->ops.empty()) {
+    finishedBatches.push_back(batch);
+  }
+}
+
+void IoRing::poll() {
+  unsigned long long count;
+  // clear the eventfd before reaping, so a completion that arrives in
+  // between still wakes the event loop
+  while (read(completionFd, &count, sizeof(count)) > 0) {
+  }
+  enter(0);
+}
+
+int IoRing::eventFd() {
+  return completionFd;
+}
+
+deque<IoBatch *> &IoRing::finished() {
+  return finishedBatches;
+}
+
+// A batch bigger than the submission queue goes in several pieces. An
+// fsync is linked behind everything queued before it in its piece, and
+// when part of the batch went in an earlier piece it first waits for
+// that, since a link can't reach back into operations already submitted.
+void IoRing::submit(IoBatch *batch) {
+  batch->pending = batch->ops.size();
+  size_t pieceStart = 0;
+  for (size_t idx = 0; idx < batch->ops.size(); idx++) {
+    IoOp &op = batch->ops[idx];
+    if (queued == entries) {
+      enter(0);
+      pieceStart = idx;
+    }
+    if (op.opcode == IORING_OP_FSYNC && pieceStart > 0) {
+      while (batch->pending > batch->ops.size() - idx) {
+        enter(1);
+      }
+      pieceStart = idx;
+    }
+
+    unsigned tail = *sqTail + queued;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *) sqes + (tail & *sqMask);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op.opcode;
+    sqe->fd = op.fd;
+    sqe->user_data = (unsigned long long) &op;
+    if (op.opcode == IORING_OP_FSYNC) {
+      sqe->fsync_flags = op.dataOnly ? IORING_FSYNC_DATASYNC : 0;
+      for (size_t prev = pieceStart; prev < idx; prev++) {
+        struct io_uring_sqe *before = (struct io_uring_sqe *) sqes + ((tail - (idx - prev)) & *sqMask);
+        before->flags |= IOSQE_IO_LINK;
+      }
+    } else {
+      sqe->addr = (unsigned long long) op.iov;
+      sqe->len = op.iovCount;
+      sqe->off = op.offset;
+    }
+    queued++;
+  }
+}
+
+// With the completion queue full the kernel can refuse new submissions
+// (EBUSY) until some completions are reaped.
+void IoRing::enter(unsigned minComplete) {
+  unsigned toSubmit = queued;
+  __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+  queued = 0;
+
+  while (true) {
+    int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret >= 0) {
+      toSubmit -= ret;
+      if (toSubmit == 0) {
+        break;
+      }
+    } else if (errno == EBUSY || errno == EAGAIN) {
+      reap();
+    } else if (errno != EINTR) {
+      perror("io_uring_enter");
+      cerr << "Could not submit I/O" << endl;
+      exit(1);
+    }
+  }
+  reap();
+}
+
+void IoRing::reap() {
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *) cqes + (head & *cqMask);
+    IoOp *op = (IoOp *) cqe->user_data;
+    op->result = cqe->res;
+    IoBatch *batch = op->batch;
+    batch->pending--;
+    if (batch->pending == 0 && batch->async) {
+      finishedBatches.push_back(batch);
+    }
+    head++;
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+IoRing *IoRing::create(unsigned entries) {
+  return NULL;
+}
+
+IoRing::~IoRing() {
+}
+
+void IoRing::run(IoBatch *batch) {
+}
+
+void IoRing::start(IoBatch *batch) {
+}
+
+void IoRing::poll() {
+}
+
+int IoRing::eventFd() {
+  return -1;
+}
+
+deque<IoBatch *> &IoRing::finished() {
+  return finishedBatches;
+}
+
+#endif
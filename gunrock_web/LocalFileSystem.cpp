@@ -5,78 +5,562 @@
 #include <cstring>
 #include <algorithm>
 #include <cmath>
+#include <unordered_map>
+#include <set>
 
 #include "include/LocalFileSystem.h"
 #include "include/ufs.h"
 
 using namespace std;
 
+#define MAX_NEGATIVE_DENTRIES 4096
+
+// The locks are taken on every call, so they are plain pthread locks
+// like BlockCache's rather than the dthread wrappers, which log each call.
 LocalFileSystem::LocalFileSystem(Disk *disk) {
   this->disk = disk;
+  for (int i = 0; i < INODE_LOCK_STRIPES; i++) {
+    InodeStripe *stripe = new InodeStripe();
+    pthread_rwlock_init(&stripe->lock, NULL);
+    stripe->version = 0;
+    stripes.push_back(stripe);
+  }
+  pthread_mutex_init(&metadataLock, NULL);
+  pthread_mutex_init(&metadataWriteLock, NULL);
+  pthread_rwlock_init(&cacheLock, NULL);
+  namespaceGeneration = 0;
+  loadMetadata();
+  disk->addObserver(this);
 }
 
-void LocalFileSystem::readSuperBlock(super_t *super) {
+LocalFileSystem::~LocalFileSystem() {
+  for (size_t i = 0; i < stripes.size(); i++) {
+    pthread_rwlock_destroy(&stripes[i]->lock);
+    delete stripes[i];
+  }
+  pthread_mutex_destroy(&metadataLock);
+  pthread_mutex_destroy(&metadataWriteLock);
+  pthread_rwlock_destroy(&cacheLock);
+}
+
+void LocalFileSystem::loadMetadata() {
   char buffer[UFS_BLOCK_SIZE]; // Allocate buffer
   disk->readBlock(0, buffer); // Read the first block from disk into buffer
-  memcpy(super, buffer, sizeof(super_t)); // Copy contents of buffer into super_t 
+  memcpy(&super, buffer, sizeof(super_t)); // Copy contents of buffer into super_t 
+
+  inodeBitmap.reset(super.num_inodes, super.inode_bitmap_len, UFS_BLOCK_SIZE);
+  dataBitmap.reset(super.num_data, super.data_bitmap_len, UFS_BLOCK_SIZE);
+
+  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  int inodeBlocks = (super.num_inodes + inodesPerBlock - 1) / inodesPerBlock;
+  // resize keeps the table where it is when it is reloaded
+  inodes.resize(inodeBlocks * inodesPerBlock);
+  dirtyInodeBlocks.clear();
+
+  // The two bitmaps and the inode table sit next to each other, so this
+  // is usually one read. With the whole table in memory, stat never has
+  // to wait for the disk.
+  vector<int> blocks;
+  vector<void *> buffers;
+  for (int i = 0; i < super.inode_bitmap_len; i++) {
+    blocks.push_back(super.inode_bitmap_addr + i);
+    buffers.push_back(inodeBitmap.data() + i * UFS_BLOCK_SIZE);
+  }
+  for (int i = 0; i < super.data_bitmap_len; i++) {
+    blocks.push_back(super.data_bitmap_addr + i);
+    buffers.push_back(dataBitmap.data() + i * UFS_BLOCK_SIZE);
+  }
+  for (int i = 0; i < inodeBlocks; i++) {
+    blocks.push_back(super.inode_region_addr + i);
+    buffers.push_back(&inodes[i * inodesPerBlock]);
+  }
+  disk->readBlocks(blocks, buffers);
+}
+
+void LocalFileSystem::afterRollback() {
+  loadMetadata();
+  for (set<int>::iterator it = reservedBlocks.begin(); it != reservedBlocks.end(); it++) {
+    dataBitmap.set(*it);
+  }
+  directoryIndexes.clear();
+  dentries.clear();
+  negativeDentries.clear();
+  dentryPaths.clear();
+  namespaceGeneration++;
+}
+
+void LocalFileSystem::writeDirtyBitmaps(vector<int> &blocks, vector<unsigned char> &data) {
+  for (int i = 0; i < super.inode_bitmap_len; i++) {
+    if (inodeBitmap.isDirty(i)) {
+      unsigned char *block = inodeBitmap.data() + i * UFS_BLOCK_SIZE;
+      blocks.push_back(super.inode_bitmap_addr + i);
+      data.insert(data.end(), block, block + UFS_BLOCK_SIZE);
+      inodeBitmap.markClean(i);
+    }
+  }
+  for (int i = 0; i < super.data_bitmap_len; i++) {
+    if (dataBitmap.isDirty(i)) {
+      unsigned char *block = dataBitmap.data() + i * UFS_BLOCK_SIZE;
+      blocks.push_back(super.data_bitmap_addr + i);
+      data.insert(data.end(), block, block + UFS_BLOCK_SIZE);
+      dataBitmap.markClean(i);
+    }
+  }
+}
+
+void LocalFileSystem::readSuperBlock(super_t *super) {
+  memcpy(super, &this->super, sizeof(super_t));
+}
+
+bool LocalFileSystem::validInode(int inodeNumber) {
+  return inodeNumber >= 0 && inodeNumber < super.num_inodes;
+}
+
+LocalFileSystem::InodeStripe *LocalFileSystem::stripeFor(int inodeNumber) {
+  return stripes[inodeNumber % INODE_LOCK_STRIPES];
+}
+
+void LocalFileSystem::lockInode(int inodeNumber, bool exclusive) {
+  if (exclusive) {
+    pthread_rwlock_wrlock(&stripeFor(inodeNumber)->lock);
+  } else {
+    pthread_rwlock_rdlock(&stripeFor(inodeNumber)->lock);
+  }
+}
+
+void LocalFileSystem::unlockInode(int inodeNumber) {
+  pthread_rwlock_unlock(&stripeFor(inodeNumber)->lock);
+}
+
+int LocalFileSystem::lockEntry(int parentInodeNumber, const string &name) {
+  while (true) {
+    int inodeNumber = lookupLocked(parentInodeNumber, name);
+    if (inodeNumber < 0) {
+      return inodeNumber;
+    }
+    if (!validInode(inodeNumber)) {
+      return -EINVALIDINODE;
+    }
+    InodeStripe *parent = stripeFor(parentInodeNumber);
+    InodeStripe *child = stripeFor(inodeNumber);
+    if (child == parent || pthread_rwlock_trywrlock(&child->lock) == 0) {
+      return inodeNumber;
+    }
+
+    // Someone holds the child, maybe waiting for a lock we hold. Start
+    // over taking both in stripe order, and make sure the name still
+    // refers to the same inode once we have them.
+    unlockInode(parentInodeNumber);
+    int parentStripe = parentInodeNumber % INODE_LOCK_STRIPES;
+    int childStripe = inodeNumber % INODE_LOCK_STRIPES;
+    pthread_rwlock_wrlock(&stripes[min(parentStripe, childStripe)]->lock);
+    pthread_rwlock_wrlock(&stripes[max(parentStripe, childStripe)]->lock);
+    if (lookupLocked(parentInodeNumber, name) == inodeNumber) {
+      return inodeNumber;
+    }
+    unlockInode(inodeNumber);
+  }
+}
+
+void LocalFileSystem::unlockEntry(int parentInodeNumber, int inodeNumber) {
+  if (stripeFor(inodeNumber) != stripeFor(parentInodeNumber)) {
+    unlockInode(inodeNumber);
+  }
+  unlockInode(parentInodeNumber);
 }
 
 int LocalFileSystem::lookup(int parentInodeNumber, string name) {
-  // Read parent inode
-  inode_t parentInode;
-  int statResult = stat(parentInodeNumber, &parentInode);
-  if (statResult != 0) {
+  int inodeNumber;
+  if (findEntry(parentInodeNumber, name, inodeNumber)) {
+    return inodeNumber;
+  }
+  if (!validInode(parentInodeNumber)) {
+    return -EINVALIDINODE;
+  }
+
+  // the directory hasn't been indexed yet
+  lockInode(parentInodeNumber, false);
+  inodeNumber = lookupLocked(parentInodeNumber, name);
+  unlockInode(parentInodeNumber);
+  return inodeNumber;
+}
+
+int LocalFileSystem::lookupLocked(int parentInodeNumber, const string &name) {
+  int inodeNumber;
+  if (findEntry(parentInodeNumber, name, inodeNumber)) {
+    return inodeNumber;
+  }
+  if (!indexDirectory(parentInodeNumber)) {
     return -EINVALIDINODE; // Invalid parent inode or not a directory
   }
-  
-  // Read data blocks of parent inode
-  char block[UFS_BLOCK_SIZE];
-  int numBlocks = (int)ceil((double)parentInode.size / UFS_BLOCK_SIZE);
-  for (int i = 0; i < numBlocks; i++) {
-    if (parentInode.direct[i] != 0) {
-      disk->readBlock(parentInode.direct[i], block);
-      dir_ent_t *entries = reinterpret_cast<dir_ent_t *>(block);
-      for (int j = 0; j < (int)(UFS_BLOCK_SIZE / sizeof(dir_ent_t)); j++) {
-        if (entries[j].inum != -1 && strcmp(entries[j].name, name.c_str()) == 0) {
-          return entries[j].inum;
-        }
+  findEntry(parentInodeNumber, name, inodeNumber);
+  return inodeNumber;
+}
+
+bool LocalFileSystem::findEntry(int parentInodeNumber, const string &name, int &inodeNumber) {
+  pthread_rwlock_rdlock(&cacheLock);
+  unordered_map<int, DirectoryIndex>::iterator index = directoryIndexes.find(parentInodeNumber);
+  bool indexed = index != directoryIndexes.end();
+  if (indexed) {
+    DirectoryIndex::iterator entry = index->second.find(name);
+    inodeNumber = entry == index->second.end() ? -ENOTFOUND : entry->second;
+  }
+  pthread_rwlock_unlock(&cacheLock);
+  return indexed;
+}
+
+bool LocalFileSystem::indexDirectory(int inodeNumber) {
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0 || inode.type != UFS_DIRECTORY) {
+    return false;
+  }
+
+  // A mapped image lets the entries be indexed where they are, without
+  // copying the directory out. Blocks with a newer copy in the journal
+  // aren't mapped, and then the directory is read as usual.
+  int numEntries = inode.size / sizeof(dir_ent_t);
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int numBlocks = (numEntries + entriesPerBlock - 1) / entriesPerBlock;
+  vector<const dir_ent_t *> mapped;
+  vector<int> blocks;
+  fileBlocks(inode, 0, numBlocks, blocks);
+  for (int b = 0; b < numBlocks; b++) {
+    const dir_ent_t *block = (const dir_ent_t *) disk->blockPtr(blocks[b]);
+    if (block == NULL) {
+      break;
+    }
+    mapped.push_back(block);
+  }
+
+  vector<dir_ent_t> entries;
+  if ((int) mapped.size() < numBlocks) {
+    if (readDirectory(inodeNumber, inode, entries) < 0) {
+      return false;
+    }
+    mapped.clear();
+    for (int b = 0; b < numBlocks; b++) {
+      mapped.push_back(&entries[b * entriesPerBlock]);
+    }
+  }
+
+  DirectoryIndex index;
+  for (int b = 0; b < numBlocks; b++) {
+    int count = min(entriesPerBlock, numEntries - b * entriesPerBlock);
+    for (int i = 0; i < count; i++) {
+      const dir_ent_t &entry = mapped[b][i];
+      if (entry.inum != -1) {
+        // emplace keeps the first entry if a name shows up twice, like a scan would
+        index.emplace(string(entry.name, strnlen(entry.name, DIR_ENT_NAME_SIZE)), entry.inum);
       }
     }
   }
-  return -ENOTFOUND; // Not found
+
+  // another reader of the directory may have indexed it first
+  pthread_rwlock_wrlock(&cacheLock);
+  directoryIndexes.emplace(inodeNumber, index);
+  pthread_rwlock_unlock(&cacheLock);
+  return true;
 }
 
-int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
-  if (inodeNumber < 0 || inode == nullptr) {
-      return -1; // Invalid inode number or inode pointer
+int LocalFileSystem::readDirectory(int inodeNumber, inode_t &inode, vector<dir_ent_t> &entries) {
+  entries.resize(inode.size / sizeof(dir_ent_t));
+  if (entries.empty()) {
+    return 0;
   }
+  return preadLocked(inodeNumber, entries.data(), entries.size() * sizeof(dir_ent_t), 0);
+}
 
-  super_t super;
-  readSuperBlock(&super);
-  char block[UFS_BLOCK_SIZE];
+void LocalFileSystem::writeDirectoryBlock(inode_t &inode, vector<dir_ent_t> &entries, int blockIndex) {
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  dir_ent_t block[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+  int first = blockIndex * entriesPerBlock;
+  int count = max(0, min(entriesPerBlock, (int) entries.size() - first));
+  if (count > 0) {
+    memcpy(block, &entries[first], count * sizeof(dir_ent_t));
+  }
+  // unused slots are marked free, not left as stale or uninitialized entries
+  for (int k = count; k < entriesPerBlock; k++) {
+    memset(&block[k], 0, sizeof(dir_ent_t));
+    block[k].inum = -1;
+  }
+  disk->writeBlock(fileBlock(inode, blockIndex), block);
+}
 
-  // Calculate the block that the inode is in
-  // 1.) Start at the inode region address which is given as the block address (in blocks)
-  // 2.) Then add the inode number (first inode? second inode? etc.) divided by
-  //     # inodes per block, (bytes/block / bytes/inode => bytes/block * inode/bytes => inodes/block)
-  //     which gives you how many blocks into the inode region the inode is
-  // 3.) To get the block # on the disk
+// stat reads inodes without a lock, so changes make the stripe's version
+// odd while they copy the inode
+void LocalFileSystem::writeInode(int inodeNumber, inode_t &inode) {
   int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-  if (inodeNumber >= super.num_inodes) {
-      return -1; // Inode number out of range
+  InodeStripe *stripe = stripeFor(inodeNumber);
+  pthread_mutex_lock(&metadataLock);
+  stripe->version.fetch_add(1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  inodes[inodeNumber] = inode;
+  stripe->version.fetch_add(1, memory_order_release);
+  dirtyInodeBlocks.insert(inodeNumber / inodesPerBlock);
+  pthread_mutex_unlock(&metadataLock);
+}
+
+void LocalFileSystem::writeDirtyInodes(vector<int> &blocks, vector<unsigned char> &data) {
+  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  set<int>::iterator iter;
+  for (iter = dirtyInodeBlocks.begin(); iter != dirtyInodeBlocks.end(); iter++) {
+    unsigned char *block = reinterpret_cast<unsigned char *>(&inodes[*iter * inodesPerBlock]);
+    blocks.push_back(super.inode_region_addr + *iter);
+    data.insert(data.end(), block, block + UFS_BLOCK_SIZE);
+  }
+  dirtyInodeBlocks.clear();
+}
+
+void LocalFileSystem::writeDirtyMetadata() {
+  vector<int> blocks;
+  vector<unsigned char> data;
+  pthread_mutex_lock(&metadataWriteLock);
+  pthread_mutex_lock(&metadataLock);
+  writeDirtyBitmaps(blocks, data);
+  writeDirtyInodes(blocks, data);
+  pthread_mutex_unlock(&metadataLock);
+
+  vector<const void *> buffers;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    buffers.push_back(&data[i * UFS_BLOCK_SIZE]);
+  }
+  disk->writeBlocks(blocks, buffers);
+  pthread_mutex_unlock(&metadataWriteLock);
+}
+
+void LocalFileSystem::writeMetadata() {
+  // inside a transaction this waits for beforeCommit
+  if (!disk->inTransaction()) {
+    writeDirtyMetadata();
+  }
+}
+
+void LocalFileSystem::beforeCommit() {
+  writeDirtyMetadata();
+}
+
+bool LocalFileSystem::allocateDataBlocks(int count, vector<int> &blocks) {
+  pthread_mutex_lock(&metadataLock);
+  bool allocated = dataBitmap.allocate(count, blocks);
+  pthread_mutex_unlock(&metadataLock);
+  for (size_t i = 0; i < blocks.size(); i++) {
+    blocks[i] += super.data_region_addr;
+  }
+  return allocated;
+}
+
+void LocalFileSystem::freeDataBlocks(const vector<int> &blocks) {
+  pthread_mutex_lock(&metadataLock);
+  for (size_t i = 0; i < blocks.size(); i++) {
+    dataBitmap.clear(blocks[i] - super.data_region_addr);
+  }
+  pthread_mutex_unlock(&metadataLock);
+}
+
+int LocalFileSystem::allocateInode() {
+  pthread_mutex_lock(&metadataLock);
+  int inodeNumber = inodeBitmap.allocate();
+  pthread_mutex_unlock(&metadataLock);
+  return inodeNumber;
+}
+
+void LocalFileSystem::freeInode(int inodeNumber) {
+  pthread_mutex_lock(&metadataLock);
+  inodeBitmap.clear(inodeNumber);
+  pthread_mutex_unlock(&metadataLock);
+}
+
+bool LocalFileSystem::inodeAllocated(int inodeNumber) {
+  pthread_mutex_lock(&metadataLock);
+  bool allocated = inodeBitmap.isSet(inodeNumber);
+  pthread_mutex_unlock(&metadataLock);
+  return allocated;
+}
+
+int LocalFileSystem::maxFileSize() {
+  if (super.inode_format == UFS_FORMAT_INDIRECT) {
+    return MAX_INDIRECT_FILE_SIZE;
+  }
+  return MAX_FILE_SIZE;
+}
+
+unsigned int *LocalFileSystem::indirectBlock(IndirectBlocks &blocks, unsigned int blockNumber, bool fresh) {
+  IndirectBlocks::iterator found = blocks.find(blockNumber);
+  if (found == blocks.end()) {
+    found = blocks.insert(make_pair(blockNumber, vector<unsigned int>(UFS_PTRS_PER_BLOCK, 0))).first;
+    if (!fresh) {
+      disk->readBlock(blockNumber, found->second.data());
     }
+  }
+  return found->second.data();
+}
 
-    int blockNumber = super.inode_region_addr + (inodeNumber / inodesPerBlock);
-    disk->readBlock(blockNumber, block);
-    // Calculate the offset of the inode into the block
-    // 1.) Mod the inode number by # of inodes per block. This gives you how many inodes into the block
-    //     the inode is
-    // 2.) Multiply the calculated value by the size of the inode to get how many bytes into the block
-    //     the inode is
-    int offset = (inodeNumber % inodesPerBlock) * sizeof(inode_t);
+void LocalFileSystem::fileBlocks(const inode_t &inode, int first, int count, vector<int> &blocks) {
+  if (super.inode_format != UFS_FORMAT_INDIRECT) {
+    blocks.insert(blocks.end(), inode.direct + first, inode.direct + first + count);
+    return;
+  }
 
-    memcpy(inode, block + offset, sizeof(inode_t));
+  IndirectBlocks indirect;
+  for (int i = first; i < first + count; i++) {
+    int index = i - UFS_NUM_DIRECT;
+    if (index < 0) {
+      blocks.push_back(inode.direct[i]);
+    } else if (index < UFS_PTRS_PER_BLOCK) {
+      blocks.push_back(indirectBlock(indirect, inode.direct[UFS_SINGLE_INDIRECT], false)[index]);
+    } else {
+      index -= UFS_PTRS_PER_BLOCK;
+      unsigned int *single = indirectBlock(indirect, inode.direct[UFS_DOUBLE_INDIRECT], false);
+      blocks.push_back(indirectBlock(indirect, single[index / UFS_PTRS_PER_BLOCK], false)[index % UFS_PTRS_PER_BLOCK]);
+    }
+  }
+}
+
+int LocalFileSystem::fileBlock(const inode_t &inode, int index) {
+  vector<int> blocks;
+  fileBlocks(inode, index, 1, blocks);
+  return blocks[0];
+}
+
+int LocalFileSystem::fileBlocks(int inodeNumber, vector<int> &blocks) {
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  // the indirect blocks have to match the inode
+  lockInode(inodeNumber, false);
+  stat(inodeNumber, &inode);
+  fileBlocks(inode, 0, (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, blocks);
+  unlockInode(inodeNumber);
+  return 0;
+}
+
+int LocalFileSystem::mapFileBlocks(inode_t &inode, int first, const vector<int> &blocks) {
+  int end = first + blocks.size();
+  if (end > maxFileSize() / UFS_BLOCK_SIZE) {
+    return -EINVALIDSIZE;
+  }
+
+  if (super.inode_format != UFS_FORMAT_INDIRECT) {
+    copy(blocks.begin(), blocks.end(), inode.direct + first);
     return 0;
+  }
+
+  // Allocate every indirect block the new blocks need before changing
+  // anything. The single indirect block, the double indirect block and
+  // each block of pointers under it start at a fixed block of the file.
+  int doubleStart = UFS_NUM_DIRECT + UFS_PTRS_PER_BLOCK;
+  int needed = 0;
+  for (int i = first; i < end; i++) {
+    if (i == UFS_NUM_DIRECT || i == doubleStart) {
+      needed++;
+    }
+    if (i >= doubleStart && (i - doubleStart) % UFS_PTRS_PER_BLOCK == 0) {
+      needed++;
+    }
+  }
+  vector<int> fresh;
+  if (!allocateDataBlocks(needed, fresh)) {
+    return -ENOTENOUGHSPACE;
+  }
+  vector<int>::iterator next = fresh.begin();
+
+  IndirectBlocks indirect;
+  for (int i = first; i < end; i++) {
+    unsigned int block = blocks[i - first];
+    int index = i - UFS_NUM_DIRECT;
+    if (index < 0) {
+      inode.direct[i] = block;
+    } else if (index < UFS_PTRS_PER_BLOCK) {
+      if (index == 0) {
+        inode.direct[UFS_SINGLE_INDIRECT] = *next++;
+      }
+      indirectBlock(indirect, inode.direct[UFS_SINGLE_INDIRECT], index == 0)[index] = block;
+    } else {
+      index -= UFS_PTRS_PER_BLOCK;
+      if (index == 0) {
+        inode.direct[UFS_DOUBLE_INDIRECT] = *next++;
+      }
+      unsigned int *single = indirectBlock(indirect, inode.direct[UFS_DOUBLE_INDIRECT], index == 0);
+      bool startsSingle = index % UFS_PTRS_PER_BLOCK == 0;
+      if (startsSingle) {
+        single[index / UFS_PTRS_PER_BLOCK] = *next++;
+      }
+      indirectBlock(indirect, single[index / UFS_PTRS_PER_BLOCK], startsSingle)[index % UFS_PTRS_PER_BLOCK] = block;
+    }
+  }
+
+  vector<int> indirectNumbers;
+  vector<const void *> buffers;
+  for (IndirectBlocks::iterator it = indirect.begin(); it != indirect.end(); it++) {
+    indirectNumbers.push_back(it->first);
+    buffers.push_back(it->second.data());
+  }
+  disk->writeBlocks(indirectNumbers, buffers);
+  return 0;
+}
+
+void LocalFileSystem::freeFileBlocks(inode_t &inode, int first, int numBlocks) {
+  if (first >= numBlocks) {
+    return;
+  }
+
+  vector<int> blocks;
+  fileBlocks(inode, first, numBlocks - first, blocks);
+
+  if (super.inode_format != UFS_FORMAT_INDIRECT) {
+    fill(inode.direct + first, inode.direct + numBlocks, 0);
+    freeDataBlocks(blocks);
+    return;
+  }
+
+  fill(inode.direct + min(first, UFS_NUM_DIRECT), inode.direct + min(numBlocks, UFS_NUM_DIRECT), 0);
+  if (first <= UFS_NUM_DIRECT && numBlocks > UFS_NUM_DIRECT) {
+    blocks.push_back(inode.direct[UFS_SINGLE_INDIRECT]);
+    inode.direct[UFS_SINGLE_INDIRECT] = 0;
+  }
+
+  // Pointers left behind in indirect blocks that are kept are past the
+  // end of the file, and get replaced if it grows again
+  int doubleStart = UFS_NUM_DIRECT + UFS_PTRS_PER_BLOCK;
+  if (numBlocks > doubleStart) {
+    IndirectBlocks indirect;
+    unsigned int *single = indirectBlock(indirect, inode.direct[UFS_DOUBLE_INDIRECT], false);
+    for (int k = 0; doubleStart + k * UFS_PTRS_PER_BLOCK < numBlocks; k++) {
+      if (doubleStart + k * UFS_PTRS_PER_BLOCK >= first) {
+        blocks.push_back(single[k]);
+      }
+    }
+    if (first <= doubleStart) {
+      blocks.push_back(inode.direct[UFS_DOUBLE_INDIRECT]);
+      inode.direct[UFS_DOUBLE_INDIRECT] = 0;
+    }
+  }
+  freeDataBlocks(blocks);
+}
+
+int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+  if (inodeNumber < 0 || inode == nullptr) {
+      return -1; // Invalid inode number or inode pointer
+  }
+
+  if (inodeNumber >= super.num_inodes) {
+      return -1; // Inode number out of range
+  }
+
+  // Lock free: copy the inode, and copy it again if writeInode was
+  // changing an inode in the same stripe in the meantime
+  atomic<unsigned int> &version = stripeFor(inodeNumber)->version;
+  while (true) {
+    unsigned int before = version.load(memory_order_acquire);
+    if (before % 2 == 0) {
+      memcpy(inode, &inodes[inodeNumber], sizeof(inode_t));
+      atomic_thread_fence(memory_order_acquire);
+      if (version.load(memory_order_relaxed) == before) {
+        return 0;
+      }
+    }
+  }
 }
 
 int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
@@ -86,30 +570,71 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
         return -EINVALIDINODE; // Invalid inode
     }
 
-    if(size < 0 || size > MAX_FILE_SIZE) {
+    if(size < 0 || size > maxFileSize()) {
         return -EINVALIDSIZE;
     }
-    
-    if(size > inode.size) {
-        size = inode.size;
+
+    return pread(inodeNumber, buffer, size, 0);
+}
+
+int LocalFileSystem::pread(int inodeNumber, void *buffer, int size, int offset) {
+    if (!validInode(inodeNumber)) {
+        return -EINVALIDINODE;
     }
+    lockInode(inodeNumber, false);
+    int result = preadLocked(inodeNumber, buffer, size, offset);
+    unlockInode(inodeNumber);
+    return result;
+}
 
-    int bytesRead = 0;
-    char block[UFS_BLOCK_SIZE];
-    int numBlocks = (int)ceil((double)size / UFS_BLOCK_SIZE);
-    // Iterating through the direct pointers (each pointer refers to one disk block that belongs to the file) 
-    // as well as keeping in mind that the bytesRead must be less than the number of bytes we want to read
-    for (int i = 0; i < numBlocks; i++) {
-        if (inode.direct[i] != 0) { // Skip super block
-            disk->readBlock(inode.direct[i], block);
-            // Min makes sure if we have less than a block of bytes left to read then we only read the amount
-            // of bytes we have left to read
-            int bytesToRead = min(size - bytesRead, UFS_BLOCK_SIZE);
-            memcpy(static_cast<char *>(buffer) + bytesRead, block, bytesToRead);
-            bytesRead += bytesToRead;
+int LocalFileSystem::preadLocked(int inodeNumber, void *buffer, int size, int offset) {
+    inode_t inode;
+    if (stat(inodeNumber, &inode) != 0) {
+        return -EINVALIDINODE;
+    }
+
+    if (size < 0 || offset < 0) {
+        return -EINVALIDSIZE;
+    }
+
+    if (offset >= inode.size) {
+        return 0;
+    }
+    size = min(size, inode.size - offset);
+    if (size == 0) {
+        return 0;
+    }
+
+    int firstBlock = offset / UFS_BLOCK_SIZE;
+    vector<int> blocks;
+    fileBlocks(inode, firstBlock, (offset + size - 1) / UFS_BLOCK_SIZE - firstBlock + 1, blocks);
+
+    // Whole blocks go straight into the caller's buffer, only a partial
+    // first or last block goes through one of these
+    char edges[2][UFS_BLOCK_SIZE];
+    vector<void *> buffers(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        int blockStart = (firstBlock + i) * UFS_BLOCK_SIZE;
+        int from = max(offset, blockStart);
+        int to = min(offset + size, blockStart + UFS_BLOCK_SIZE);
+        if (to - from == UFS_BLOCK_SIZE) {
+            buffers[i] = static_cast<char *>(buffer) + (from - offset);
+        } else {
+            buffers[i] = edges[i == 0 ? 0 : 1];
+        }
+    }
+    disk->readBlocks(blocks, buffers);
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (buffers[i] != edges[0] && buffers[i] != edges[1]) {
+            continue;
         }
+        int blockStart = (firstBlock + i) * UFS_BLOCK_SIZE;
+        int from = max(offset, blockStart);
+        int to = min(offset + size, blockStart + UFS_BLOCK_SIZE);
+        memcpy(static_cast<char *>(buffer) + (from - offset), static_cast<char *>(buffers[i]) + (from - blockStart), to - from);
     }
-    return bytesRead;
+    return size;
 }
 
 int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
@@ -117,16 +642,32 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
         return -EINVALIDINODE; // Invalid parent inode number
     }
 
-    if (name.length() > DIR_ENT_NAME_SIZE) {
-        return -EINVALIDNAME; // Name too long
+    if (name.length() >= DIR_ENT_NAME_SIZE) {
+        return -EINVALIDNAME; // Name too long, it needs room for the terminating null
     }
 
     if (type != UFS_REGULAR_FILE && type != UFS_DIRECTORY) {
         return -EINVALIDTYPE; // Invalid type
     }
 
+    if (!validInode(parentInodeNumber)) {
+        return -EINVALIDINODE;
+    }
+
+    // The new inode can't be reached until its entry is in the parent, so
+    // only the parent is locked
+    lockInode(parentInodeNumber, true);
+    int result = createLocked(parentInodeNumber, type, name);
+    unlockInode(parentInodeNumber);
+    return result;
+}
+
+int LocalFileSystem::createLocked(int parentInodeNumber, int type, const string &name) {
     // Check if name already exists in the parent directory
-    int existingInodeNumber = lookup(parentInodeNumber, name);
+    int existingInodeNumber = lookupLocked(parentInodeNumber, name);
+    if (existingInodeNumber == -EINVALIDINODE) {
+        return -EINVALIDINODE; // Invalid parent inode or not a directory
+    }
     if (existingInodeNumber != -ENOTFOUND) {
         inode_t existingInode;
         int checkIt = stat(existingInodeNumber, &existingInode);
@@ -137,30 +678,59 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
         }
     }
 
-    // Read the superblock
-    super_t super;
-    readSuperBlock(&super);
-
-    // Read inode and data bitmaps
-    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
-    vector<unsigned char> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
-    readInodeBitmap(&super, inodeBitmap.data());
-    readDataBitmap(&super, dataBitmap.data());
+    // Read the parent directory and pick the slot for the new entry
+    inode_t parentInode;
+    vector<dir_ent_t> parentEntries;
+    if (stat(parentInodeNumber, &parentInode) != 0 || readDirectory(parentInodeNumber, parentInode, parentEntries) < 0) {
+        return -EINVALIDINODE;
+    }
 
-    // Find a free inode
-    int newInodeNumber = -1;
-    for (int i = 0; i < super.num_inodes; ++i) {
-        if ((inodeBitmap[i / 8] & (1 << (i % 8))) == 0) {
-            newInodeNumber = i;
-            inodeBitmap[i / 8] |= 1 << (i % 8); // Mark inode as used
+    int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+    int slot = -1;
+    for (int i = 0; i < (int)parentEntries.size(); i++) {
+        if (parentEntries[i].inum == -1) {
+            slot = i;
             break;
         }
     }
+    bool parentNeedsBlock = false;
+    if (slot == -1) {
+        slot = parentEntries.size();
+        parentNeedsBlock = slot % entriesPerBlock == 0;
+        if (parentNeedsBlock && slot / entriesPerBlock >= maxFileSize() / UFS_BLOCK_SIZE) {
+            return -ENOTENOUGHSPACE; // The parent directory is as big as it can get
+        }
+    }
 
+    // Allocate the inode, a data block for directories and a new block for
+    // the parent if it is full. Nothing is written until all of them succeed.
+    int newInodeNumber = allocateInode();
     if (newInodeNumber == -1) {
         return -ENOTENOUGHSPACE; // No free inodes
     }
 
+    vector<int> newDirBlock;
+    if (type == UFS_DIRECTORY && !allocateDataBlocks(1, newDirBlock)) {
+        freeInode(newInodeNumber);
+        return -ENOTENOUGHSPACE; // No free data blocks
+    }
+
+    if (parentNeedsBlock) {
+        vector<int> newBlock;
+        int mapped = -ENOTENOUGHSPACE;
+        if (allocateDataBlocks(1, newBlock)) {
+            mapped = mapFileBlocks(parentInode, slot / entriesPerBlock, newBlock);
+            if (mapped < 0) {
+                freeDataBlocks(newBlock);
+            }
+        }
+        if (mapped < 0) {
+            freeInode(newInodeNumber);
+            freeDataBlocks(newDirBlock);
+            return -ENOTENOUGHSPACE; // No free data blocks
+        }
+    }
+
     // Initialize the new inode
     inode_t newInode;
     memset(&newInode, 0, sizeof(newInode)); // Initialize inode to zero
@@ -169,24 +739,9 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
     if (type == UFS_REGULAR_FILE) {
         newInode.size = 0;
     } else if (type == UFS_DIRECTORY) {
-        // Allocate a data block for the new directory
-        int newDirBlock = -1;
-        for (int i = 0; i < super.num_data; i++) {
-            if ((dataBitmap[i / 8] & (1 << (i % 8))) == 0) {
-                newDirBlock = super.data_region_addr + i;
-                dataBitmap[i / 8] |= 1 << (i % 8); // Mark block as used
-                break;
-            }
-        }
-
-        if (newDirBlock == -1) {
-            return -ENOTENOUGHSPACE; // No free data blocks
-        }
-
         // Initialize the new directory block with . and ..
-        char newDirBlockContent[UFS_BLOCK_SIZE];
-        memset(newDirBlockContent, 0, UFS_BLOCK_SIZE); // Clear the block
-        dir_ent_t *entries = reinterpret_cast<dir_ent_t *>(newDirBlockContent);
+        vector<dir_ent_t> entries(2);
+        memset(entries.data(), 0, 2 * sizeof(dir_ent_t));
 
         // Entry for .
         strcpy(entries[0].name, ".");
@@ -196,76 +751,38 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
         strcpy(entries[1].name, "..");
         entries[1].inum = parentInodeNumber;
 
-        disk->writeBlock(newDirBlock, entries);
-
-        newInode.direct[0] = newDirBlock;
+        newInode.direct[0] = newDirBlock[0];
         newInode.size = 2 * sizeof(dir_ent_t);
+        writeDirectoryBlock(newInode, entries, 0);
     }
 
     // Write the new inode to disk
-    int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-    int inodeBlockNumber = super.inode_region_addr + (newInodeNumber / inodesPerBlock);
-    int inodeOffset = (newInodeNumber % inodesPerBlock) * sizeof(inode_t);
-    char block2[UFS_BLOCK_SIZE];
-
-    disk->readBlock(inodeBlockNumber, block2);
-    memcpy(block2 + inodeOffset, &newInode, sizeof(inode_t));
-    disk->writeBlock(inodeBlockNumber, block2);
-
-    // Update the parent directory
-    inode_t parentInode;
-    int checkIt2 = stat(parentInodeNumber, &parentInode);
-    if (checkIt2 != 0 || parentInode.type != UFS_DIRECTORY) {
-        return -EINVALIDINODE; // Invalid parent inode or not a directory
-    }
-
-    char block[UFS_BLOCK_SIZE];
-    bool added = false;
-    int numEntries = parentInode.size / (int)sizeof(dir_ent_t);
-    dir_ent_t *parent_entries = new dir_ent_t[numEntries + 1];
-    read(parentInodeNumber, parent_entries, parentInode.size);
-    for(int i = 0; i < numEntries; i++) {
-        if(parent_entries[i].inum == -1) {
-            strcpy(parent_entries[i].name, name.c_str());
-            parent_entries[i].inum = newInodeNumber;
-            added = true;
-            break;
-        }
-    }
-
-    if(!added) {
-        parent_entries[numEntries].inum = newInodeNumber;
-        strcpy(parent_entries[numEntries].name, name.c_str());
+    writeInode(newInodeNumber, newInode);
+
+    // Add the entry to the parent, only the block holding it changes
+    dir_ent_t newEntry;
+    memset(&newEntry, 0, sizeof(newEntry));
+    strcpy(newEntry.name, name.c_str());
+    newEntry.inum = newInodeNumber;
+    if (slot == (int)parentEntries.size()) {
+        parentEntries.push_back(newEntry);
         parentInode.size += sizeof(dir_ent_t);
+    } else {
+        parentEntries[slot] = newEntry;
     }
-
-    int numBlocks = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-    int dirCopy = 0;
-    for(int j = 0; j < numBlocks; j++) {
-        char buffer[UFS_BLOCK_SIZE];
-        int dir2Copy = min(UFS_BLOCK_SIZE / (int)sizeof(dir_ent_t), (numEntries - dirCopy) * (int)(sizeof(dir_ent_t)));
-        memcpy(buffer, parent_entries + dirCopy, sizeof(dir_ent_t) * dir2Copy);
-        disk->writeBlock(parentInode.direct[j], buffer);
-        dirCopy += dir2Copy;
-    }
+    writeDirectoryBlock(parentInode, parentEntries, slot / entriesPerBlock);
 
     // Write the updated parent inode to disk
-    int parentInodeBlockNumber = super.inode_region_addr + (parentInodeNumber / inodesPerBlock);
-    int parentInodeOffset = (parentInodeNumber % inodesPerBlock) * sizeof(inode_t);
-    disk->readBlock(parentInodeBlockNumber, block);
-    memcpy(block + parentInodeOffset, &parentInode, sizeof(inode_t));
-    disk->writeBlock(parentInodeBlockNumber, block);
-
-    // Write the updated inode bitmap to disk
-    for (int i = 0; i < super.inode_bitmap_len; ++i) {
-        disk->writeBlock(super.inode_bitmap_addr + i, &inodeBitmap[i * UFS_BLOCK_SIZE]);
-    }
+    writeInode(parentInodeNumber, parentInode);
 
-    // Write the updated data bitmap to disk
-    for (int i = 0; i < super.data_bitmap_len; i++) {
-        disk->writeBlock(super.data_bitmap_addr + i, &dataBitmap[i * UFS_BLOCK_SIZE]);
-    }
+    // Write the bitmap and inode blocks we changed
+    writeMetadata();
 
+    pthread_rwlock_wrlock(&cacheLock);
+    directoryIndexes[parentInodeNumber].emplace(name, newInodeNumber);
+    negativeDentries.clear();
+    namespaceGeneration++;
+    pthread_rwlock_unlock(&cacheLock);
     return newInodeNumber;
 }
 
@@ -273,10 +790,21 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
 
 
 int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+    if (!validInode(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+    lockInode(inodeNumber, true);
+    int result = writeLocked(inodeNumber, buffer, size);
+    unlockInode(inodeNumber);
+    return result;
+}
 
+int LocalFileSystem::writeLocked(int inodeNumber, const void *buffer, int size) {
+    // An unlinked inode has nothing to write to, even if the caller
+    // looked it up before it went away
     inode_t inode;
     int statResult = stat(inodeNumber, &inode);
-    if (statResult != 0) {
+    if (statResult != 0 || !inodeAllocated(inodeNumber)) {
         return -EINVALIDINODE; // Invalid inode
     }
 
@@ -284,66 +812,327 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
         return -EINVALIDTYPE; // Not a regular file
     }
 
-    if (size > MAX_FILE_SIZE) {
+    if (size > maxFileSize()) {
         return -EINVALIDSIZE; // Exceeds max file size
     }
 
     int blocksNeeded = (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE; // Round up to nearest block
 
-    unsigned char dataBitmap[UFS_BLOCK_SIZE];
-    super_t super;
-    readSuperBlock(&super);
-    readDataBitmap(&super, dataBitmap);
-
-    // Find free blocks in the data region
+    // Allocate the data blocks, next to the most recently allocated ones
     vector<int> freeBlocks;
-    for (int i = 0; i < super.num_data; i++) {
-        if ((dataBitmap[i / 8] & (1 << (i % 8))) == 0) {
-            freeBlocks.push_back(super.data_region_addr + i);
-        }
-        if ((int)freeBlocks.size() == blocksNeeded) {
-            break;
-        }
+    if (!allocateDataBlocks(blocksNeeded, freeBlocks)) {
+        return -ENOTENOUGHSPACE; // Not enough space
     }
 
-    // Check if there are enough free blocks available
-    if ((int)freeBlocks.size() < blocksNeeded) {
-        return -ENOTENOUGHSPACE; // Not enough space
+    // Map them in a copy of the inode, the old blocks are still needed to
+    // free them
+    inode_t newInode = inode;
+    fill(newInode.direct, newInode.direct + DIRECT_PTRS, 0);
+    int mapped = mapFileBlocks(newInode, 0, freeBlocks);
+    if (mapped < 0) {
+        freeDataBlocks(freeBlocks);
+        return mapped;
     }
+    freeFileBlocks(inode, 0, (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
 
-    // Write data to the free blocks
+    // Write data to the free blocks, straight from the caller's buffer
+    // except for a partial last block
     char block[UFS_BLOCK_SIZE];
+    vector<const void *> buffers;
     int bytesWritten = 0;
     for (int i = 0; i < blocksNeeded; i++) {
         int bytesToWrite = min(size - bytesWritten, UFS_BLOCK_SIZE);
-        memcpy(block, static_cast<const char *>(buffer) + bytesWritten, bytesToWrite);
+        const char *data = static_cast<const char *>(buffer) + bytesWritten;
+        if (bytesToWrite == UFS_BLOCK_SIZE) {
+            buffers.push_back(data);
+        } else {
+            memcpy(block, data, bytesToWrite);
+            memset(block + bytesToWrite, 0, UFS_BLOCK_SIZE - bytesToWrite);
+            buffers.push_back(block);
+        }
+
+        bytesWritten += bytesToWrite;
+    }
+    disk->writeBlocks(freeBlocks, buffers);
 
-        disk->writeBlock(freeBlocks[i], block);
-        inode.direct[i] = freeBlocks[i];
+    newInode.size = size;
+    writeInode(inodeNumber, newInode);
 
-        // Mark the block as used in the data bitma
-        dataBitmap[(freeBlocks[i] - super.data_region_addr) / 8] |= 1 << ((freeBlocks[i] - super.data_region_addr) % 8);
+    // Write the updated data bitmap and inode blocks back to the disk
+    writeMetadata();
 
-        bytesWritten += bytesToWrite;
+    return bytesWritten;
+    // return 0;
+}
+
+int LocalFileSystem::pwrite(int inodeNumber, const void *buffer, int size, int offset) {
+    if (!validInode(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+    lockInode(inodeNumber, true);
+    int result = pwriteLocked(inodeNumber, buffer, size, offset);
+    unlockInode(inodeNumber);
+    return result;
+}
+
+int LocalFileSystem::pwriteLocked(int inodeNumber, const void *buffer, int size, int offset) {
+    inode_t inode;
+    if (stat(inodeNumber, &inode) != 0 || !inodeAllocated(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+
+    if (inode.type != UFS_REGULAR_FILE) {
+        return -EINVALIDTYPE;
+    }
+
+    if (size < 0 || offset < 0 || offset > maxFileSize() - size) {
+        return -EINVALIDSIZE;
     }
 
+    if (size == 0) {
+        return 0;
+    }
+
+    // Only the part of the file that grows needs new blocks. A gap
+    // between the old end and the block offset is in gets zeroed there.
+    int end = offset + size;
+    int oldNumBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int first = offset / UFS_BLOCK_SIZE;
+    int last = (end - 1) / UFS_BLOCK_SIZE;
+    int grown = growFile(inode, end, first * UFS_BLOCK_SIZE);
+    if (grown < 0) {
+        return grown;
+    }
+
+    vector<int> blocks;
+    fileBlocks(inode, first, last - first + 1, blocks);
+    vector<char> data(blocks.size() * UFS_BLOCK_SIZE);
+
+    // read the old contents of the blocks that are only partly overwritten
+    vector<int> partial;
+    vector<void *> partialBuffers;
+    for (int i = first; i <= last; i++) {
+        int blockStart = i * UFS_BLOCK_SIZE;
+        bool overwritten = offset <= blockStart && end >= blockStart + UFS_BLOCK_SIZE;
+        if (i < oldNumBlocks && !overwritten) {
+            partial.push_back(blocks[i - first]);
+            partialBuffers.push_back(&data[(i - first) * UFS_BLOCK_SIZE]);
+        }
+    }
+    disk->readBlocks(partial, partialBuffers);
+
+    vector<const void *> buffers;
+    for (int i = first; i <= last; i++) {
+        char *block = &data[(i - first) * UFS_BLOCK_SIZE];
+        int blockStart = i * UFS_BLOCK_SIZE;
+        int blockEnd = blockStart + UFS_BLOCK_SIZE;
+        if (blockEnd > inode.size) {
+            // nothing past the old end of the file is worth keeping
+            int keep = max(inode.size - blockStart, 0);
+            memset(block + keep, 0, UFS_BLOCK_SIZE - keep);
+        }
+
+        int from = max(offset, blockStart);
+        int to = min(end, blockEnd);
+        if (to > from) {
+            memcpy(block + (from - blockStart), static_cast<const char *>(buffer) + (from - offset), to - from);
+        }
+        buffers.push_back(block);
+    }
+    disk->writeBlocks(blocks, buffers);
+
+    inode.size = max(inode.size, end);
+    writeInode(inodeNumber, inode);
+    writeMetadata();
+    return size;
+}
+
+int LocalFileSystem::append(int inodeNumber, const void *buffer, int size) {
+    if (!validInode(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+    // the end of the file can't move before the write
+    lockInode(inodeNumber, true);
+    inode_t inode;
+    stat(inodeNumber, &inode);
+    int result = pwriteLocked(inodeNumber, buffer, size, inode.size);
+    unlockInode(inodeNumber);
+    return result;
+}
+
+int LocalFileSystem::truncate(int inodeNumber, int size) {
+    if (!validInode(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+    lockInode(inodeNumber, true);
+    int result = truncateLocked(inodeNumber, size);
+    unlockInode(inodeNumber);
+    return result;
+}
+
+int LocalFileSystem::truncateLocked(int inodeNumber, int size) {
+    inode_t inode;
+    if (stat(inodeNumber, &inode) != 0 || !inodeAllocated(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+
+    if (inode.type != UFS_REGULAR_FILE) {
+        return -EINVALIDTYPE;
+    }
+
+    if (size < 0 || size > maxFileSize()) {
+        return -EINVALIDSIZE;
+    }
+
+    if (size > inode.size) {
+        int grown = growFile(inode, size, size);
+        if (grown < 0) {
+            return grown;
+        }
+    } else {
+        // Free the blocks past the new end. What is left of the last block
+        // past the end gets zeroed if the file grows again.
+        freeFileBlocks(inode, (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+    }
     inode.size = size;
-    int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-    int inodeBlockNumber = super.inode_region_addr + (inodeNumber / inodesPerBlock);
-    int inodeOffset = (inodeNumber % inodesPerBlock) * sizeof(inode_t);
+    writeInode(inodeNumber, inode);
+    writeMetadata();
+    return 0;
+}
 
-    disk->readBlock(inodeBlockNumber, block);
-    memcpy(block + inodeOffset, &inode, sizeof(inode_t));
-    disk->writeBlock(inodeBlockNumber, block);
+// Growing a file by a lot must not need memory for all of it, so the new
+// blocks are zeroed one at a time, and their numbers looked up a block of
+// pointers at a time
+int LocalFileSystem::growFile(inode_t &inode, int end, int zeroTo) {
+    int oldNumBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int newNumBlocks = max(oldNumBlocks, (end + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+    vector<int> freeBlocks;
+    if (!allocateDataBlocks(newNumBlocks - oldNumBlocks, freeBlocks)) {
+        return -ENOTENOUGHSPACE;
+    }
+    int mapped = mapFileBlocks(inode, oldNumBlocks, freeBlocks);
+    if (mapped < 0) {
+        freeDataBlocks(freeBlocks);
+        return mapped;
+    }
+    if (zeroTo <= inode.size) {
+        return 0;
+    }
 
-    // Write the updated data bitmap back to the disk
-    for (int i = 0; i < super.data_bitmap_len; i++) {
-        disk->writeBlock(super.data_bitmap_addr + i, &dataBitmap[i * UFS_BLOCK_SIZE]);
+    // what is left past the end of the old last block
+    int from = inode.size;
+    if (from % UFS_BLOCK_SIZE != 0) {
+        char block[UFS_BLOCK_SIZE];
+        int blockStart = from - from % UFS_BLOCK_SIZE;
+        int blockNumber = fileBlock(inode, from / UFS_BLOCK_SIZE);
+        disk->readBlock(blockNumber, block);
+        memset(block + from % UFS_BLOCK_SIZE, 0, min(zeroTo - blockStart, UFS_BLOCK_SIZE) - from % UFS_BLOCK_SIZE);
+        disk->writeBlock(blockNumber, block);
+        from = blockStart + UFS_BLOCK_SIZE;
     }
-    
 
-    return bytesWritten;
-    // return 0;
+    // the rest are new blocks, which nothing on disk points to yet
+    static char zeroBlock[UFS_BLOCK_SIZE];
+    int firstNew = from / UFS_BLOCK_SIZE;
+    int lastNew = (zeroTo + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    for (int i = firstNew; i < lastNew; i += UFS_PTRS_PER_BLOCK) {
+        vector<int> blocks;
+        fileBlocks(inode, i, min(UFS_PTRS_PER_BLOCK, lastNew - i), blocks);
+        for (size_t b = 0; b < blocks.size(); b++) {
+            disk->writeUnloggedBlock(blocks[b], zeroBlock);
+        }
+    }
+    return 0;
+}
+
+int LocalFileSystem::appendBlock(WriteSession &session, const void *buffer, int size) {
+    if (session.error != 0) {
+        return session.error;
+    }
+
+    if (size <= 0 || size > UFS_BLOCK_SIZE || session.size + size > maxFileSize()) {
+        session.error = -EINVALIDSIZE;
+        return session.error;
+    }
+
+    pthread_mutex_lock(&metadataLock);
+    int bit = dataBitmap.allocate();
+    if (bit >= 0) {
+        reservedBlocks.insert(bit);
+    }
+    pthread_mutex_unlock(&metadataLock);
+    if (bit < 0) {
+        session.error = -ENOTENOUGHSPACE;
+        return session.error;
+    }
+
+    // Nothing points at the block until the session commits, so it
+    // doesn't need to be part of a transaction
+    char block[UFS_BLOCK_SIZE];
+    memcpy(block, buffer, size);
+    memset(block + size, 0, UFS_BLOCK_SIZE - size);
+    disk->writeUnloggedBlock(super.data_region_addr + bit, block);
+
+    session.blocks.push_back(super.data_region_addr + bit);
+    session.size += size;
+    return 0;
+}
+
+int LocalFileSystem::commitWrite(int inodeNumber, WriteSession &session) {
+    if (!validInode(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+    lockInode(inodeNumber, true);
+    int result = commitWriteLocked(inodeNumber, session);
+    unlockInode(inodeNumber);
+    return result;
+}
+
+int LocalFileSystem::commitWriteLocked(int inodeNumber, WriteSession &session) {
+    inode_t inode;
+    if (stat(inodeNumber, &inode) != 0 || !inodeAllocated(inodeNumber)) {
+        return -EINVALIDINODE;
+    }
+
+    if (inode.type != UFS_REGULAR_FILE) {
+        return -EINVALIDTYPE;
+    }
+
+    if (session.error != 0) {
+        return session.error;
+    }
+
+    // Map the new blocks in a copy of the inode, the old blocks are still
+    // needed to free them
+    inode_t newInode = inode;
+    fill(newInode.direct, newInode.direct + DIRECT_PTRS, 0);
+    int mapped = mapFileBlocks(newInode, 0, session.blocks);
+    if (mapped < 0) {
+        return mapped;
+    }
+    freeFileBlocks(inode, 0, (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+    pthread_mutex_lock(&metadataLock);
+    for (size_t i = 0; i < session.blocks.size(); i++) {
+        reservedBlocks.erase(session.blocks[i] - super.data_region_addr);
+    }
+    pthread_mutex_unlock(&metadataLock);
+    newInode.size = session.size;
+    writeInode(inodeNumber, newInode);
+    writeMetadata();
+
+    session.blocks.clear();
+    return newInode.size;
+}
+
+void LocalFileSystem::abortWrite(WriteSession &session) {
+    pthread_mutex_lock(&metadataLock);
+    for (size_t i = 0; i < session.blocks.size(); i++) {
+        dataBitmap.clear(session.blocks[i] - super.data_region_addr);
+        reservedBlocks.erase(session.blocks[i] - super.data_region_addr);
+    }
+    pthread_mutex_unlock(&metadataLock);
+    session.blocks.clear();
+    writeMetadata();
 }
 
 int LocalFileSystem::unlink(int parentInodeNumber, std::string name) {
@@ -357,13 +1146,9 @@ int LocalFileSystem::unlink(int parentInodeNumber, std::string name) {
         return -EINVALIDNAME;
     }
 
-    // Read the superblock
-    super_t super;
-    readSuperBlock(&super);
-
     // Check if the parent inode number is valid
     inode_t parentInode;
-    if (stat(parentInodeNumber, &parentInode) < 0) {
+    if (!validInode(parentInodeNumber) || stat(parentInodeNumber, &parentInode) < 0) {
         return -EINVALIDINODE;
     }
 
@@ -372,172 +1157,252 @@ int LocalFileSystem::unlink(int parentInodeNumber, std::string name) {
         return -EINVALIDTYPE;
     }
 
-    // Read the directory entries
-    char buffer[UFS_BLOCK_SIZE];
-    int bytesRead = read(parentInodeNumber, buffer, UFS_BLOCK_SIZE);
+    // The index tells us whether there is anything to do without a scan.
+    // The entry is locked too, so nobody is reading or writing it, or
+    // creating files in it, while it goes away.
+    lockInode(parentInodeNumber, true);
+    int entryInodeNumber = lockEntry(parentInodeNumber, name);
+    if (entryInodeNumber < 0) {
+        unlockInode(parentInodeNumber);
+        if (entryInodeNumber == -ENOTFOUND) {
+            return 0;  // Not a failure according to the problem statement
+        }
+        return entryInodeNumber;
+    }
+    int result = unlinkLocked(parentInodeNumber, entryInodeNumber, name);
+    unlockEntry(parentInodeNumber, entryInodeNumber);
+    return result;
+}
+
+int LocalFileSystem::unlinkLocked(int parentInodeNumber, int entryInodeNumber, const string &name) {
+    // Read the directory entries and find the one with the given name
+    inode_t parentInode;
+    stat(parentInodeNumber, &parentInode);
+    vector<dir_ent_t> entries;
+    int bytesRead = readDirectory(parentInodeNumber, parentInode, entries);
     if (bytesRead < 0) {
         return bytesRead;  // Propagate the error code
     }
 
-    // Find the entry with the given name
-    dir_ent_t* entry = nullptr;
     int entryIndex = -1;
-    for (int i = 0; i < bytesRead; i += sizeof(dir_ent_t)) {
-        dir_ent_t* currentEntry = reinterpret_cast<dir_ent_t*>(buffer + i);
-        if (currentEntry->name == name) {
-            entry = currentEntry;
+    for (int i = 0; i < (int)entries.size(); i++) {
+        if (entries[i].inum != -1 && strcmp(entries[i].name, name.c_str()) == 0) {
             entryIndex = i;
             break;
         }
     }
-
-    // Entry not found
-    if (entry == nullptr) {
-        return 0;  // Not a failure according to the problem statement
-    }
-
-    // Check if the entry inode number is valid
-    if (entry->inum < 0 || entry->inum >= super.num_inodes) {
-        return -EINVALIDINODE;
+    if (entryIndex == -1) {
+        return -EINVALIDINODE;  // The index and the directory disagree
     }
 
     inode_t entryInode;
-    if (stat(entry->inum, &entryInode) < 0) {
+    if (stat(entryInodeNumber, &entryInode) < 0) {
         return -EINVALIDINODE;
     }
 
     // Handle directory unlink
     if (entryInode.type == UFS_DIRECTORY) {
         // Check if the directory is empty
-        bool isEmpty = true;
-        char dirBuffer[UFS_BLOCK_SIZE];
-        int dirBytesRead = read(entry->inum, dirBuffer, UFS_BLOCK_SIZE);
-        if (dirBytesRead < 0) {
-            return dirBytesRead;  // Propagate the error code
+        vector<dir_ent_t> dirEntries;
+        if (readDirectory(entryInodeNumber, entryInode, dirEntries) < 0) {
+            return -EINVALIDINODE;
         }
 
-        for (int i = 0; i < dirBytesRead; i += sizeof(dir_ent_t)) {
-            dir_ent_t* dirEntry = reinterpret_cast<dir_ent_t*>(dirBuffer + i);
-            if (strcmp(dirEntry->name, ".") != 0 && strcmp(dirEntry->name, "..") != 0 && dirEntry->inum != 0) {
-                isEmpty = false;
-                break;
+        for (size_t i = 0; i < dirEntries.size(); i++) {
+            if (strcmp(dirEntries[i].name, ".") != 0 && strcmp(dirEntries[i].name, "..") != 0 && dirEntries[i].inum != -1) {
+                return -EDIRNOTEMPTY;
             }
         }
-
-        if (!isEmpty) {
-            return -EDIRNOTEMPTY;
-        }
-
-        // Deallocate the blocks used by the directory
-        vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
-        vector<unsigned char> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
-        readInodeBitmap(&super, inodeBitmap.data());
-        readDataBitmap(&super, dataBitmap.data());
-
-        inodeBitmap[entry->inum / 8] &= ~(1 << (entry->inum % 8));
-        for (int i = 0; i < DIRECT_PTRS && entryInode.direct[i] != 0; i++) {
-            int blockIndex = entryInode.direct[i] - super.data_region_addr;
-            dataBitmap[blockIndex / 8] &= ~(1 << (blockIndex % 8));
-        }
-
-        writeInodeBitmap(&super, inodeBitmap.data());
-        writeDataBitmap(&super, dataBitmap.data());
     }
 
-    // Handle file unlink
-    if (entryInode.type == UFS_REGULAR_FILE) {
-        // Deallocate the blocks used by the file
-        vector<unsigned char> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
-        readDataBitmap(&super, dataBitmap.data());
+    // Deallocate the blocks used by the file or directory and its inode
+    freeFileBlocks(entryInode, 0, (entryInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+    freeInode(entryInodeNumber);
 
-        for (int i = 0; i < DIRECT_PTRS && entryInode.direct[i] != 0; i++) {
-            int blockIndex = entryInode.direct[i] - super.data_region_addr;
-            dataBitmap[blockIndex / 8] &= ~(1 << (blockIndex % 8));
-        }
+    // Remove the entry from the parent directory, later entries move down one slot
+    entries.erase(entries.begin() + entryIndex);
+    parentInode.size -= sizeof(dir_ent_t);
 
-        writeDataBitmap(&super, dataBitmap.data());
+    // Rewrite the blocks from the removed entry on, and free the last
+    // block if it no longer holds any entries
+    int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+    int oldNumBlocks = (entries.size() + 1 + entriesPerBlock - 1) / entriesPerBlock;
+    int newNumBlocks = max(1, (int)(entries.size() + entriesPerBlock - 1) / entriesPerBlock);
+    for (int i = entryIndex / entriesPerBlock; i < newNumBlocks; i++) {
+        writeDirectoryBlock(parentInode, entries, i);
     }
+    freeFileBlocks(parentInode, newNumBlocks, oldNumBlocks);
+
+    // Update the parent inode, and write the bitmap and inode blocks we changed
+    writeInode(parentInodeNumber, parentInode);
+    writeMetadata();
+
+    pthread_rwlock_wrlock(&cacheLock);
+    directoryIndexes[parentInodeNumber].erase(name);
+    directoryIndexes.erase(entryInodeNumber);
+    unordered_map<int, string>::iterator path = dentryPaths.find(entryInodeNumber);
+    if (path != dentryPaths.end()) {
+        dentries.erase(path->second);
+        dentryPaths.erase(path);
+    }
+    negativeDentries.clear();
+    namespaceGeneration++;
+    pthread_rwlock_unlock(&cacheLock);
+    return 0;
+}
 
-    // Deallocate the target inode
-    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
-    readInodeBitmap(&super, inodeBitmap.data());
-
-    inodeBitmap[entry->inum / 8] &= ~(1 << (entry->inum % 8));
-    writeInodeBitmap(&super, inodeBitmap.data());
-
-    // Remove the entry from the parent directory
-    memmove(buffer + entryIndex, buffer + entryIndex + sizeof(dir_ent_t), bytesRead - entryIndex - sizeof(dir_ent_t));
-    bytesRead -= sizeof(dir_ent_t);
-    parentInode.size -= sizeof(dir_ent_t);
+int LocalFileSystem::resolvePath(const string &path) {
+  size_t begin = path.find_first_not_of('/');
+  if (begin == string::npos) {
+    return UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  }
+  size_t end = path.find_last_not_of('/');
+  string key = path.substr(begin, end - begin + 1);
+
+  // the warm path: one probe for the whole path
+  pthread_rwlock_rdlock(&cacheLock);
+  unsigned long generation = namespaceGeneration;
+  bool hit = false;
+  int inodeNumber = 0;
+  unordered_map<string, int>::iterator cached = dentries.find(key);
+  if (cached != dentries.end()) {
+    hit = true;
+    inodeNumber = cached->second;
+  } else {
+    cached = negativeDentries.find(key);
+    if (cached != negativeDentries.end()) {
+      hit = true;
+      inodeNumber = cached->second;
+    }
+  }
+  pthread_rwlock_unlock(&cacheLock);
+  if (hit) {
+    return inodeNumber;
+  }
 
-    // Update the parent directory block
-    this->disk->writeBlock(parentInode.direct[0], buffer);
+  // walk the path, reusing the entries for its prefixes and collecting
+  // the ones to fill in
+  vector<pair<string, int> > found;
+  inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  bool cacheable = true;
+  size_t start = 0;
+  while (true) {
+    size_t slash = key.find('/', start);
+    string name = key.substr(start, slash == string::npos ? string::npos : slash - start);
+    string prefix = key.substr(0, slash);
+    if (name == "." || name == "..") {
+      cacheable = false;
+    }
 
-    // Update the parent inode
-    parentInode.size = bytesRead;
-    int parentInodeBlockNumber = super.inode_region_addr + (parentInodeNumber / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-    int parentInodeOffset = (parentInodeNumber % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t);
+    int next = -ENOTFOUND;
+    bool known = false;
+    if (cacheable) {
+      pthread_rwlock_rdlock(&cacheLock);
+      cached = dentries.find(prefix);
+      known = cached != dentries.end();
+      if (known) {
+        next = cached->second;
+      }
+      pthread_rwlock_unlock(&cacheLock);
+    }
+    if (!known) {
+      next = lookup(inodeNumber, name);
+      if (cacheable && next >= 0) {
+        found.push_back(make_pair(prefix, next));
+      }
+    }
 
-    char parentBlock[UFS_BLOCK_SIZE];
-    disk->readBlock(parentInodeBlockNumber, parentBlock);
-    memcpy(parentBlock + parentInodeOffset, &parentInode, sizeof(inode_t));
-    disk->writeBlock(parentInodeBlockNumber, parentBlock);
+    if (next < 0 || slash == string::npos) {
+      inodeNumber = next;
+      break;
+    }
+    inodeNumber = next;
+    start = slash + 1;
+  }
 
-    return 0;
+  // Nothing is added if a create or unlink ran since we started, what we
+  // found might already be out of date
+  bool negative = inodeNumber < 0 && cacheable;
+  if (found.empty() && !negative) {
+    return inodeNumber;
+  }
+  pthread_rwlock_wrlock(&cacheLock);
+  if (namespaceGeneration == generation) {
+    for (size_t i = 0; i < found.size(); i++) {
+      dentries[found[i].first] = found[i].second;
+      dentryPaths[found[i].second] = found[i].first;
+    }
+    // remember the failure for the whole path, and keep a flood of
+    // requests for missing paths from growing the cache without bound
+    if (negative) {
+      if (negativeDentries.size() >= MAX_NEGATIVE_DENTRIES) {
+        negativeDentries.clear();
+      }
+      negativeDentries[key] = inodeNumber;
+    }
+  }
+  pthread_rwlock_unlock(&cacheLock);
+  return inodeNumber;
 }
 
 void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
     assert(super != nullptr && inodeBitmap != nullptr); // Ensure pointers are valid
-    for (int i = 0; i < super->inode_bitmap_len; i++) {
-        disk->readBlock(super->inode_bitmap_addr + i, &inodeBitmap[i * UFS_BLOCK_SIZE]);
-    }
+    pthread_mutex_lock(&metadataLock);
+    memcpy(inodeBitmap, this->inodeBitmap.data(), super->inode_bitmap_len * UFS_BLOCK_SIZE);
+    pthread_mutex_unlock(&metadataLock);
 }
 
 void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
     assert(super != nullptr && dataBitmap != nullptr); // Ensure pointers are valid
-    for (int i = 0; i < super->data_bitmap_len; i++) {
-        disk->readBlock(super->data_bitmap_addr + i, &dataBitmap[i * UFS_BLOCK_SIZE]);
-    }
+    pthread_mutex_lock(&metadataLock);
+    memcpy(dataBitmap, this->dataBitmap.data(), super->data_bitmap_len * UFS_BLOCK_SIZE);
+    pthread_mutex_unlock(&metadataLock);
 }
 
+// Only the bitmap blocks that differ from the cached copy are written
 void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
     assert(super != nullptr && inodeBitmap != nullptr); // Ensure pointers are valid
+    pthread_mutex_lock(&metadataLock);
     for (int i = 0; i < super->inode_bitmap_len; i++) {
-        disk->writeBlock(super->inode_bitmap_addr + i, &inodeBitmap[i * UFS_BLOCK_SIZE]);
+        unsigned char *block = this->inodeBitmap.data() + i * UFS_BLOCK_SIZE;
+        if (memcmp(block, &inodeBitmap[i * UFS_BLOCK_SIZE], UFS_BLOCK_SIZE) != 0) {
+            memcpy(block, &inodeBitmap[i * UFS_BLOCK_SIZE], UFS_BLOCK_SIZE);
+            this->inodeBitmap.markDirty(i);
+        }
     }
+    pthread_mutex_unlock(&metadataLock);
+    writeMetadata();
 }
 
 void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
     assert(super != nullptr && dataBitmap != nullptr); // Ensure pointers are valid
+    pthread_mutex_lock(&metadataLock);
     for (int i = 0; i < super->data_bitmap_len; i++) {
-        disk->writeBlock(super->data_bitmap_addr + i, &dataBitmap[i * UFS_BLOCK_SIZE]);
+        unsigned char *block = this->dataBitmap.data() + i * UFS_BLOCK_SIZE;
+        if (memcmp(block, &dataBitmap[i * UFS_BLOCK_SIZE], UFS_BLOCK_SIZE) != 0) {
+            memcpy(block, &dataBitmap[i * UFS_BLOCK_SIZE], UFS_BLOCK_SIZE);
+            this->dataBitmap.markDirty(i);
+        }
     }
+    pthread_mutex_unlock(&metadataLock);
+    writeMetadata();
 }
 
 void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
     assert(super != nullptr && inodes != nullptr); // Ensure pointers are valid
-    int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-    int numInodeBlocks = (super->num_inodes + inodesPerBlock - 1) / inodesPerBlock;
-
-    for (int i = 0; i < numInodeBlocks; i++) {
-        char buffer[UFS_BLOCK_SIZE];
-        int inodesInThisBlock = min(inodesPerBlock, super->num_inodes - i * inodesPerBlock);
-        memcpy(buffer, inodes + i * inodesPerBlock, inodesInThisBlock * sizeof(inode_t));
-        disk->writeBlock(super->inode_region_addr + i, buffer);
+    for (int i = 0; i < super->num_inodes; i++) {
+        inode_t current;
+        stat(i, &current);
+        if (memcmp(&current, &inodes[i], sizeof(inode_t)) != 0) {
+            writeInode(i, inodes[i]);
+        }
     }
+    writeMetadata();
 }
 
 void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
     assert(super != nullptr && inodes != nullptr); // Ensure pointers are valid
-    int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-    int numInodeBlocks = (super->num_inodes + inodesPerBlock - 1) / inodesPerBlock;
-
-    for (int i = 0; i < numInodeBlocks; i++) {
-        char buffer[UFS_BLOCK_SIZE];
-        disk->readBlock(super->inode_region_addr + i, buffer);
-        int inodesInThisBlock = min(inodesPerBlock, super->num_inodes - i * inodesPerBlock);
-        memcpy(inodes + i * inodesPerBlock, buffer, inodesInThisBlock * sizeof(inode_t));
+    for (int i = 0; i < super->num_inodes; i++) {
+        stat(i, &inodes[i]);
     }
 }
-
-
@@ -8,7 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-MyServerSocket::MyServerSocket(int port)
+MyServerSocket::MyServerSocket(int port, int backlog, bool reusePort)
 {
     struct sockaddr_in server;
     int one = 1;
@@ -23,6 +23,12 @@ MyServerSocket::MyServerSocket(int port)
     if (setsockopt(serverFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(int)) == -1) {
       throw SocketError("error with set socket opts");
     }
+
+    // every listener that sets this can bind the same port, and the kernel
+    // spreads new connections across them
+    if (reusePort && setsockopt(serverFd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(int)) == -1) {
+      throw SocketError("error setting SO_REUSEPORT");
+    }
     
     if( bind(serverFd,(struct sockaddr *) &server, sizeof(server)) ==-1){
         char str[1024];
@@ -30,8 +36,11 @@ MyServerSocket::MyServerSocket(int port)
         throw SocketError(str);
     }	
     
-    //set up a listen queue
-    listen(serverFd, 10);
+    //set up a listen queue, connections past the backlog are dropped
+    //until we accept some
+    if (listen(serverFd, backlog) == -1) {
+      throw SocketError("could not listen");
+    }
 }
 
 MySocket *MyServerSocket::accept()
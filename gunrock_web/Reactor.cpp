@@ -0,0 +1,423 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <sstream>
+#include <vector>
+
+#include "Reactor.h"
+#include "dthread.h"
+
+using namespace std;
+
+#define MAX_EVENTS 256
+// how much one connection can read before the event loop moves on to the
+// others, so a big upload doesn't hold up everyone else
+#define READ_BUDGET (1024 * 1024)
+
+static void setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    throw SocketError("could not make socket non-blocking");
+  }
+}
+
+static string describe(ReactorConnection *conn) {
+  stringstream payload;
+  payload << " client: " << (void *) conn->socket;
+  return payload.str();
+}
+
+Reactor::Reactor(MyServerSocket *server, int keepAliveSeconds, int maxRequests,
+                 void (*serve)(MySocket *client, HTTPRequest *request, HTTPResponse *response)) {
+  this->server = server;
+  this->keepAliveSeconds = keepAliveSeconds;
+  this->maxRequests = maxRequests;
+  this->serveRequest = serve;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+
+  // every idle connection is a file descriptor, so allow as many as the
+  // hard limit lets us have
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    throw SocketError("could not create epoll instance");
+  }
+
+  setNonBlocking(server->getFd());
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, server->getFd(), &event) < 0) {
+    throw SocketError("could not watch the server socket");
+  }
+}
+
+Reactor::~Reactor() {
+  ::close(epollFd);
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&notEmpty);
+}
+
+void Reactor::run() {
+  struct epoll_event events[MAX_EVENTS];
+  time_t lastSweep = time(NULL);
+
+  while (true) {
+    int count = epoll_wait(epollFd, events, MAX_EVENTS, 1000);
+    if (count < 0 && errno != EINTR) {
+      throw SocketError("epoll_wait failed");
+    }
+
+    for (int idx = 0; idx < count; idx++) {
+      ReactorConnection *conn = (ReactorConnection *) events[idx].data.ptr;
+      if (conn == NULL) {
+        acceptConnections();
+        continue;
+      }
+
+      // one shot registrations deliver one event per arm, so this thread
+      // owns the connection until it arms it again or passes it on
+      dthread_mutex_lock(&lock);
+      ReactorConnection::State state = conn->state;
+      conn->state = ReactorConnection::BUSY;
+      dthread_mutex_unlock(&lock);
+
+      if (state == ReactorConnection::WRITING) {
+        // the worker carries on pulling the body, which can block
+        dispatch(conn);
+      } else {
+        onReadable(conn);
+      }
+    }
+
+    if (keepAliveSeconds > 0 && time(NULL) != lastSweep) {
+      lastSweep = time(NULL);
+      closeIdleConnections();
+    }
+  }
+}
+
+void Reactor::work() {
+  while (true) {
+    dthread_mutex_lock(&lock);
+    while (ready.empty()) {
+      dthread_cond_wait(&notEmpty, &lock);
+    }
+    ReactorConnection *conn = ready.front();
+    ready.pop_front();
+    dthread_mutex_unlock(&lock);
+
+    if (conn->response != NULL) {
+      flush(conn);
+    } else {
+      serve(conn);
+    }
+  }
+}
+
+void Reactor::acceptConnections() {
+  // edge triggered: keep accepting until the backlog is empty or we will
+  // not hear about the connections still in it
+  while (true) {
+    int fd = accept4(server->getFd(), NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        sync_print("accept_error", strerror(errno));
+      }
+      return;
+    }
+
+    ReactorConnection *conn = new ReactorConnection();
+    conn->fd = fd;
+    conn->socket = new MySocket(fd);
+    conn->request = NULL;
+    conn->response = NULL;
+    conn->written = 0;
+    conn->fileSent = 0;
+    conn->chunkSent = 0;
+    conn->served = 0;
+    conn->peerClosed = false;
+    conn->closeAfterWrite = false;
+    conn->state = ReactorConnection::READING;
+    conn->lastActive = time(NULL);
+    sync_print("client_accepted", describe(conn));
+
+    dthread_mutex_lock(&lock);
+    connections.insert(conn);
+    dthread_mutex_unlock(&lock);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      dthread_mutex_lock(&lock);
+      conn->state = ReactorConnection::BUSY;
+      dthread_mutex_unlock(&lock);
+      close(conn);
+    }
+  }
+}
+
+void Reactor::onReadable(ReactorConnection *conn) {
+  char buffer[65536];
+  size_t total = 0;
+
+  while (total < READ_BUDGET) {
+    ssize_t ret = ::read(conn->fd, buffer, sizeof(buffer));
+    if (ret > 0) {
+      conn->input.append(buffer, ret);
+      total += ret;
+    } else if (ret == 0) {
+      conn->peerClosed = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      close(conn);
+      return;
+    }
+  }
+
+  conn->lastActive = time(NULL);
+  advance(conn);
+}
+
+void Reactor::advance(ReactorConnection *conn) {
+  if (conn->request == NULL) {
+    if (conn->input.empty() && conn->peerClosed) {
+      close(conn);
+      return;
+    }
+    conn->request = new HTTPRequest(conn->socket, 0);
+  }
+
+  bool complete;
+  try {
+    complete = conn->request->parse(conn->input);
+  } catch (...) {
+    sync_print("read_request_error", describe(conn));
+    close(conn);
+    return;
+  }
+
+  if (complete) {
+    dispatch(conn);
+  } else if (conn->peerClosed) {
+    // the client hung up partway through a request
+    close(conn);
+  } else {
+    arm(conn, ReactorConnection::READING);
+  }
+}
+
+void Reactor::dispatch(ReactorConnection *conn) {
+  dthread_mutex_lock(&lock);
+  ready.push_back(conn);
+  dthread_cond_signal(&notEmpty);
+  dthread_mutex_unlock(&lock);
+}
+
+void Reactor::serve(ReactorConnection *conn) {
+  HTTPRequest *request = conn->request;
+  HTTPResponse *response = new HTTPResponse();
+  conn->request = NULL;
+  conn->served++;
+
+  bool keepAlive = keepAliveSeconds > 0 && conn->served < maxRequests &&
+    !conn->peerClosed && request->keepAlive();
+  response->setHeader("Connection", keepAlive ? "keep-alive" : "close");
+  serveRequest(conn->socket, request, response);
+
+  conn->response = response;
+  conn->head = response->head();
+  conn->written = 0;
+  conn->fileSent = 0;
+  conn->chunk.clear();
+  conn->chunkSent = 0;
+  conn->closeAfterWrite = !keepAlive;
+  delete request;
+
+  flush(conn);
+}
+
+void Reactor::flush(ReactorConnection *conn) {
+  HTTPResponse *response = conn->response;
+  const string &head = conn->head;
+  static const string none;
+  const string *contents = response->isChunked() ? NULL : response->getBodySource()->contents();
+  if (contents == NULL) {
+    contents = &none;
+  }
+  off_t fileOffset = 0;
+  int file = response->isChunked() ? -1 : response->getBodySource()->file(&fileOffset);
+  size_t fileLength = file >= 0 ? response->getBodySource()->length() : 0;
+  // hold the headers back for the body that follows them, if any does
+  bool more = contents == &none &&
+    (response->isChunked() || response->getBodySource()->length() != 0);
+
+  while (true) {
+    ssize_t ret;
+    enum { HEAD, FILE, CHUNK } part;
+    try {
+      if (conn->written < head.size() + contents->size()) {
+        // headers and an in memory body in one gathering write
+        struct iovec iov[2];
+        int count = 0;
+        if (conn->written < head.size()) {
+          iov[count].iov_base = (void *) (head.data() + conn->written);
+          iov[count].iov_len = head.size() - conn->written;
+          count++;
+        }
+        size_t bodyOffset = conn->written > head.size() ? conn->written - head.size() : 0;
+        iov[count].iov_base = (void *) (contents->data() + bodyOffset);
+        iov[count].iov_len = contents->size() - bodyOffset;
+        count++;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        part = HEAD;
+      } else if (file >= 0) {
+        if (conn->fileSent == fileLength) {
+          break;
+        }
+        off_t offset = fileOffset + conn->fileSent;
+        ret = sendfile(conn->fd, file, &offset, fileLength - conn->fileSent);
+        part = FILE;
+      } else {
+        if (conn->chunkSent == conn->chunk.size()) {
+          if (!response->nextChunk(conn->chunk)) {
+            break;
+          }
+          conn->chunkSent = 0;
+        }
+        ret = send(conn->fd, conn->chunk.data() + conn->chunkSent,
+                   conn->chunk.size() - conn->chunkSent, MSG_NOSIGNAL);
+        part = CHUNK;
+      }
+    } catch (...) {
+      // the body can't be produced, and we've already promised it
+      close(conn);
+      return;
+    }
+
+    if (ret > 0) {
+      if (part == HEAD) {
+        conn->written += ret;
+      } else if (part == FILE) {
+        conn->fileSent += ret;
+      } else {
+        conn->chunkSent += ret;
+      }
+      conn->lastActive = time(NULL);
+    } else if (ret < 0 && errno == EINTR) {
+      continue;
+    } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      arm(conn, ReactorConnection::WRITING);
+      return;
+    } else {
+      // the client went away, or the file got shorter than the
+      // Content-Length we sent, either way the connection is done
+      close(conn);
+      return;
+    }
+  }
+
+  delete conn->response;
+  conn->response = NULL;
+  conn->head.clear();
+  conn->chunk.clear();
+  conn->chunkSent = 0;
+  if (conn->closeAfterWrite) {
+    close(conn);
+  } else {
+    // a pipelining client may already have sent the next request
+    advance(conn);
+  }
+}
+
+void Reactor::arm(ReactorConnection *conn, ReactorConnection::State state) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLET | EPOLLONESHOT;
+  event.events |= state == ReactorConnection::WRITING ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = conn;
+
+  // The state has to be set first, once the connection is armed the event
+  // loop can pick it up at any time. Once it's set the idle sweep can
+  // close the connection too, so the descriptor is read before, and a
+  // fresh lastActive keeps the sweep off it until the connection has had
+  // its keep-alive time in epoll.
+  int fd = conn->fd;
+  conn->lastActive = time(NULL);
+  dthread_mutex_lock(&lock);
+  conn->state = state;
+  dthread_mutex_unlock(&lock);
+
+  if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    // we never got it back to epoll, and it isn't idle, so we still own it
+    dthread_mutex_lock(&lock);
+    conn->state = ReactorConnection::BUSY;
+    dthread_mutex_unlock(&lock);
+    close(conn);
+  }
+}
+
+void Reactor::close(ReactorConnection *conn) {
+  dthread_mutex_lock(&lock);
+  connections.erase(conn);
+  dthread_mutex_unlock(&lock);
+
+  sync_print("close_connection", describe(conn));
+  // closing the descriptor also takes it out of the epoll set
+  conn->socket->close();
+  delete conn->socket;
+  delete conn->request;
+  delete conn->response;
+  delete conn;
+}
+
+void Reactor::closeIdleConnections() {
+  time_t cutoff = time(NULL) - keepAliveSeconds;
+  vector<ReactorConnection *> idle;
+
+  // Only connections that are waiting in epoll can be idle. Taking them
+  // out of epoll's hands here is safe because this thread is the only one
+  // that gets their events.
+  dthread_mutex_lock(&lock);
+  set<ReactorConnection *>::iterator iter;
+  for (iter = connections.begin(); iter != connections.end(); iter++) {
+    ReactorConnection *conn = *iter;
+    if (conn->state != ReactorConnection::BUSY && conn->lastActive <= cutoff) {
+      conn->state = ReactorConnection::BUSY;
+      idle.push_back(conn);
+    }
+  }
+  dthread_mutex_unlock(&lock);
+
+  for (size_t idx = 0; idx < idle.size(); idx++) {
+    close(idle[idx]);
+  }
+}
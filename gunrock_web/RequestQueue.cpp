@@ -0,0 +1,167 @@
+#include <limits.h>
+
+#include "RequestQueue.h"
+#include "dthread.h"
+
+using namespace std;
+
+RequestQueue::RequestQueue(int capacity) {
+  this->capacity = capacity;
+  this->count = 0;
+  this->sequence = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+  pthread_cond_init(&notFull, NULL);
+}
+
+RequestQueue::~RequestQueue() {
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&notEmpty);
+  pthread_cond_destroy(&notFull);
+}
+
+RequestQueue *RequestQueue::create(string policy, int capacity, long (*estimateCost)(MySocket *client)) {
+  if (policy == "FIFO") {
+    return new FifoRequestQueue(capacity);
+  } else if (policy == "SFF") {
+    return new SffRequestQueue(capacity, estimateCost);
+  } else if (policy == "FAIR") {
+    return new FairShareRequestQueue(capacity);
+  }
+  return NULL;
+}
+
+void RequestQueue::put(MySocket *client) {
+  add(client, true);
+}
+
+bool RequestQueue::offer(MySocket *client) {
+  return add(client, false);
+}
+
+bool RequestQueue::add(MySocket *client, bool wait) {
+  QueuedClient entry;
+  entry.client = client;
+  entry.cost = 0;
+  prepare(entry);
+
+  dthread_mutex_lock(&lock);
+  while (count >= capacity) {
+    if (!wait) {
+      dthread_mutex_unlock(&lock);
+      return false;
+    }
+    dthread_cond_wait(&notFull, &lock);
+  }
+  entry.sequence = sequence++;
+  push(entry);
+  count++;
+  dthread_cond_signal(&notEmpty);
+  dthread_mutex_unlock(&lock);
+  return true;
+}
+
+MySocket *RequestQueue::take() {
+  dthread_mutex_lock(&lock);
+  while (count == 0) {
+    dthread_cond_wait(&notEmpty, &lock);
+  }
+  QueuedClient entry = pop();
+  count--;
+  dthread_cond_signal(&notFull);
+  dthread_mutex_unlock(&lock);
+  return entry.client;
+}
+
+int RequestQueue::waiting() {
+  dthread_mutex_lock(&lock);
+  int waiting = count;
+  dthread_mutex_unlock(&lock);
+  return waiting;
+}
+
+void RequestQueue::prepare(QueuedClient &entry) {
+}
+
+FifoRequestQueue::FifoRequestQueue(int capacity) : RequestQueue(capacity) {
+}
+
+void FifoRequestQueue::push(const QueuedClient &entry) {
+  clients.push_back(entry);
+}
+
+QueuedClient FifoRequestQueue::pop() {
+  QueuedClient entry = clients.front();
+  clients.pop_front();
+  return entry;
+}
+
+SffRequestQueue::SffRequestQueue(int capacity, long (*estimateCost)(MySocket *client)) : RequestQueue(capacity) {
+  this->estimateCost = estimateCost;
+}
+
+void SffRequestQueue::prepare(QueuedClient &entry) {
+  entry.cost = estimateCost(entry.client);
+}
+
+void SffRequestQueue::push(const QueuedClient &entry) {
+  if (entry.cost == LONG_MAX) {
+    unknown.push_back(entry);
+  } else {
+    clients.push(entry);
+  }
+}
+
+QueuedClient SffRequestQueue::pop() {
+  deque<QueuedClient>::iterator iter = unknown.begin();
+  while (iter != unknown.end()) {
+    iter->cost = estimateCost(iter->client);
+    if (iter->cost == LONG_MAX) {
+      iter++;
+    } else {
+      clients.push(*iter);
+      iter = unknown.erase(iter);
+    }
+  }
+
+  QueuedClient entry;
+  if (!clients.empty()) {
+    entry = clients.top();
+    clients.pop();
+  } else {
+    entry = unknown.front();
+    unknown.pop_front();
+  }
+  return entry;
+}
+
+FairShareRequestQueue::FairShareRequestQueue(int capacity) : RequestQueue(capacity) {
+}
+
+void FairShareRequestQueue::prepare(QueuedClient &entry) {
+  entry.address = entry.client->peerAddress();
+}
+
+void FairShareRequestQueue::push(const QueuedClient &entry) {
+  deque<QueuedClient> &waiting = clientsByAddress[entry.address];
+  if (waiting.empty()) {
+    // a client that had nothing waiting goes to the back of the line
+    turns.push_back(entry.address);
+  }
+  waiting.push_back(entry);
+}
+
+QueuedClient FairShareRequestQueue::pop() {
+  string address = turns.front();
+  turns.pop_front();
+
+  deque<QueuedClient> &waiting = clientsByAddress[address];
+  QueuedClient entry = waiting.front();
+  waiting.pop_front();
+  if (waiting.empty()) {
+    clientsByAddress.erase(address);
+  } else {
+    turns.push_back(address);
+  }
+  return entry;
+}
@@ -0,0 +1,790 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "MySocket.h"
+#include "RequestQueue.h"
+#include "ufs.h"
+
+using namespace std;
+
+// ds3bench runs LocalFileSystem operations in a loop against a disk image
+// and reports the average latency and the number of read/write syscalls
+// per operation. It modifies the image, so run it on a scratch copy made
+// with mkfs, e.g.:
+//
+//   ./mkfs -f bench.img -i 4096 -d 4096 && ./ds3bench bench.img
+//
+// Directory sizes that need more inodes than the image has are skipped.
+//
+// The third argument is a cache size, "map" to map the image or "ring"
+// to use io_uring (see Disk::enableMapping and Disk::enableRing).
+//
+// Last comes a stress test: threads creating, reading and unlinking files
+// in one directory at the same time. It checks what each thread reads
+// back and that the bitmaps end up as they were. Then come checks of
+// files with holes in them, of two transactions that would deadlock, and
+// of SFF ranking a request that arrives after its connection was queued.
+// ds3bench exits with 1 if anything is off.
+
+#define BENCH_DIR "ds3bench"
+#define STRESS_DIR "ds3bench-stress"
+#define STRESS_THREADS 8
+#define READ_FILE_BLOCKS 4
+
+struct IoCounters {
+  long syscr;
+  long syscw;
+};
+
+// Linux keeps per-process syscall counters for read and write class
+// calls (read/pread/readv, write/pwrite/writev) in /proc/self/io.
+IoCounters readIoCounters() {
+  IoCounters counters = {-1, -1};
+  ifstream io("/proc/self/io");
+  string key;
+  long value;
+  while (io >> key >> value) {
+    if (key == "syscr:") {
+      counters.syscr = value;
+    } else if (key == "syscw:") {
+      counters.syscw = value;
+    }
+  }
+  return counters;
+}
+
+// Reading /proc/self/io takes a few read syscalls of its own, measure how
+// many so we can subtract them from every sample.
+long readIoOverhead() {
+  IoCounters first = readIoCounters();
+  IoCounters second = readIoCounters();
+  return second.syscr - first.syscr;
+}
+
+long ioOverhead = readIoOverhead();
+
+class Measurement {
+ public:
+  Measurement(string name) {
+    this->name = name;
+    this->iterations = 0;
+    this->elapsed = chrono::nanoseconds(0);
+    this->syscr = 0;
+    this->syscw = 0;
+  }
+
+  void start() {
+    startCounters = readIoCounters();
+    startTime = chrono::steady_clock::now();
+  }
+
+  // operations is for a sample that timed several at once
+  void stop(int operations = 1) {
+    elapsed += chrono::steady_clock::now() - startTime;
+    IoCounters stopCounters = readIoCounters();
+    syscr += stopCounters.syscr - startCounters.syscr - ioOverhead;
+    syscw += stopCounters.syscw - startCounters.syscw;
+    iterations += operations;
+  }
+
+  void print() {
+    if (iterations == 0) {
+      cout << name << "\tskipped" << endl;
+      return;
+    }
+    double usec = chrono::duration<double, micro>(elapsed).count() / iterations;
+    cout << name << "\t" << iterations << "\t" << usec << "\t"
+         << (double) syscr / iterations << "\t" << (double) syscw / iterations << endl;
+  }
+
+ private:
+  string name;
+  int iterations;
+  chrono::steady_clock::duration elapsed;
+  chrono::steady_clock::time_point startTime;
+  IoCounters startCounters;
+  long syscr;
+  long syscw;
+};
+
+// One thread of the parallel transaction benchmark. Each thread writes
+// its own free data blocks, so the transactions never wait on each other.
+struct TxnWorker {
+  Disk *disk;
+  vector<int> blocks;
+  int transactions;
+};
+
+void *runTransactions(void *arg) {
+  TxnWorker *worker = (TxnWorker *) arg;
+  char block[UFS_BLOCK_SIZE];
+  memset(block, 't', sizeof(block));
+  for (int i = 0; i < worker->transactions; i++) {
+    worker->disk->beginTransaction();
+    worker->disk->writeBlock(worker->blocks[i % worker->blocks.size()], block);
+    worker->disk->commit();
+  }
+  return NULL;
+}
+
+// One of two threads that write the same two blocks in opposite orders,
+// each round in one transaction. Both take their first block before
+// either goes for its second, so every round one of them is aborted and
+// runs its transaction again.
+struct ConflictWorker {
+  Disk *disk;
+  int first;
+  int second;
+  char fill;
+  int rounds;
+  pthread_barrier_t *barrier;
+  int commits;
+  int aborts;
+};
+
+void *runConflicts(void *arg) {
+  ConflictWorker *worker = (ConflictWorker *) arg;
+  char block[UFS_BLOCK_SIZE];
+  memset(block, worker->fill, sizeof(block));
+  for (int i = 0; i < worker->rounds; i++) {
+    for (bool retry = false; ; retry = true) {
+      worker->disk->beginTransaction();
+      worker->disk->writeBlock(worker->first, block);
+      if (!retry) {
+        pthread_barrier_wait(worker->barrier);
+      }
+      worker->disk->writeBlock(worker->second, block);
+      if (worker->disk->commit()) {
+        worker->commits++;
+        break;
+      }
+      worker->aborts++;
+    }
+    pthread_barrier_wait(worker->barrier);
+  }
+  return NULL;
+}
+
+// One thread of the parallel read benchmark, reading a whole file over
+// and over
+struct ReadWorker {
+  LocalFileSystem *lfs;
+  int inodeNumber;
+  int reads;
+};
+
+// readBlocksAsync's done, counting down the reads still out
+void readDone(void *arg) {
+  (*(int *) arg)--;
+}
+
+void *runReads(void *arg) {
+  ReadWorker *worker = (ReadWorker *) arg;
+  vector<char> buffer(READ_FILE_BLOCKS * UFS_BLOCK_SIZE);
+  for (int i = 0; i < worker->reads; i++) {
+    worker->lfs->pread(worker->inodeNumber, buffer.data(), buffer.size(), 0);
+  }
+  return NULL;
+}
+
+// One thread of the stress test. Each thread writes, reads back and
+// unlinks files of its own and checks them, and creates, looks up, reads
+// and unlinks files that all threads share.
+struct StressWorker {
+  LocalFileSystem *lfs;
+  int dir;
+  int id;
+  int rounds;
+  int failures;
+};
+
+void *runStress(void *arg) {
+  StressWorker *worker = (StressWorker *) arg;
+  LocalFileSystem *lfs = worker->lfs;
+  unsigned int seed = worker->id;
+  vector<char> data(3 * UFS_BLOCK_SIZE);
+  vector<char> readBack(data.size());
+  inode_t inode;
+  for (int i = 0; i < worker->rounds; i++) {
+    string own = "t" + to_string(worker->id) + "-" + to_string(i % 4);
+    int size = 1 + rand_r(&seed) % data.size();
+    memset(data.data(), 'a' + (worker->id + i) % 26, size);
+    int inodeNumber = lfs->create(worker->dir, UFS_REGULAR_FILE, own);
+    if (inodeNumber < 0 || lfs->write(inodeNumber, data.data(), size) != size ||
+        lfs->pread(inodeNumber, readBack.data(), size, 0) != size ||
+        memcmp(data.data(), readBack.data(), size) != 0 ||
+        lfs->stat(inodeNumber, &inode) != 0 || inode.size != size ||
+        lfs->resolvePath(string(STRESS_DIR) + "/" + own) != inodeNumber) {
+      worker->failures++;
+    }
+    if (i % 2 == 1 && lfs->unlink(worker->dir, own) != 0) {
+      worker->failures++;
+    }
+
+    // Another thread can unlink a shared file, and its inode can be
+    // reused, between our lookup and our read, so only errors count
+    string shared = "shared" + to_string(rand_r(&seed) % 8);
+    int found;
+    switch (rand_r(&seed) % 4) {
+    case 0:
+      if (lfs->create(worker->dir, UFS_REGULAR_FILE, shared) < 0) {
+        worker->failures++;
+      }
+      break;
+    case 1:
+      found = lfs->lookup(worker->dir, shared);
+      if (found >= 0) {
+        lfs->stat(found, &inode);
+        lfs->pread(found, readBack.data(), readBack.size(), 0);
+      } else if (found != -ENOTFOUND) {
+        worker->failures++;
+      }
+      break;
+    case 2:
+      found = lfs->resolvePath(string(STRESS_DIR) + "/" + shared);
+      if (found < 0 && found != -ENOTFOUND) {
+        worker->failures++;
+      }
+      break;
+    default:
+      if (lfs->unlink(worker->dir, shared) != 0) {
+        worker->failures++;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Writes past the end of a file, and truncating it to a larger size,
+// leave a hole, which has to read back as zeros. Returns how many checks failed.
+int checkHoles(LocalFileSystem &lfs, int dir) {
+  int failures = 0;
+  const char data[] = "0123456789";
+  int offsets[] = {2 * UFS_BLOCK_SIZE, 100, UFS_BLOCK_SIZE + 7};
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    string name = "hole" + to_string(i);
+    int offset = offsets[i];
+    int inodeNumber = lfs.create(dir, UFS_REGULAR_FILE, name);
+    vector<char> readBack(offset + 10, 'x');
+    if (inodeNumber < 0 || lfs.pwrite(inodeNumber, data, 10, offset) != 10 ||
+        lfs.pread(inodeNumber, readBack.data(), readBack.size(), 0) != (int) readBack.size() ||
+        vector<char>(readBack.begin(), readBack.begin() + offset) != vector<char>(offset, 0) ||
+        memcmp(readBack.data() + offset, data, 10) != 0) {
+      failures++;
+    }
+    lfs.unlink(dir, name);
+  }
+
+  // so does growing a file with truncate, including what a shrink left
+  // behind in its last block
+  int grownSize = 3 * UFS_BLOCK_SIZE + 7;
+  int inodeNumber = lfs.create(dir, UFS_REGULAR_FILE, "hole-truncate");
+  vector<char> readBack(grownSize, 'x');
+  vector<char> expected(grownSize, 0);
+  memcpy(expected.data(), data, 5);
+  if (inodeNumber < 0 || lfs.write(inodeNumber, data, 10) != 10 ||
+      lfs.truncate(inodeNumber, 5) != 0 || lfs.truncate(inodeNumber, grownSize) != 0 ||
+      lfs.pread(inodeNumber, readBack.data(), grownSize, 0) != grownSize || readBack != expected) {
+    failures++;
+  }
+  lfs.unlink(dir, "hole-truncate");
+  return failures;
+}
+
+// SFF's cost for a request line like "GET /<cost> ...", LONG_MAX until
+// it has arrived
+long requestCost(MySocket *client) {
+  string head = client->peek(64, 0);
+  if (head.compare(0, 5, "GET /") != 0 || head.find("\r\n") == string::npos) {
+    return LONG_MAX;
+  }
+  return atol(head.c_str() + 5);
+}
+
+// A small GET whose connection was queued before the request arrived
+// still goes ahead of a large one queued after it. Returns how many
+// connections came out in the wrong order.
+int checkSff() {
+  RequestQueue *queue = RequestQueue::create("SFF", 4, requestCost);
+  int smallPair[2];
+  int largePair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, smallPair) != 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, largePair) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+  MySocket *small = new MySocket(smallPair[0]);
+  MySocket *large = new MySocket(largePair[0]);
+
+  string largeRequest = "GET /1000000 HTTP/1.1\r\n\r\n";
+  string smallRequest = "GET /10 HTTP/1.1\r\n\r\n";
+  queue->put(small);
+  if (write(largePair[1], largeRequest.c_str(), largeRequest.size()) != (ssize_t) largeRequest.size()) {
+    perror("write");
+  }
+  queue->put(large);
+  if (write(smallPair[1], smallRequest.c_str(), smallRequest.size()) != (ssize_t) smallRequest.size()) {
+    perror("write");
+  }
+  int failures = 0;
+  if (queue->take() != small) {
+    failures++;
+  }
+  if (queue->take() != large) {
+    failures++;
+  }
+
+  delete small;
+  delete large;
+  close(smallPair[1]);
+  close(largePair[1]);
+  delete queue;
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    cout << argv[0] << ": diskImageFile [iterations] [cacheBlocks|map|ring]" << endl;
+    return 1;
+  }
+
+  int iterations = 1000;
+  if (argc >= 3) {
+    iterations = stoi(argv[2]);
+  }
+
+  Disk disk(argv[1], UFS_BLOCK_SIZE);
+  if (argc == 4 && string(argv[3]) == "map") {
+    disk.enableMapping();
+  } else if (argc == 4 && string(argv[3]) == "ring") {
+    if (!disk.enableRing()) {
+      cerr << "io_uring is not available, using pread and pwrite" << endl;
+    }
+  } else if (argc == 4 && stoi(argv[3]) > 0) {
+    disk.enableCache(stoi(argv[3]), false);
+  }
+  LocalFileSystem lfs(&disk);
+
+  int benchDir = lfs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, BENCH_DIR);
+  if (benchDir < 0) {
+    cerr << "Could not create " << BENCH_DIR << ": " << benchDir << endl;
+    return 1;
+  }
+
+  Measurement statBench("stat");
+  Measurement lookupBench("lookup");
+  Measurement resolveBench("resolve");
+  Measurement createBench("create");
+  Measurement createTxnBench("create-txn");
+  Measurement writeBench("write");
+  Measurement fullWriteBench("write-full");
+
+  inode_t inode;
+  for (int i = 0; i < iterations; i++) {
+    statBench.start();
+    lfs.stat(benchDir, &inode);
+    statBench.stop();
+  }
+
+  for (int i = 0; i < iterations; i++) {
+    lookupBench.start();
+    lfs.lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, BENCH_DIR);
+    lookupBench.stop();
+  }
+
+  // a deep path, resolved through the dentry cache
+  string deepPath = BENCH_DIR;
+  int parent = benchDir;
+  for (int depth = 0; depth < 5 && parent >= 0; depth++) {
+    string name = "d" + to_string(depth);
+    parent = lfs.create(parent, UFS_DIRECTORY, name);
+    deepPath += "/" + name;
+  }
+  for (int i = 0; i < iterations && parent >= 0; i++) {
+    resolveBench.start();
+    lfs.resolvePath(deepPath);
+    resolveBench.stop();
+  }
+
+  // creates and writes are undone with an untimed unlink so that the
+  // benchmark does not run out of inodes or data blocks
+  for (int i = 0; i < iterations; i++) {
+    string name = "create" + to_string(i);
+    createBench.start();
+    int inodeNumber = lfs.create(benchDir, UFS_REGULAR_FILE, name);
+    createBench.stop();
+    if (inodeNumber < 0) {
+      cerr << "create failed: " << inodeNumber << endl;
+      break;
+    }
+    lfs.unlink(benchDir, name);
+  }
+
+  // the same inside a transaction, the way the web service runs it, so
+  // the bitmap and inode blocks are written once at commit
+  for (int i = 0; i < iterations; i++) {
+    string name = "create" + to_string(i);
+    createTxnBench.start();
+    disk.beginTransaction();
+    int inodeNumber = lfs.create(benchDir, UFS_REGULAR_FILE, name);
+    disk.commit();
+    createTxnBench.stop();
+    if (inodeNumber < 0) {
+      cerr << "create failed: " << inodeNumber << endl;
+      break;
+    }
+    lfs.unlink(benchDir, name);
+  }
+
+  char buffer[UFS_BLOCK_SIZE];
+  memset(buffer, 'a', sizeof(buffer));
+  for (int i = 0; i < iterations; i++) {
+    string name = "write" + to_string(i);
+    int inodeNumber = lfs.create(benchDir, UFS_REGULAR_FILE, name);
+    if (inodeNumber < 0) {
+      cerr << "create failed: " << inodeNumber << endl;
+      break;
+    }
+    writeBench.start();
+    int ret = lfs.write(inodeNumber, buffer, sizeof(buffer));
+    writeBench.stop();
+    lfs.unlink(benchDir, name);
+    if (ret < 0) {
+      cerr << "write failed: " << ret << endl;
+      break;
+    }
+  }
+
+  // fill the disk with full-sized files and free the last one, so the
+  // remaining free blocks are at the end of the data bitmap
+  char fillBuffer[MAX_FILE_SIZE];
+  memset(fillBuffer, 'f', sizeof(fillBuffer));
+  int fillFiles = 0;
+  while (true) {
+    string name = "fill" + to_string(fillFiles);
+    int inodeNumber = lfs.create(benchDir, UFS_REGULAR_FILE, name);
+    if (inodeNumber < 0) {
+      break;
+    }
+    if (lfs.write(inodeNumber, fillBuffer, sizeof(fillBuffer)) < 0) {
+      lfs.unlink(benchDir, name);
+      break;
+    }
+    fillFiles++;
+  }
+  if (fillFiles > 0) {
+    lfs.unlink(benchDir, "fill" + to_string(fillFiles - 1));
+  }
+
+  for (int i = 0; i < iterations && fillFiles > 0; i++) {
+    string name = "full" + to_string(i);
+    int inodeNumber = lfs.create(benchDir, UFS_REGULAR_FILE, name);
+    if (inodeNumber < 0) {
+      cerr << "create failed: " << inodeNumber << endl;
+      break;
+    }
+    fullWriteBench.start();
+    int ret = lfs.write(inodeNumber, buffer, sizeof(buffer));
+    fullWriteBench.stop();
+    lfs.unlink(benchDir, name);
+    if (ret < 0) {
+      cerr << "write failed: " << ret << endl;
+      break;
+    }
+  }
+
+  for (int i = 0; i < fillFiles - 1; i++) {
+    lfs.unlink(benchDir, "fill" + to_string(i));
+  }
+
+  // lookup latency as a directory grows, each size is a separate row
+  vector<Measurement> dirSizeBench;
+  int dirSizes[] = {16, 128, 1024, 3072};
+  int entries = 0;
+  for (size_t size = 0; size < sizeof(dirSizes) / sizeof(dirSizes[0]); size++) {
+    while (entries < dirSizes[size]) {
+      if (lfs.create(benchDir, UFS_REGULAR_FILE, "entry" + to_string(entries)) < 0) {
+        break;
+      }
+      entries++;
+    }
+    if (entries < dirSizes[size]) {
+      break;
+    }
+
+    dirSizeBench.push_back(Measurement("lookup-" + to_string(dirSizes[size])));
+    for (int i = 0; i < iterations; i++) {
+      string name = "entry" + to_string(i % entries);
+      dirSizeBench.back().start();
+      lfs.lookup(benchDir, name);
+      dirSizeBench.back().stop();
+    }
+  }
+  for (int i = 0; i < entries; i++) {
+    lfs.unlink(benchDir, "entry" + to_string(i));
+  }
+  for (int depth = 4; depth >= 0; depth--) {
+    deepPath = deepPath.substr(0, deepPath.rfind('/'));
+    lfs.unlink(lfs.resolvePath(deepPath), "d" + to_string(depth));
+  }
+  lfs.unlink(UFS_ROOT_DIRECTORY_INODE_NUMBER, BENCH_DIR);
+
+  // single block transactions from several threads with group commit,
+  // usec/op is wall time over all of them
+  super_t super;
+  lfs.readSuperBlock(&super);
+  vector<unsigned char> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
+  lfs.readDataBitmap(&super, dataBitmap.data());
+  vector<int> freeBlocks;
+  for (int i = 0; i < super.num_data; i++) {
+    if ((dataBitmap[i / 8] & (1 << (i % 8))) == 0) {
+      freeBlocks.push_back(super.data_region_addr + i);
+    }
+  }
+  vector<Measurement> txnBench;
+  DurabilityPolicy durability = disk.getDurability();
+  disk.setDurability(DURABILITY_GROUP);
+  int threadCounts[] = {1, 4, 16};
+  for (size_t count = 0; count < sizeof(threadCounts) / sizeof(threadCounts[0]); count++) {
+    int threads = threadCounts[count];
+    if ((int) freeBlocks.size() < threads) {
+      break;
+    }
+    vector<TxnWorker> workers(threads);
+    for (int t = 0; t < threads; t++) {
+      workers[t].disk = &disk;
+      workers[t].transactions = iterations / threads;
+      for (size_t i = t; i < freeBlocks.size() && workers[t].blocks.size() < 8; i += threads) {
+        workers[t].blocks.push_back(freeBlocks[i]);
+      }
+    }
+
+    txnBench.push_back(Measurement("txn-group-" + to_string(threads)));
+    txnBench.back().start();
+    vector<pthread_t> ids(threads);
+    for (int t = 0; t < threads; t++) {
+      pthread_create(&ids[t], NULL, runTransactions, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+      pthread_join(ids[t], NULL);
+    }
+    txnBench.back().stop(threads * (iterations / threads));
+  }
+
+  // two transactions that would deadlock: one of them has to be aborted
+  // rather than both waiting, and what the other wrote has to be all that
+  // is left of the round
+  int conflictFailures = 0;
+  int conflictAborts = 0;
+  if (freeBlocks.size() >= 2) {
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, 2);
+    ConflictWorker conflictWorkers[2] = {
+      {&disk, freeBlocks[0], freeBlocks[1], 'a', 100, &barrier, 0, 0},
+      {&disk, freeBlocks[1], freeBlocks[0], 'b', 100, &barrier, 0, 0},
+    };
+    pthread_t conflictIds[2];
+    for (int t = 0; t < 2; t++) {
+      pthread_create(&conflictIds[t], NULL, runConflicts, &conflictWorkers[t]);
+    }
+    for (int t = 0; t < 2; t++) {
+      pthread_join(conflictIds[t], NULL);
+      conflictAborts += conflictWorkers[t].aborts;
+      if (conflictWorkers[t].commits != conflictWorkers[t].rounds) {
+        conflictFailures++;
+      }
+    }
+    pthread_barrier_destroy(&barrier);
+    char first[UFS_BLOCK_SIZE];
+    char second[UFS_BLOCK_SIZE];
+    disk.readBlock(freeBlocks[0], first);
+    disk.readBlock(freeBlocks[1], second);
+    if (conflictAborts == 0 || memcmp(first, second, UFS_BLOCK_SIZE) != 0 ||
+        (first[0] != 'a' && first[0] != 'b') ||
+        memcmp(first, first + 1, UFS_BLOCK_SIZE - 1) != 0) {
+      conflictFailures++;
+    }
+  }
+  disk.setDurability(durability);
+
+  // Writes from here on don't need to reach the disk, and the stress
+  // test is about locking rather than fsync
+  disk.setDurability(DURABILITY_NONE);
+  vector<unsigned char> inodeBitmapBefore(super.inode_bitmap_len * UFS_BLOCK_SIZE);
+  lfs.readInodeBitmap(&super, inodeBitmapBefore.data());
+  lfs.readDataBitmap(&super, dataBitmap.data());
+  int stressDir = lfs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, STRESS_DIR);
+  if (stressDir < 0) {
+    cerr << "Could not create " << STRESS_DIR << ": " << stressDir << endl;
+    return 1;
+  }
+
+  // whole file reads from several threads, each of its own file and all
+  // of the same one, usec/op is wall time over all of them
+  vector<int> readFiles;
+  vector<char> readData(READ_FILE_BLOCKS * UFS_BLOCK_SIZE, 'r');
+  for (int t = 0; t < 16; t++) {
+    int inodeNumber = lfs.create(stressDir, UFS_REGULAR_FILE, "read" + to_string(t));
+    if (inodeNumber < 0 || lfs.write(inodeNumber, readData.data(), readData.size()) < 0) {
+      break;
+    }
+    readFiles.push_back(inodeNumber);
+  }
+  vector<Measurement> readBench;
+  for (int same = 0; same < 2; same++) {
+    for (size_t count = 0; count < sizeof(threadCounts) / sizeof(threadCounts[0]); count++) {
+      int threads = threadCounts[count];
+      if ((int) readFiles.size() < threads) {
+        break;
+      }
+      vector<ReadWorker> workers(threads);
+      for (int t = 0; t < threads; t++) {
+        workers[t].lfs = &lfs;
+        workers[t].inodeNumber = readFiles[same ? 0 : t];
+        workers[t].reads = iterations / threads;
+      }
+
+      readBench.push_back(Measurement(string(same ? "read-same-" : "read-own-") + to_string(threads)));
+      readBench.back().start();
+      vector<pthread_t> ids(threads);
+      for (int t = 0; t < threads; t++) {
+        pthread_create(&ids[t], NULL, runReads, &workers[t]);
+      }
+      for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+      }
+      readBench.back().stop(threads * (iterations / threads));
+    }
+  }
+
+  // The blocks of all the files read from one thread, one file after the
+  // other and then all at once with readBlocksAsync, the way an event
+  // loop would, waiting on completionFd. usec/op is per file.
+  Measurement diskReadBench("disk-read-" + to_string(readFiles.size()));
+  Measurement asyncReadBench("disk-read-async-" + to_string(readFiles.size()));
+  vector<vector<int> > fileBlocks(readFiles.size());
+  vector<vector<char> > fileData(readFiles.size(), vector<char>(readData.size()));
+  vector<vector<void *> > fileBuffers(readFiles.size());
+  for (size_t f = 0; f < readFiles.size(); f++) {
+    lfs.fileBlocks(readFiles[f], fileBlocks[f]);
+    for (size_t b = 0; b < fileBlocks[f].size(); b++) {
+      fileBuffers[f].push_back(fileData[f].data() + b * UFS_BLOCK_SIZE);
+    }
+  }
+  for (int i = 0; i < iterations / 16 && !readFiles.empty(); i++) {
+    diskReadBench.start();
+    for (size_t f = 0; f < readFiles.size(); f++) {
+      disk.readBlocks(fileBlocks[f], fileBuffers[f]);
+    }
+    diskReadBench.stop(readFiles.size());
+
+    asyncReadBench.start();
+    int outstanding = readFiles.size();
+    for (size_t f = 0; f < readFiles.size(); f++) {
+      disk.readBlocksAsync(fileBlocks[f], fileBuffers[f], readDone, &outstanding);
+    }
+    struct pollfd completions = {disk.completionFd(), POLLIN, 0};
+    while (outstanding > 0) {
+      poll(&completions, 1, -1);
+      disk.reapCompletions();
+    }
+    asyncReadBench.stop(readFiles.size());
+  }
+  for (size_t f = 0; f < readFiles.size() && iterations >= 16; f++) {
+    if (fileData[f] != readData) {
+      cerr << "disk-read-async read the wrong data" << endl;
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < readFiles.size(); i++) {
+    lfs.unlink(stressDir, "read" + to_string(i));
+  }
+
+  vector<StressWorker> stressWorkers(STRESS_THREADS);
+  Measurement stressBench("stress-" + to_string(STRESS_THREADS));
+  stressBench.start();
+  vector<pthread_t> stressIds(STRESS_THREADS);
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    stressWorkers[t].lfs = &lfs;
+    stressWorkers[t].dir = stressDir;
+    stressWorkers[t].id = t;
+    stressWorkers[t].rounds = iterations;
+    stressWorkers[t].failures = 0;
+    pthread_create(&stressIds[t], NULL, runStress, &stressWorkers[t]);
+  }
+  int stressFailures = 0;
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(stressIds[t], NULL);
+    stressFailures += stressWorkers[t].failures;
+  }
+  stressBench.stop(STRESS_THREADS * iterations);
+  int holeFailures = checkHoles(lfs, stressDir);
+  int sffFailures = checkSff();
+
+  // once everything is unlinked again no inode or block may be left over
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    for (int i = 0; i < 4; i++) {
+      lfs.unlink(stressDir, "t" + to_string(t) + "-" + to_string(i));
+    }
+  }
+  for (int i = 0; i < 8; i++) {
+    lfs.unlink(stressDir, "shared" + to_string(i));
+  }
+  lfs.unlink(UFS_ROOT_DIRECTORY_INODE_NUMBER, STRESS_DIR);
+  disk.setDurability(durability);
+  vector<unsigned char> inodeBitmapAfter(inodeBitmapBefore.size());
+  vector<unsigned char> dataBitmapAfter(dataBitmap.size());
+  lfs.readInodeBitmap(&super, inodeBitmapAfter.data());
+  lfs.readDataBitmap(&super, dataBitmapAfter.data());
+  bool consistent = inodeBitmapAfter == inodeBitmapBefore && dataBitmapAfter == dataBitmap;
+
+  cout << "op\titers\tusec/op\treads/op\twrites/op" << endl;
+  statBench.print();
+  lookupBench.print();
+  resolveBench.print();
+  createBench.print();
+  createTxnBench.print();
+  writeBench.print();
+  fullWriteBench.print();
+  for (size_t i = 0; i < dirSizeBench.size(); i++) {
+    dirSizeBench[i].print();
+  }
+  for (size_t i = 0; i < txnBench.size(); i++) {
+    txnBench[i].print();
+  }
+  for (size_t i = 0; i < readBench.size(); i++) {
+    readBench[i].print();
+  }
+  diskReadBench.print();
+  asyncReadBench.print();
+  stressBench.print();
+
+  BlockCache *cache = disk.getCache();
+  if (cache != NULL) {
+    cout << endl << "cache\t" << cache->capacity() << " blocks\t"
+         << cache->hits() << " hits\t" << cache->misses() << " misses" << endl;
+  }
+
+  cout << endl << "stress\t" << STRESS_THREADS << " threads\t" << stressFailures << " failures\t"
+       << (consistent ? "bitmaps unchanged" : "bitmaps changed") << endl;
+  cout << "holes\t" << holeFailures << " failures" << endl;
+  cout << "conflicts\t" << conflictAborts << " aborted\t" << conflictFailures << " failures" << endl;
+  cout << "sff\t" << sffFailures << " failures" << endl;
+  if (stressFailures > 0 || holeFailures > 0 || conflictFailures > 0 || sffFailures > 0 || !consistent) {
+    return 1;
+  }
+  return 0;
+}
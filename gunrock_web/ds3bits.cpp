@@ -16,7 +16,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   
-  Disk disk = Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk disk = Disk(argv[1], UFS_BLOCK_SIZE, true);
   LocalFileSystem lfs(&disk);
 
   // Read the superblock
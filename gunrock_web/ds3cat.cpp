@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -20,12 +21,13 @@ void printFileBlocksAndData(int inodeNumber, LocalFileSystem &lfs) {
 
     // Print file blocks
     cout << "File blocks" << endl;
-    int numBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE; // Number of blocks allocated
-    for (int i = 0; i < numBlocks; i++) {
-        if (inode.direct[i] > 0) { // Ensure the block number is positive
-            cout << inode.direct[i] << endl;
-        } else if (inode.direct[i] != 0) {
-            cerr << "Invalid block number " << inode.direct[i] << endl;
+    vector<int> blocks;
+    lfs.fileBlocks(inodeNumber, blocks);  // follows indirect blocks in either inode format
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i] > 0) { // Ensure the block number is positive
+            cout << blocks[i] << endl;
+        } else if (blocks[i] != 0) {
+            cerr << "Invalid block number " << (unsigned int) blocks[i] << endl;
         }
     }
     cout << endl;
@@ -44,7 +46,7 @@ int main(int argc, char *argv[]) {
     }
 
     try {
-        Disk disk(argv[1], UFS_BLOCK_SIZE);
+        Disk disk(argv[1], UFS_BLOCK_SIZE, true);
         LocalFileSystem lfs(&disk);
         int inodeNumber = stoi(argv[2]);
         //lfs.create(stoi(argv[2]), UFS_REGULAR_FILE, "check.txt");
@@ -32,19 +32,15 @@ void printDirectory(const string &path, int inodeNumber, LocalFileSystem &lfs) {
 
     // Calculate the total number of directory entries
     int totalEntries = inode.size / sizeof(dir_ent_t);
-    int entriesRead = 0;
 
     char* buffer = new char[inode.size];  
     lfs.read(inodeNumber, buffer, inode.size);
     
     dir_ent_t *dirEntry = reinterpret_cast<dir_ent_t *>(buffer);
-    // Number of entries to read from this block
-    int entriesInBlock = min(totalEntries - entriesRead, static_cast<int>(UFS_BLOCK_SIZE / sizeof(dir_ent_t)));
-    for (int j = 0; j < entriesInBlock; ++j) {
+    for (int j = 0; j < totalEntries; ++j) {
         if (dirEntry[j].inum != -1) {
             entries.push_back(dirEntry[j]);
         }
-        entriesRead++;
     }
 
     sort(entries.begin() + 2, entries.end(), compareEntries);
@@ -70,7 +66,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    Disk disk = Disk(argv[1], UFS_BLOCK_SIZE);
+    Disk disk = Disk(argv[1], UFS_BLOCK_SIZE, true);
     LocalFileSystem lfs(&disk);
 
     string rootPath = "/";
@@ -3,6 +3,10 @@
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/socket.h>
 
 #include <iostream>
 #include <memory>
@@ -10,6 +14,7 @@
 #include <vector>
 #include <sstream>
 #include <deque>
+#include <algorithm>
 
 #include "ClientError.h"
 #include "HTTPRequest.h"
@@ -18,10 +23,18 @@
 #include "HttpUtils.h"
 #include "FileService.h"
 #include "DistributedFileSystemService.h"
+#include "Disk.h"
+#include "ufs.h"
 #include "MySocket.h"
 #include "MyServerSocket.h"
+#include "Reactor.h"
+#include "RequestQueue.h"
 #include "dthread.h"
 
+// how long a worker waits on an idle keep-alive connection before it
+// checks whether other connections are queued
+#define KEEP_ALIVE_POLL_MS 50
+
 using namespace std;
 int PORT = 8080;
 int THREAD_POOL_SIZE = 1;
@@ -30,13 +43,39 @@ string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+string DURABILITY = "always";
+int CACHE_BLOCKS = 1024;
+bool WRITE_BACK = false;
+bool JOURNAL = false;
+bool MAP_IMAGE = false;
+bool IO_RING = false;
+int KEEP_ALIVE_TIMEOUT = 5;
+int MAX_REQUESTS_PER_CONNECTION = 100;
+bool EVENT_DRIVEN = false;
+int ACCEPTORS = 1;
+int LISTEN_BACKLOG = SOMAXCONN;
 
 vector<HttpService *> services;
 
-HttpService *find_service(HTTPRequest *request) {
+// Accepted connections wait here for a worker, in the order SCHEDALG picks.
+// The acceptor blocks when BUFFER_SIZE connections are already waiting.
+RequestQueue *connections;
+
+// A listening socket and the thread that accepts on it. With more than
+// one, each has its own SO_REUSEPORT socket and the kernel spreads new
+// connections across them. When EVENT_DRIVEN is set each one runs its
+// own Reactor instead of feeding connections.
+struct Acceptor {
+  MyServerSocket *server;
+  Reactor *reactor;
+  // the core the thread is pinned to, or -1 to leave it unpinned
+  int cpu;
+};
+
+HttpService *find_service(string path) {
    // find a service that is registered for this path prefix
   for (unsigned int idx = 0; idx < services.size(); idx++) {
-    if (request->getPath().find(services[idx]->pathPrefix()) == 0) {
+    if (path.find(services[idx]->pathPrefix()) == 0) {
       return services[idx];
     }
   }
@@ -44,6 +83,51 @@ HttpService *find_service(HTTPRequest *request) {
   return NULL;
 }
 
+HttpService *find_service(HTTPRequest *request) {
+  return find_service(request->getPath());
+}
+
+BodySink *open_body_sink(HTTPRequest *request) {
+  HttpService *service = find_service(request);
+  if (service == NULL) {
+    return NULL;
+  }
+  return service->openBodySink(request);
+}
+
+// Estimate how much work a connection's request is, for SFF, from the
+// request line and headers that have already arrived. GETs cost the size
+// of the response body, requests that upload cost their Content-Length,
+// and requests we can't see yet go after everything we know about. This
+// runs on the accept path, so it never waits for the client or for a
+// service busy with a write.
+long estimate_cost(MySocket *client) {
+  string head = client->peek(4096, 0);
+  size_t methodEnd = head.find(' ');
+  size_t pathEnd = head.find_first_of(" ?", methodEnd + 1);
+  if (methodEnd == string::npos || pathEnd == string::npos) {
+    return LONG_MAX;
+  }
+  string method = head.substr(0, methodEnd);
+  string path = head.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+
+  if (method == "GET") {
+    HttpService *service = find_service(path);
+    long size = service == NULL ? 0 : service->responseSize(path);
+    return size < 0 ? LONG_MAX : size;
+  } else if (method == "HEAD") {
+    return 0;
+  }
+
+  string lowerHead = head;
+  transform(lowerHead.begin(), lowerHead.end(), lowerHead.begin(), ::tolower);
+  size_t contentLength = lowerHead.find("\r\ncontent-length:");
+  if (contentLength == string::npos) {
+    return 0;
+  }
+  return atol(head.c_str() + contentLength + strlen("\r\ncontent-length:"));
+}
+
 
 void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
   stringstream payload;
@@ -78,42 +162,96 @@ void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPRespo
   }
 }
 
-void handle_request(MySocket *client) {
-  HTTPRequest *request = new HTTPRequest(client, PORT);
-  HTTPResponse *response = new HTTPResponse();
-  stringstream payload;
-  
-  // read in the request
-  bool readResult = false;
-  try {
-    payload << "client: " << (void *) client;
-    sync_print("read_request_enter", payload.str());
-    readResult = request->readRequest();
-    sync_print("read_request_return", payload.str());
-  } catch (...) {
-    // swallow it
-  }    
-    
-  if (!readResult) {
-    // there was a problem reading in the request, bail
-    delete response;
-    delete request;
-    sync_print("read_request_error", payload.str());
-    return;
-  }
-  
+// Run the service for a request that has been read in, and log the
+// response that is about to be sent back.
+void serve_request(MySocket *client, HTTPRequest *request, HTTPResponse *response) {
   HttpService *service = find_service(request);
   invoke_service_method(service, request, response);
 
-  // send data back to the client and clean up
-  payload.str(""); payload.clear();
+  stringstream payload;
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
-  cout << payload.str() << endl;
-  client->write(response->response());
-    
-  delete response;
-  delete request;
+  // one write per line so lines from different workers don't interleave
+  cout << payload.str() + "\n" << flush;
+}
+
+// Wait for the next request on a connection we kept open, and return
+// false if the client hung up or sat idle for KEEP_ALIVE_TIMEOUT seconds.
+// A worker waiting here can't serve anyone else, so it waits in slices of
+// KEEP_ALIVE_POLL_MS and gives the connection up after a slice that ends
+// with others queued and its next request not there. A client usually
+// sends that right after reading the response, so it gets one slice.
+bool wait_for_request(MySocket *client) {
+  int timeoutMs = KEEP_ALIVE_TIMEOUT * 1000;
+  for (int waited = 0; waited < timeoutMs; waited += KEEP_ALIVE_POLL_MS) {
+    if (client->waitReadable(min(KEEP_ALIVE_POLL_MS, timeoutMs - waited)) ||
+        connections->waiting() > 0) {
+      break;
+    }
+  }
+  // empty if the client hung up or nothing came
+  return !client->peek(1, 0).empty();
+}
+
+void handle_request(MySocket *client) {
+  stringstream payload;
+  // bytes a pipelining client sent after the request we just read
+  string buffered;
+  int served = 0;
+  bool keepAlive = true;
+
+  while (keepAlive) {
+    if (served > 0 && buffered.empty()) {
+      if (!wait_for_request(client)) {
+        break;
+      }
+      // with others waiting, the next request queues up behind them like
+      // a new connection would, so the scheduler ranks it too
+      if (connections->waiting() > 0 && connections->offer(client)) {
+        return;
+      }
+    }
+
+    HTTPRequest *request = new HTTPRequest(client, PORT);
+    HTTPResponse *response = new HTTPResponse();
+    // this thread can wait on the service, so bodies can go straight to it
+    request->setBodySinkFactory(open_body_sink);
+
+    // read in the request
+    bool readResult = false;
+    try {
+      payload.str(""); payload.clear();
+      payload << "client: " << (void *) client;
+      sync_print("read_request_enter", payload.str());
+      readResult = request->readRequest(buffered);
+      sync_print("read_request_return", payload.str());
+    } catch (...) {
+      // swallow it
+    }
+
+    if (!readResult) {
+      // there was a problem reading in the request, bail
+      delete response;
+      delete request;
+      sync_print("read_request_error", payload.str());
+      break;
+    }
+    served++;
+
+    keepAlive = KEEP_ALIVE_TIMEOUT > 0 && served < MAX_REQUESTS_PER_CONNECTION && request->keepAlive();
+    response->setHeader("Connection", keepAlive ? "keep-alive" : "close");
+
+    serve_request(client, request, response);
+    try {
+      response->write(client);
+    } catch (...) {
+      // the client went away, there is nobody left to tell
+      keepAlive = false;
+    }
+
+    delete response;
+    delete request;
+  }
 
   payload.str(""); payload.clear();
   payload << " client: " << (void *) client;
@@ -122,12 +260,63 @@ void handle_request(MySocket *client) {
   delete client;
 }
 
+void *worker(void *arg) {
+  while (true) {
+    handle_request(connections->take());
+  }
+  return NULL;
+}
+
+void *reactor_worker(void *arg) {
+  ((Reactor *) arg)->work();
+  return NULL;
+}
+
+void *accept_connections(void *arg) {
+  Acceptor *acceptor = (Acceptor *) arg;
+  if (acceptor->cpu >= 0) {
+    // a scheduling hint, the acceptor works the same if it can't be pinned
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(acceptor->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  if (acceptor->reactor != NULL) {
+    acceptor->reactor->run();
+  }
+
+  while(true) {
+    sync_print("waiting_to_accept", "");
+    MySocket *client = acceptor->server->accept();
+    sync_print("client_accepted", "");
+
+    connections->put(client);
+  }
+  return NULL;
+}
+
+DurabilityPolicy parse_durability(string name) {
+  if (name == "always") {
+    return DURABILITY_ALWAYS;
+  } else if (name == "commit") {
+    return DURABILITY_COMMIT;
+  } else if (name == "group") {
+    return DURABILITY_GROUP;
+  } else if (name == "none") {
+    return DURABILITY_NONE;
+  }
+
+  cerr << "unknown durability policy " << name << ", expected always, commit, group or none" << endl;
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:f:c:wjmuk:r:ea:q:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,29 +339,121 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'f':
+      DURABILITY = string(optarg);
+      break;
+    case 'c':
+      CACHE_BLOCKS = atoi(optarg);
+      break;
+    case 'w':
+      WRITE_BACK = true;
+      break;
+    case 'j':
+      JOURNAL = true;
+      break;
+    case 'm':
+      MAP_IMAGE = true;
+      break;
+    case 'u':
+      IO_RING = true;
+      break;
+    case 'k':
+      KEEP_ALIVE_TIMEOUT = atoi(optarg);
+      break;
+    case 'r':
+      MAX_REQUESTS_PER_CONNECTION = atoi(optarg);
+      break;
+    case 'e':
+      EVENT_DRIVEN = true;
+      break;
+    case 'a':
+      ACCEPTORS = atoi(optarg);
+      break;
+    case 'q':
+      LISTEN_BACKLOG = atoi(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-s FIFO|SFF|FAIR] [-i diskFile] [-f always|commit|group|none] [-c cacheBlocks] [-w] [-j] [-m] [-u] [-k keepAliveSeconds] [-r maxRequestsPerConnection] [-e] [-a acceptors] [-q backlog]" << endl;
       exit(1);
     }
   }
 
+  if (THREAD_POOL_SIZE < 1 || BUFFER_SIZE < 1) {
+    cerr << "-t and -b must be at least 1" << endl;
+    exit(1);
+  }
+  if (KEEP_ALIVE_TIMEOUT < 0 || MAX_REQUESTS_PER_CONNECTION < 1) {
+    cerr << "-k must not be negative and -r must be at least 1" << endl;
+    exit(1);
+  }
+  if (ACCEPTORS < 1 || LISTEN_BACKLOG < 1) {
+    cerr << "-a and -q must be at least 1" << endl;
+    exit(1);
+  }
+
+  connections = RequestQueue::create(SCHEDALG, BUFFER_SIZE, estimate_cost);
+  if (connections == NULL) {
+    cerr << "unknown scheduling policy " << SCHEDALG << ", expected FIFO, SFF or FAIR" << endl;
+    exit(1);
+  }
+
   set_log_file(LOGFILE);
 
   cout << "Lisening on port " << PORT << endl;
   
   sync_print("init", "");
-  MyServerSocket *server = new MyServerSocket(PORT);
-  MySocket *client;
+  vector<Acceptor> acceptors(ACCEPTORS);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int idx = 0; idx < ACCEPTORS; idx++) {
+    acceptors[idx].server = new MyServerSocket(PORT, LISTEN_BACKLOG, ACCEPTORS > 1);
+    acceptors[idx].reactor = NULL;
+    acceptors[idx].cpu = ACCEPTORS > 1 && cpus > 0 ? idx % cpus : -1;
+  }
+
+  Disk *disk = new Disk(DISKFILE, UFS_BLOCK_SIZE);
+  disk->setDurability(parse_durability(DURABILITY));
+  if (JOURNAL) {
+    disk->enableJournal();
+  }
+  if (IO_RING && !disk->enableRing()) {
+    cerr << "io_uring is not available, using pread and pwrite" << endl;
+  }
+  if (MAP_IMAGE) {
+    disk->enableMapping();
+  } else if (CACHE_BLOCKS > 0) {
+    disk->enableCache(CACHE_BLOCKS, WRITE_BACK);
+  }
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  services.push_back(new DistributedFileSystemService(disk));
   services.push_back(new FileService(BASEDIR));
   
-  while(true) {
-    sync_print("waiting_to_accept", "");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    handle_request(client);
+  if (EVENT_DRIVEN) {
+    // each event loop waits on its own connections and the pool only sees
+    // requests that have been read in, -b and -s don't apply. The workers
+    // are shared out between the event loops, at least one each.
+    for (int idx = 0; idx < ACCEPTORS; idx++) {
+      acceptors[idx].reactor = new Reactor(acceptors[idx].server, KEEP_ALIVE_TIMEOUT, MAX_REQUESTS_PER_CONNECTION, serve_request);
+    }
+    for (int idx = 0; idx < max(THREAD_POOL_SIZE, ACCEPTORS); idx++) {
+      pthread_t thread;
+      dthread_create(&thread, NULL, reactor_worker, acceptors[idx % ACCEPTORS].reactor);
+      dthread_detach(thread);
+    }
+  } else {
+    for (int idx = 0; idx < THREAD_POOL_SIZE; idx++) {
+      pthread_t thread;
+      dthread_create(&thread, NULL, worker, NULL);
+      dthread_detach(thread);
+    }
+  }
+
+  // the main thread is the first acceptor
+  for (int idx = 1; idx < ACCEPTORS; idx++) {
+    pthread_t thread;
+    dthread_create(&thread, NULL, accept_connections, &acceptors[idx]);
+    dthread_detach(thread);
   }
+  accept_connections(&acceptors[0]);
 }
@@ -0,0 +1,55 @@
+#ifndef _BITMAP_ALLOCATOR_H_
+#define _BITMAP_ALLOCATOR_H_
+
+#include <vector>
+
+/**
+ * An in-memory copy of an on-disk allocation bitmap (one bit per inode or
+ * data block, least significant bit first, as in ufs.h).
+ *
+ * Free bits are found a 64-bit word at a time with count-trailing-zeros,
+ * and fully allocated stretches are skipped 128 or 256 bits at a time
+ * with SSE2/AVX2 when the compiler targets them. allocate is next-fit:
+ * it resumes searching after the last bit it handed out instead of at
+ * bit 0, so a nearly full bitmap is not rescanned from the start on
+ * every allocation.
+ *
+ * Changing a bit marks the bitmap block that holds it dirty; the owner
+ * writes dirty blocks to disk and then calls markClean.
+ */
+class BitmapAllocator {
+ public:
+  BitmapAllocator();
+
+  // Size the bitmap for numBits bits stored in numBlocks blocks and
+  // clear it. The caller then fills data() from disk.
+  void reset(int numBits, int numBlocks, int blockSize);
+  unsigned char *data();
+  int numBlocks();
+
+  bool isSet(int bit);
+  void set(int bit);
+  void clear(int bit);
+
+  // First clear bit in [from, to), or -1 if every bit there is set.
+  int findClear(int from, int to);
+  // Find and set one clear bit, searching from the next-fit cursor and
+  // wrapping around once. Returns -1 if the bitmap is full.
+  int allocate();
+  // Find and set count clear bits. If there are fewer than count clear
+  // bits nothing is changed and false is returned.
+  bool allocate(int count, std::vector<int> &bits);
+
+  bool isDirty(int block);
+  void markDirty(int block);
+  void markClean(int block);
+
+ private:
+  std::vector<unsigned char> bits;
+  std::vector<bool> dirty;
+  int numBits;
+  int blockSize;
+  int cursor;
+};
+
+#endif
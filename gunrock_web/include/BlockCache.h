@@ -0,0 +1,66 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#include <pthread.h>
+
+/**
+ * A fixed-size, in-memory cache of disk blocks keyed by block number.
+ *
+ * The cache is split into shards (block number modulo the shard count),
+ * each with its own lock and LRU list, so threads reading different
+ * blocks rarely contend. Dirty blocks are never evicted: they stay
+ * pinned until the owner writes them out and calls markClean, which
+ * lets Disk defer writes until a transaction commits.
+ */
+class BlockCache {
+ public:
+  BlockCache(int capacity, int blockSize, int numShards = 16);
+  ~BlockCache();
+
+  // Copy a cached block into buffer. Returns false on a miss.
+  bool lookup(int blockNumber, void *buffer);
+  // Like lookup, but does not touch the LRU order or the counters.
+  bool peek(int blockNumber, void *buffer);
+  // Add a block read from disk, unless the cache already has a
+  // (possibly newer) copy of it.
+  void fill(int blockNumber, const void *buffer);
+  // Add or replace a block. Dirty blocks are pinned until markClean.
+  void update(int blockNumber, const void *buffer, bool dirty);
+  void markClean(int blockNumber);
+
+  // Block numbers of all dirty blocks, in ascending order.
+  std::vector<int> dirtyBlocks();
+
+  int capacity();
+  unsigned long hits();
+  unsigned long misses();
+
+ private:
+  struct Entry {
+    std::vector<unsigned char> data;
+    bool dirty;
+    std::list<int>::iterator lruPosition;
+  };
+
+  struct Shard {
+    pthread_mutex_t lock;
+    std::list<int> lru;  // most recently used at the front
+    std::unordered_map<int, Entry> entries;
+    unsigned long hits;
+    unsigned long misses;
+  };
+
+  Shard *shardFor(int blockNumber);
+  void insert(Shard *shard, int blockNumber, const void *buffer, bool dirty);
+  void evict(Shard *shard);
+
+  int blockSize;
+  int shardCapacity;
+  std::vector<Shard *> shards;
+};
+
+#endif
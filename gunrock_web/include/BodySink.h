@@ -0,0 +1,19 @@
+#ifndef _BODY_SINK_H_
+#define _BODY_SINK_H_
+
+/**
+ * Where an HTTPRequest body goes when a service takes it as it arrives
+ * instead of after the whole request has been read. write is called from
+ * the parser, so it can't throw: a sink that can't keep up with its body
+ * remembers why and drops the rest, and the service reports it once the
+ * request is complete.
+ */
+class BodySink {
+ public:
+  virtual ~BodySink() {}
+
+  // The next size bytes of the body
+  virtual void write(const char *data, int size) = 0;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _BODY_SOURCE_H_
+#define _BODY_SOURCE_H_
+
+#include <string>
+
+#include <sys/types.h>
+
+/**
+ * Where an HTTPResponse body comes from. The response pulls the body a
+ * chunk at a time while it writes it, so a body never has to be in memory
+ * all at once unless it started out that way.
+ */
+class BodySource {
+ public:
+  virtual ~BodySource();
+
+  // The body's length in bytes, or -1 if it isn't known until the end, in
+  // which case the response is sent chunked.
+  virtual long length() = 0;
+
+  // Copies up to size bytes of the body that haven't been read yet into
+  // buffer and returns how many, or 0 at the end of the body. Throws if
+  // the rest of the body can't be produced.
+  virtual int read(char *buffer, int size) = 0;
+
+  // Bodies that are already in memory return them here, so they can go
+  // out in the same write as the headers. NULL for everything else.
+  virtual const std::string *contents();
+
+  // Bodies that are a range of an open file return its descriptor and set
+  // offset to where the range starts, so they can go out with sendfile.
+  // -1 for everything else.
+  virtual int file(off_t *offset);
+};
+
+// A body held in memory.
+class StringBodySource : public BodySource {
+ public:
+  StringBodySource(std::string data);
+
+  virtual long length();
+  virtual int read(char *buffer, int size);
+  virtual const std::string *contents();
+
+ private:
+  std::string data;
+  size_t consumed;
+};
+
+// length bytes of an open file starting at offset. The source owns fd and
+// closes it.
+class FileBodySource : public BodySource {
+ public:
+  FileBodySource(int fd, off_t offset, size_t length);
+  virtual ~FileBodySource();
+
+  virtual long length();
+  virtual int read(char *buffer, int size);
+  virtual int file(off_t *offset);
+
+ private:
+  int fd;
+  off_t offset;
+  size_t size;
+  size_t consumed;
+};
+
+#endif
@@ -3,29 +3,343 @@
 
 #include <string>
 #include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "BlockCache.h"
+#include "IoRing.h"
+
+// see Disk::enableJournal
+#define JOURNAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+#define JOURNAL_LIMIT_BYTES (64 * 1024 * 1024)
+// see Disk::enableRing
+#define RING_ENTRIES 256
+
+/**
+ * When Disk flushes writes to stable storage.
+ *
+ * DURABILITY_ALWAYS fsyncs after every block write, which is the
+ * original behavior. DURABILITY_COMMIT issues a single fdatasync when
+ * a transaction commits (or after a write made outside a transaction).
+ * DURABILITY_GROUP is like COMMIT, but commits that arrive while a flush
+ * is already running wait for it and share the next one.
+ * DURABILITY_NONE never flushes and leaves it to the OS.
+ */
+enum DurabilityPolicy {
+  DURABILITY_ALWAYS,
+  DURABILITY_COMMIT,
+  DURABILITY_GROUP,
+  DURABILITY_NONE
+};
+
+/**
+ * Something that keeps in-memory state derived from disk blocks (e.g.,
+ * LocalFileSystem's cached bitmaps and inodes). It needs to hear about
+ * rollbacks, since a rollback changes blocks underneath it, and gets a
+ * chance to write out deferred changes as part of a commit.
+ */
+class DiskObserver {
+ public:
+  virtual ~DiskObserver() {}
+  // Called by commit while the transaction is still open, so blocks
+  // written here are part of it.
+  virtual void beforeCommit() = 0;
+  // Called after rollback has restored the blocks of a transaction.
+  virtual void afterRollback() = 0;
+};
 
 struct UndoRecord {
   int blockNumber;
   unsigned char *blockData;
 };
 
+// A committed block that is in the journal but not yet back in the image.
+// sequence tells a checkpoint whether the block was committed again while
+// it was being written out.
+struct JournaledBlock {
+  unsigned char *blockData;
+  unsigned long sequence;
+};
+
 class Disk {
  public:
-  Disk(std::string imageFile, int blockSize);
+  /**
+   * One open transaction: its undo log or, with a journal, its write set,
+   * and the blocks it has written. A thread has at most one open
+   * transaction and every Disk call it makes goes through it, so code
+   * like LocalFileSystem needs no handle of its own.
+   *
+   * A block written by an open transaction belongs to it until it commits
+   * or rolls back, and other transactions that write the block wait until
+   * then. Transactions writing different blocks commit in parallel and
+   * share group commit flushes. When transactions would end up waiting
+   * for each other's blocks, the youngest of them is aborted instead: its
+   * writes from then on are dropped, and its commit rolls it back and
+   * returns false so the caller can run it again. Reads don't wait, and
+   * writes made outside a transaction don't take part.
+   */
+  class Txn {
+   public:
+    unsigned long id();
+    // Same as Disk::commit and Disk::rollback, on the thread that began it
+    bool commit(bool flush = true);
+    void rollback();
+
+   private:
+    friend class Disk;
+    Txn(Disk *disk, unsigned long id);
+
+    Disk *disk;
+    unsigned long txnId;
+    std::deque<struct UndoRecord> undoLog;
+    std::map<int, unsigned char *> redoSet;
+    std::set<int> ownedBlocks;
+    // the block this one is waiting for, or -1, guarded by
+    // Disk::ownersLock. Its owner can end before this one wakes up, so
+    // the owner is looked up rather than kept.
+    int waitingFor;
+    // set under Disk::ownersLock, only while the transaction waits or by
+    // its own thread
+    bool aborted;
+  };
+
+  // readOnly opens the image only for reading, for tools that inspect
+  // an image a server may be using. Such a Disk reads the blocks of a
+  // journal it finds without replaying or emptying it.
+  Disk(std::string imageFile, int blockSize, bool readOnly = false);
+  ~Disk();
   void readBlock(int blockNumber, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
+  /**
+   * Write a block that nothing on disk points to yet, like a newly
+   * allocated data block. It needs no undo record and no flush of its own,
+   * the commit that makes it reachable flushes it.
+   */
+  void writeUnloggedBlock(int blockNumber, void *buffer);
+  /**
+   * Read or write several blocks at once: blockNumbers[i] to or from
+   * buffers[i]. Blocks that sit next to each other in the image go out
+   * as one preadv or pwritev, whatever order they are listed in (or
+   * one io_uring batch, see enableRing, or are copied, for a mapped
+   * image, see enableMapping).
+   * writeBlocks logs and caches like writeBlock does, but flushes once
+   * for the whole call.
+   */
+  void readBlocks(const std::vector<int> &blockNumbers, const std::vector<void *> &buffers);
+  void writeBlocks(const std::vector<int> &blockNumbers, const std::vector<const void *> &buffers);
   int numberOfBlocks();
 
-  void beginTransaction();
-  void commit();
+  void setDurability(DurabilityPolicy durability);
+  DurabilityPolicy getDurability();
+
+  /**
+   * Keep up to `capacity` blocks in an in-memory BlockCache.
+   *
+   * With writeBack false, writes go to the image right away and update
+   * the cache. With writeBack true, writes made inside a transaction
+   * only dirty the cache and are written out by commit, and rollback
+   * just puts the old contents back into the cache.
+   */
+  void enableCache(int capacity, bool writeBack);
+  BlockCache *getCache();
+
+  /**
+   * Switch from the undo log to a redo journal kept next to the image,
+   * in imageFile + ".journal". Any Disk opened for writing on an image
+   * with a non-empty journal, journaling or not, replays it first, unless
+   * another process holds the journal: a journaling Disk keeps an
+   * exclusive flock on it, and exits if someone else has it.
+   *
+   * Writes made inside a transaction stay in memory, and commit appends
+   * them to the journal as one record and flushes the journal alone, so
+   * a transaction costs one sequential write and one flush and rollback
+   * costs nothing. A background thread copies journaled blocks back into
+   * the image (a checkpoint) once the journal passes
+   * JOURNAL_CHECKPOINT_BYTES, and empties the journal when nothing in it
+   * is left to copy. It only copies blocks whose records have been
+   * flushed, since a crash in the middle of a copy needs them to redo the
+   * rest. A commit that finds the journal past JOURNAL_LIMIT_BYTES
+   * flushes the journal and checkpoints before returning. Until then reads
+   * are served from the journaled copies. With a journal, writes never
+   * dirty the cache, so write-back has no effect.
+   */
+  void enableJournal();
+
+  /**
+   * Map the whole image into memory, shared with the file, and copy
+   * blocks to and from the mapping instead of calling pread and pwrite.
+   * The kernel's page cache does the caching, so the block cache is
+   * dropped and enableCache can't be used afterwards. Flushes msync the
+   * blocks written since the last one rather than fdatasync the image.
+   */
+  void enableMapping();
+  /**
+   * A block of a mapped image, to read in place instead of copying it
+   * out. NULL if the image isn't mapped, or if the calling thread's
+   * transaction or the journal has a newer copy of the block than the
+   * image, in which case readBlock returns the right one. The pointer is
+   * good for as long as the Disk, and later writes to the block show
+   * through it.
+   */
+  const void *blockPtr(int blockNumber);
+
+  /**
+   * Do the image's I/O through io_uring, with a ring of RING_ENTRIES for
+   * each thread that uses the Disk. readBlocks and writeBlocks then
+   * submit all of their runs of consecutive blocks as one batch and wait
+   * once. writeBlocks under DURABILITY_ALWAYS, and commit writing a
+   * write-back cache's blocks under ALWAYS or COMMIT, link the flush
+   * behind the writes in the same batch. Returns false, and leaves the
+   * Disk on preadv and pwritev, if the kernel can't set up a ring. Has
+   * no effect on a mapped image.
+   */
+  bool enableRing();
+  /**
+   * Starts reading the blocks and returns without waiting for them.
+   * Once they are all in buffers, reapCompletions calls done(arg) on the
+   * calling thread. Blocks the journal or the cache has are copied right
+   * away, and without a ring (or when nothing is left to read) done runs
+   * before readBlocksAsync returns. The buffers must stay put until then.
+   */
+  void readBlocksAsync(const std::vector<int> &blockNumbers, const std::vector<void *> &buffers,
+                       void (*done)(void *arg), void *arg);
+  // Readable when the calling thread has reads for reapCompletions to
+  // finish, for an event loop to wait on. -1 without a ring.
+  int completionFd();
+  // Calls done for the calling thread's finished async reads, and
+  // returns how many
+  int reapCompletions();
+
+  void addObserver(DiskObserver *observer);
+
+  /**
+   * Transactions for the calling thread, see Txn. commit(false) ends the
+   * transaction and makes its writes visible without flushing them, so a
+   * caller can drop its own locks before sync() makes them durable and
+   * concurrent commits can share one flush. commit returns false when the
+   * transaction was aborted to break a deadlock and rolled back instead.
+   */
+  Txn *beginTransaction();
+  bool commit(bool flush = true);
   void rollback();
-  
+  bool inTransaction();
+  Txn *currentTransaction();
+  // Flushes everything committed so far, the way commit does
+  void sync();
+
  private:
+  void pwriteBlock(int blockNumber, void *buffer);
+  // memcpy into the mapping, and remember the block for the next sync
+  void copyToMapping(int blockNumber, const void *buffer);
+  // fsync or fdatasync the image, or msync the blocks in mappedDirty
+  void syncImage(bool dataOnly);
+  void checkBlockNumbers(const std::vector<int> &blockNumbers);
+  // Copies the blocks the journal or the cache has into their buffers,
+  // and lists the rest
+  void lookupBlocks(const std::vector<int> &blockNumbers, const std::vector<void *> &buffers,
+                    std::vector<int> &missing, std::vector<void *> &missingBuffers);
+  // Vectored I/O on the image, one call per run of consecutive blocks,
+  // or one batch on the thread's ring. With sync, the writes are then
+  // flushed the way the durability policy wants, linked behind them on
+  // a ring.
+  void transferBlocks(const std::vector<int> &blockNumbers, const std::vector<void *> &buffers,
+                      bool write, bool sync = false);
+  void writeDirtyBlocks(Txn *txn, bool sync);
+  // The calling thread's ring, set up on first use. NULL without one.
+  IoRing *threadRing();
+  // Waits until txn may write the block, and makes it txn's. false when
+  // txn is aborted, and mustn't write anything more.
+  bool acquireBlock(Txn *txn, int blockNumber);
+  // Releases txn's blocks, unbinds it from the thread and deletes it
+  void endTransaction(Txn *txn);
+  void flush();
+  void groupFlush();
+
+  bool journaling();
+  std::string journalFile();
+  void recoverJournal();
+  // Copies the block out of the transaction or the journal, if it's there
+  bool lookupJournal(int blockNumber, void *buffer);
+  void logBlock(Txn *txn, int blockNumber, const void *buffer);
+  void commitJournal(Txn *txn);
+  // Redoes the journal's records in the image and empties it, or with
+  // toImage false keeps their blocks in checkpointSet for reads
+  void replayJournal(bool toImage);
+  // fsync or fdatasync the journal, and move durableSequence up to what
+  // that covered
+  void flushJournal(bool dataOnly);
+  // Called holding journalLock. A background checkpoint lets go of it
+  // while it writes, and leaves blocks whose records aren't durable yet
+  // for later; the others flush the journal first. false if there was
+  // nothing to copy.
+  bool checkpoint(bool background);
+  static void *checkpointMain(void *arg);
+  void checkpointLoop();
+
+
   std::string imageFile;
   int blockSize;
-  int imageFileSize;
-  bool isInTransaction;
-  std::deque<struct UndoRecord> undoLog;
+  int imageFileDescriptor;
+  off_t imageFileSize;
+  std::vector<DiskObserver *> observers;
+
+  // each thread's open transaction
+  pthread_key_t currentTxn;
+  // which open transaction each written block belongs to
+  pthread_mutex_t ownersLock;
+  pthread_cond_t ownersChanged;
+  std::map<int, Txn *> blockOwners;
+  unsigned long transactionsStarted;
+
+  BlockCache *cache;
+  bool writeBack;
+
+  // The image, or NULL when it isn't mapped. mappedDirty holds the blocks
+  // written through the mapping since they were last msynced and is
+  // guarded by mappingLock. syncLock keeps one sync from returning while
+  // another is still msyncing blocks it took out of mappedDirty.
+  unsigned char *mapping;
+  bool mappingWritable;
+  std::set<int> mappedDirty;
+  pthread_mutex_t mappingLock;
+  pthread_mutex_t syncLock;
+
+  // see enableRing. rings holds every thread's ring, so the destructor
+  // can close them, and is guarded by ringsLock.
+  bool ringEnabled;
+  pthread_key_t currentRing;
+  std::set<IoRing *> rings;
+  pthread_mutex_t ringsLock;
+
+  DurabilityPolicy durability;
+  // group commit state, see groupFlush
+  pthread_mutex_t flushLock;
+  pthread_cond_t flushDone;
+  bool flushInProgress;
+  unsigned long flushesRequested;
+  unsigned long flushesCompleted;
+
+  // redo journal, see enableJournal. journalFileDescriptor is -1 without
+  // one. Everything else is guarded by journalLock.
+  int journalFileDescriptor;
+  bool unloggedWrites;
+  off_t journalSize;
+  unsigned long journalSequence;
+  // records up to this sequence are flushed to the journal
+  unsigned long durableSequence;
+  std::map<int, JournaledBlock> checkpointSet;
+  // every block with a record in the journal file, checkpointed or not
+  std::set<int> journaledBlocks;
+  pthread_mutex_t journalLock;
+  pthread_cond_t checkpointWanted;
+  pthread_cond_t checkpointDone;
+  bool checkpointInProgress;
+  bool stopCheckpointer;
+  pthread_t checkpointer;
 };
 
 #endif
@@ -1,21 +1,117 @@
 #ifndef _DISTRIBUTEDFILESYSTEMSERVICE_H_
 #define _DISTRIBUTEDFILESYSTEMSERVICE_H_
 
+#include "BodySink.h"
+#include "BodySource.h"
 #include "HttpService.h"
 #include "LocalFileSystem.h"
+#include "ufs.h"
 
 #include <string>
+#include <vector>
+
+#include <pthread.h>
+
+class DistributedFileSystemService;
+
+// Streams a file, or ranges of it, out of the file system while its
+// response is written, a chunk at a time, so a GET never holds the whole
+// file. Every read takes the service lock and fails if the file has
+// changed since the GET looked at it, since the Content-Length has
+// already gone out. The lock is only taken shared, so files stream out
+// side by side.
+class FileSystemBodySource : public BodySource {
+ public:
+  FileSystemBodySource(DistributedFileSystemService *service, int inodeNumber, const inode_t &inode);
+
+  // The body is made of the parts added, in order: length bytes of the
+  // file starting at offset, and text like the part headers of a
+  // multipart body.
+  void addRange(long offset, long length);
+  void addText(const std::string &text);
+
+  virtual long length();
+  virtual int read(char *buffer, int size);
+
+ private:
+  struct Part {
+    // -1 for text
+    long offset;
+    long length;
+    std::string text;
+  };
+
+  DistributedFileSystemService *service;
+  int inodeNumber;
+  inode_t inode;
+  std::vector<Part> parts;
+  long size;
+  // the part being read and how much of it has been
+  size_t part;
+  long consumed;
+};
+
+// Writes a PUT body into the file system while it is read, a block at a
+// time, so an upload never has to be in memory all at once. The blocks
+// only become the file's contents when the PUT commits them. Until then
+// they belong to the sink, which frees them if the request fails or the
+// client goes away before the end of the body.
+class FileSystemBodySink : public BodySink {
+ public:
+  FileSystemBodySink(DistributedFileSystemService *service);
+  virtual ~FileSystemBodySink();
+
+  virtual void write(const char *data, int size);
+  // Writes the rest of the body and makes it the contents of the file,
+  // inside the caller's transaction and holding the service lock. Returns
+  // what LocalFileSystem::commitWrite does.
+  int commit(int inodeNumber);
+
+ private:
+  DistributedFileSystemService *service;
+  LocalFileSystem::WriteSession session;
+  // the part of the body after the last full block
+  char block[UFS_BLOCK_SIZE];
+  int used;
+};
 
 class DistributedFileSystemService : public HttpService {
  public:
-  DistributedFileSystemService(std::string driveFile);
+  DistributedFileSystemService(Disk *disk);
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
+  // Appends the body to a file, creating it like a PUT if it doesn't exist
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual long responseSize(std::string path);
+  virtual BodySink *openBodySink(HTTPRequest *request);
 
 private:
+  friend class FileSystemBodySource;
+  friend class FileSystemBodySink;
+
+  typedef void (DistributedFileSystemService::*RequestHandler)(HTTPRequest *request, HTTPResponse *response);
+
+  // GETs hold lock shared and run side by side, LocalFileSystem handles
+  // concurrent reads itself. Requests that change the file system hold
+  // it exclusive, since a transaction commits every change to the file
+  // system's metadata, not just its own. They commit without flushing
+  // and flush after releasing it, so concurrent requests share group
+  // commit flushes.
+  void locked(RequestHandler handler, HTTPRequest *request, HTTPResponse *response, bool exclusive);
+  void getLocked(HTTPRequest *request, HTTPResponse *response);
+  // The response to a GET of a regular file, honoring a Range header
+  void getFile(HTTPRequest *request, HTTPResponse *response, int inodeNumber, const inode_t &inode);
+  // PUT replaces a file, or with a Content-Range header writes part of it
+  // or changes its size. POST appends to it.
+  void putLocked(HTTPRequest *request, HTTPResponse *response);
+  // Writes the body of a PUT with a Content-Range header, or of a POST
+  int patchFile(HTTPRequest *request, int inodeNumber);
+  void delLocked(HTTPRequest *request, HTTPResponse *response);
+
   LocalFileSystem *fileSystem;
+  pthread_rwlock_t lock;
 };
 
 #endif
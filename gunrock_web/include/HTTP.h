@@ -2,6 +2,7 @@
 #define _HTTP_H_
 
 #include "http_parser.h"
+#include "BodySink.h"
 
 #include <string>
 #include <vector>
@@ -17,6 +18,9 @@ class HTTP {
     int addData(const unsigned char *data, int len);
     bool isDone();
     bool isHeaderDone();
+    // true when the sender wants the connection kept open after this
+    // message, from its HTTP version and Connection header
+    bool keepAlive();
     std::string getProxyRequest(const char *userAgent = NULL);
     std::string getReplyHeader();
     std::string getHost();
@@ -30,6 +34,9 @@ class HTTP {
     bool isDelete() {return m_method == HTTP_DELETE;}
     bool isMove() {return m_method == HTTP_MOVE;}
     std::string getBody();
+    // Sends the body to sink as it is parsed, starting with any of it
+    // that has already been parsed, instead of keeping it in getBody.
+    void setBodySink(BodySink *sink);
     std::string getQuery() {return m_query;}
     std::vector< std::pair< std::string *, std::string *> > getHeaders() {
       return m_headers;
@@ -60,6 +67,7 @@ class HTTP {
     http_parser m_parser;
     HttpState m_state;
     bool m_doneParsing;
+    bool m_keepAlive;
     bool m_headerDone;
 
     std::string m_url;
@@ -70,6 +78,7 @@ class HTTP {
     std::string *m_value;
     std::vector< std::pair< std::string *, std::string *> > m_headers;
     std::string m_body;
+    BodySink *m_bodySink;
     std::string m_statusStr;
     unsigned char m_method;
     http_parser_type m_httpType;
@@ -12,12 +12,28 @@
 #include <string>
 #include <vector>
 
+class HTTPRequest;
+
+// Called once a request's headers are parsed, returns a sink for its body
+// or NULL to keep the body in memory for getBody.
+typedef BodySink *(*BodySinkFactory)(HTTPRequest *request);
+
 class HTTPRequest {
 public:
   HTTPRequest(MySocket *sock, int serverPort);
   ~HTTPRequest();
   
   bool readRequest();
+  // Reads one request, starting with the bytes already in buffered. A
+  // pipelining client can send several requests in one packet, so on
+  // return buffered holds whatever arrived after the end of this one.
+  bool readRequest(std::string &buffered);
+  // Parses the bytes in buffered without reading from the socket, for
+  // callers that do their own non-blocking reads. Returns true once the
+  // request is complete, leaving any bytes past its end in buffered.
+  bool parse(std::string &buffered);
+  // true if the client wants to send another request on this connection
+  bool keepAlive();
 
   std::string getHost();
   std::string getRequest();
@@ -25,6 +41,7 @@ public:
   std::string getPath();
   std::vector<std::string> getPathComponents();
   std::string getHeader(std::string key);
+  bool hasHeader(std::string key);
   bool hasAuthToken();
   std::string getAuthToken();
   bool isConnect();
@@ -37,15 +54,21 @@ public:
   std::map<std::string, std::string> getParams();
   WwwFormEncodedDict formEncodedBody();
   std::string getBody() {return m_http->getBody();}
+  // The request owns the sink the factory returns and deletes it with
+  // the request.
+  void setBodySinkFactory(BodySinkFactory factory) {m_bodySinkFactory = factory;}
+  BodySink *getBodySink() {return m_bodySink;}
   
   void printDebugInfo();
     
  protected:
-    void onRead(const char *buffer, unsigned int len);
+    unsigned int onRead(const char *buffer, unsigned int len);
 
     MySocket *m_sock;
     HTTP *m_http;
     int m_serverPort;
+    BodySinkFactory m_bodySinkFactory;
+    BodySink *m_bodySink;
     unsigned long m_totalBytesRead;
     unsigned long m_totalBytesWritten;
 };
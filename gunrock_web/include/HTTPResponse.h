@@ -4,16 +4,46 @@
 #include <map>
 #include <string>
 
+#include <sys/types.h>
+
+#include "BodySource.h"
+#include "MySocket.h"
+
+// how much of a body that isn't in memory or a file is held at once
+#define BODY_CHUNK_SIZE (16 * 1024)
+
 class HTTPResponse {
  public:
   HTTPResponse();
+  ~HTTPResponse();
+  // Send the body chunked even if its length is known.
   void withStreaming();
   void setHeader(std::string name, std::string value);
   void setBody(std::string data);
+  // Send length bytes of the open file fd as the body, straight from the
+  // page cache. The response closes fd when it is done with it.
+  void setBodyFile(int fd, size_t length);
+  // Pull the body from source while the response is written. The
+  // response deletes source when it is done with it.
+  void setBodySource(BodySource *source);
   void setContentType(std::string contentType);
+  std::string getContentType();
   void setStatus(int status);
   int getStatus();
+  // the status line and headers
+  std::string head();
+  // the whole response as one string
   std::string response();
+  // Writes the response to sock without building it in one string first.
+  void write(MySocket *sock);
+
+  BodySource *getBodySource() { return source; }
+  // true if the body goes out in chunks because its length isn't sent
+  bool isChunked();
+  // Replaces chunk with the next piece of the body as it goes on the wire,
+  // framed if the response is chunked, holding at most BODY_CHUNK_SIZE
+  // bytes of the body. Returns false once the whole body has been given.
+  bool nextChunk(std::string &chunk);
 
  private:
   std::string statusToString();
@@ -21,7 +51,9 @@ class HTTPResponse {
   int status;
   bool streaming;
   std::map<std::string, std::string> headers;
-  std::string body;
+  BodySource *source;
+  // set once nextChunk has given out the end of the body
+  bool finished;
   std::string contentType;
 };
 
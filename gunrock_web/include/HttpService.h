@@ -19,6 +19,16 @@ class HttpService {
   virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
   virtual void move(HTTPRequest *request, HTTPResponse *response);
+
+  // A guess at the size of the body a GET for path would return, used to
+  // schedule requests, or -1 if the service can't tell cheaply. Called
+  // while accepting connections, so it must not block.
+  virtual long responseSize(std::string path);
+
+  // A sink that takes the body of request while it is read, or NULL to
+  // get it all at once from getBody. Only called when the server reads
+  // the request on a thread that can wait for the service.
+  virtual BodySink *openBodySink(HTTPRequest *request);
   
  private:
   std::string m_pathPrefix;
@@ -22,6 +22,18 @@ class HttpUtils {
 
   static std::vector<std::string> split(const std::string &s, char delim);
 
+  // Parses a Range header, "bytes=0-99,-500" and the like, for a body of
+  // size bytes into first and last byte offsets. Ranges that start past
+  // the end are left out, so there may be none. Returns false if the
+  // header isn't a byte range set, in which case it should be ignored.
+  static bool byteRanges(std::string header, long size,
+                         std::vector<std::pair<long, long> > &ranges);
+
+  // Parses a Content-Range header, "bytes 0-99/1000", "bytes 0-99/*" or
+  // "bytes */1000". first and last are -1 if there is no range, and total
+  // is -1 if it is "*". Returns false if the header doesn't parse.
+  static bool contentRange(std::string header, long &first, long &last, long &total);
+
  private:
   static std::vector<std::string> &split(const std::string &s,
 					 char delim,
@@ -0,0 +1,113 @@
+#ifndef _IO_RING_H_
+#define _IO_RING_H_
+
+#include <deque>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+class IoBatch;
+
+// One operation of a batch. expected is how many bytes it should
+// transfer, result what the kernel returned: bytes or -errno.
+struct IoOp {
+  int opcode;
+  int fd;
+  const struct iovec *iov;
+  int iovCount;
+  off_t offset;
+  bool dataOnly;
+  long expected;
+  long result;
+  IoBatch *batch;
+};
+
+/**
+ * Operations that go to an IoRing together. An fsync in a batch starts
+ * once every operation added before it has succeeded, and is cancelled if
+ * one of them fails. The iovecs must stay put until the batch is done.
+ */
+class IoBatch {
+ public:
+  IoBatch();
+  virtual ~IoBatch();
+
+  void readv(int fd, const struct iovec *iov, int count, off_t offset);
+  void writev(int fd, const struct iovec *iov, int count, off_t offset);
+  void fsync(int fd, bool dataOnly);
+  bool empty();
+  bool done();
+  // 0 if every operation transferred all of its bytes, otherwise the
+  // errno of the first one that didn't (EIO for a short transfer)
+  int error();
+
+ private:
+  friend class IoRing;
+  std::vector<IoOp> ops;
+  size_t pending;
+  // started with IoRing::start, so it goes on the finished list
+  bool async;
+};
+
+/**
+ * An io_uring set up with the raw system calls, so there is nothing to
+ * link against. create probes the kernel and returns NULL if it can't
+ * set a ring up or doesn't support the operations IoBatch uses, and the
+ * caller goes on with pread and pwrite.
+ *
+ * A ring isn't thread safe: every thread uses its own (see
+ * Disk::enableRing). Completions of a ring's batches can be reaped while
+ * it waits for any one of them, so they are matched to their batch
+ * rather than assumed to come back in order.
+ */
+class IoRing {
+ public:
+  static IoRing *create(unsigned entries);
+  ~IoRing();
+
+  // Submits the batch and waits until all of it has completed
+  void run(IoBatch *batch);
+  // Submits the batch and returns. Once done, it shows up in finished.
+  void start(IoBatch *batch);
+  // Reaps whatever has completed, without waiting
+  void poll();
+  // Readable when completions have arrived since the last poll, for an
+  // event loop to wait on
+  int eventFd();
+  // Batches from start that are done, oldest first. The caller takes
+  // them off.
+  std::deque<IoBatch *> &finished();
+
+ private:
+  IoRing();
+  void submit(IoBatch *batch);
+  // Hands queued submissions to the kernel, and waits for at least
+  // minComplete completions
+  void enter(unsigned minComplete);
+  void reap();
+
+  int ringFd;
+  int completionFd;
+  unsigned entries;
+  unsigned queued;
+
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  void *sqes;
+  size_t sqesSize;
+
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  void *cqes;
+
+  std::deque<IoBatch *> finishedBatches;
+};
+
+#endif
@@ -1,11 +1,19 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <atomic>
+#include <map>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <set>
 
+#include "BitmapAllocator.h"
 #include "Disk.h"
 #include "ufs.h"
 
+#include <pthread.h>
+
 /**
  * The local file system interface.
  *
@@ -17,6 +25,20 @@
  * callers operate will not align on disk block boundaries, so your job is
  * to manage the interactions with the underlying storage to provide a higher
  * level of abstraction for any code that uses this class.
+ *
+ * Calls from different threads can overlap. Every inode has a
+ * shared/exclusive lock: reads take it shared and anything that changes
+ * a file or directory takes it exclusive, so reads of different files,
+ * or of the same one, run in parallel. stat takes no lock at all, and a
+ * lookup that hits the directory index or dentry cache only takes the
+ * cache lock shared. Allocation and the dirty bitmap and inode blocks
+ * have a lock of their own that is only held while they change.
+ *
+ * Transactions are the exception. beforeCommit writes every dirty bitmap
+ * and inode block and afterRollback reloads all of them, so changes made
+ * inside a Disk transaction must not overlap with any other change, and
+ * afterRollback with any other call (DistributedFileSystemService holds
+ * its lock exclusive for those).
  */
 
 // Note: If a function invocation has more than one error, return
@@ -44,9 +66,13 @@
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
 
-class LocalFileSystem {
+// Inodes share this many locks, inode n uses lock n % INODE_LOCK_STRIPES
+#define INODE_LOCK_STRIPES 64
+
+class LocalFileSystem : public DiskObserver {
  public:
   LocalFileSystem(Disk *disk);
+  ~LocalFileSystem();
   /**
    * Lookup an inode.
    *
@@ -99,6 +125,38 @@ class LocalFileSystem {
    */
   int write(int inodeNumber, const void *buffer, int size);
 
+  /**
+   * Write part of a file.
+   *
+   * Writes size bytes from buffer starting offset bytes into the file.
+   * Blocks the file already has are updated in place, and blocks are
+   * only allocated for the part of the file that grows. Bytes between
+   * the old end of the file and offset read as zeros.
+   *
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, negative size or offset, the file
+   * would grow past MAX_FILE_SIZE, not a regular file.
+   */
+  int pwrite(int inodeNumber, const void *buffer, int size, int offset);
+
+  /**
+   * Write size bytes from buffer at the end of the file. Succeeds and
+   * fails like pwrite.
+   */
+  int append(int inodeNumber, const void *buffer, int size);
+
+  /**
+   * Change the size of a file. Blocks past the new end are freed, and a
+   * file that grows is filled with zeros.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, size is negative or larger than
+   * MAX_FILE_SIZE, not a regular file.
+   */
+  int truncate(int inodeNumber, int size);
+
   /**
    * Read the contents of a file or directory.
    *
@@ -112,6 +170,69 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read part of a file or directory.
+   *
+   * Reads up to `size` bytes starting `offset` bytes into the file, and
+   * only reads the blocks that hold them. Reading at or past the end of
+   * the file reads nothing.
+   *
+   * Success: number of bytes read
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, negative size or offset.
+   */
+  int pread(int inodeNumber, void *buffer, int size, int offset);
+
+  /**
+   * The disk blocks holding a file or directory, in order. Indirect
+   * blocks are not included.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE.
+   */
+  int fileBlocks(int inodeNumber, std::vector<int> &blocks);
+
+  // The largest file or directory the image's inode format can hold, in
+  // bytes. MAX_FILE_SIZE for images in the direct format.
+  int maxFileSize();
+
+  /**
+   * Write a file a block at a time, as its contents arrive.
+   *
+   * appendBlock allocates a data block for the next size bytes of the
+   * contents and writes it right away, while the file is left alone.
+   * commitWrite then points the file at the session's blocks and frees
+   * its old ones, the same change write makes, and abortWrite frees the
+   * session's blocks instead. The blocks stay allocated in memory until
+   * one of the two is called, even across a rollback.
+   */
+  struct WriteSession {
+    WriteSession() : size(0), error(0) {}
+    std::vector<int> blocks;
+    int size;
+    // the first failure, later blocks are dropped
+    int error;
+  };
+
+  /**
+   * Success: 0
+   * Failure: -EINVALIDSIZE, -ENOTENOUGHSPACE, or an earlier failure of the
+   * session.
+   * Failure modes: the contents are larger than MAX_FILE_SIZE, the disk
+   * is full. Only the last block of the contents can be shorter than
+   * UFS_BLOCK_SIZE.
+   */
+  int appendBlock(WriteSession &session, const void *buffer, int size);
+
+  /**
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDTYPE, or the session's failure.
+   * Failure modes: invalid inodeNumber, inodeNumber is a directory, the
+   * session failed. The session is left open on failure.
+   */
+  int commitWrite(int inodeNumber, WriteSession &session);
+  void abortWrite(WriteSession &session);
+
   /**
    * Remove a file or directory.
    *
@@ -126,6 +247,23 @@ class LocalFileSystem {
    * a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Resolve a path to an inode.
+   *
+   * Takes a path relative to the root directory, with components
+   * separated by '/', e.g., "a/b/c.txt". Leading and trailing slashes are
+   * ignored and an empty path is the root directory. Results, including
+   * failures, are kept in a cache keyed by the whole path, so resolving a
+   * path again costs one hash probe until create or unlink changes the
+   * namespace.
+   *
+   * Success: return the inode number of the last component
+   * Failure: return -ENOTFOUND, -EINVALIDINODE.
+   * Failure modes: a component does not exist, or a component other than
+   * the last one is not a directory (-EINVALIDINODE).
+   */
+  int resolvePath(const std::string &path);
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -151,10 +289,164 @@ class LocalFileSystem {
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
 
+  // Inside a transaction, changed bitmap and inode blocks are written
+  // when it commits.
+  virtual void beforeCommit();
+  // Reload the cached superblock, bitmaps and inodes, and drop the
+  // directory indexes and dentries, after a transaction rolled back.
+  virtual void afterRollback();
+
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+ private:
+  /**
+   * The superblock, both bitmaps and the inode table are read once when
+   * the file system is created and kept in memory. Allocation changes
+   * bits in the cached bitmaps, and writeDirtyBitmaps picks out only the
+   * bitmap blocks that changed.
+   *
+   * writeInode only updates the cached inode and marks its block dirty,
+   * and writeDirtyInodes picks each dirty inode block once, however many
+   * of its inodes changed. writeDirtyMetadata copies both sets of blocks
+   * under metadataLock and writes the copies with a single
+   * Disk::writeBlocks, holding metadataWriteLock so copies reach the disk
+   * in the order they were taken.
+   *
+   * writeMetadata writes dirty bitmap and inode blocks right away outside
+   * a transaction. Inside one they are left for beforeCommit, so an
+   * operation that updates several inodes in one block, or several
+   * operations in one transaction, write it once.
+   */
+  void loadMetadata();
+  void writeDirtyBitmaps(std::vector<int> &blocks, std::vector<unsigned char> &data);
+  void writeInode(int inodeNumber, inode_t &inode);
+  void writeDirtyInodes(std::vector<int> &blocks, std::vector<unsigned char> &data);
+  void writeDirtyMetadata();
+  void writeMetadata();
+
+  // Allocation, under metadataLock. Data blocks are disk block numbers.
+  bool allocateDataBlocks(int count, std::vector<int> &blocks);
+  void freeDataBlocks(const std::vector<int> &blocks);
+  int allocateInode();
+  void freeInode(int inodeNumber);
+  bool inodeAllocated(int inodeNumber);
+
+  /**
+   * Inode locks. Operations on two inodes, unlink of a child, take the
+   * parent first and only try the child's lock; if that fails they let go
+   * and take both in stripe order, since two inodes that are far apart in
+   * the tree can still share a stripe. The public functions check the
+   * inode number and take the lock, then call the *Locked version, which
+   * is also what other operations call while they hold the lock.
+   */
+  struct InodeStripe {
+    pthread_rwlock_t lock;
+    // odd while writeInode changes an inode in the stripe, see stat
+    std::atomic<unsigned int> version;
+  };
+  bool validInode(int inodeNumber);
+  InodeStripe *stripeFor(int inodeNumber);
+  void lockInode(int inodeNumber, bool exclusive);
+  void unlockInode(int inodeNumber);
+  // Called holding parentInodeNumber exclusive. Also locks the entry
+  // exclusive and returns its inode number, or returns an error without
+  // locking anything more.
+  int lockEntry(int parentInodeNumber, const std::string &name);
+  // Unlocks a parent and child locked by lockEntry
+  void unlockEntry(int parentInodeNumber, int inodeNumber);
+
+  int lookupLocked(int parentInodeNumber, const std::string &name);
+  int preadLocked(int inodeNumber, void *buffer, int size, int offset);
+  int writeLocked(int inodeNumber, const void *buffer, int size);
+  int pwriteLocked(int inodeNumber, const void *buffer, int size, int offset);
+  int truncateLocked(int inodeNumber, int size);
+  int commitWriteLocked(int inodeNumber, WriteSession &session);
+  int createLocked(int parentInodeNumber, int type, const std::string &name);
+  int unlinkLocked(int parentInodeNumber, int entryInodeNumber, const std::string &name);
+
+  /**
+   * Block maps. A file's blocks are numbered from 0, and its inode maps
+   * them to disk blocks, directly or through indirect blocks depending on
+   * the image's inode format. Callers pass how many blocks the file has,
+   * since they work on the map before or after changing the size.
+   */
+  typedef std::map<unsigned int, std::vector<unsigned int> > IndirectBlocks;
+  // The pointers in an indirect block, read once per map operation. A
+  // fresh block starts out empty instead of being read.
+  unsigned int *indirectBlock(IndirectBlocks &blocks, unsigned int blockNumber, bool fresh);
+  // Appends the disk blocks of count blocks of the file, from first on
+  void fileBlocks(const inode_t &inode, int first, int count, std::vector<int> &blocks);
+  int fileBlock(const inode_t &inode, int index);
+  // Maps the blocks of a file that has first blocks from first on to
+  // blocks, allocating the indirect blocks that takes. Returns
+  // -ENOTENOUGHSPACE or -EINVALIDSIZE, leaving everything as it was, if
+  // it can't.
+  int mapFileBlocks(inode_t &inode, int first, const std::vector<int> &blocks);
+  // Maps new blocks to a file so it holds end bytes, and zeroes it from
+  // its old end up to zeroTo. Returns like mapFileBlocks.
+  int growFile(inode_t &inode, int end, int zeroTo);
+  // Frees the blocks of a file that has numBlocks blocks from first on,
+  // and the indirect blocks only they needed
+  void freeFileBlocks(inode_t &inode, int first, int numBlocks);
+
+  /**
+   * Each directory gets an in-memory name to inode number index the
+   * first time it is looked up, so lookups don't scan directory blocks.
+   * create and unlink keep the indexes up to date, and a rollback drops
+   * all of them. The indexes and the dentry cache are guarded by
+   * cacheLock; a directory's index is built holding the directory's lock
+   * at least shared, so it can't change while it is read.
+   */
+  typedef std::unordered_map<std::string, int> DirectoryIndex;
+  // Looks name up in parentInodeNumber's index. Returns false if the
+  // directory has no index yet.
+  bool findEntry(int parentInodeNumber, const std::string &name, int &inodeNumber);
+  // Builds the index of a directory whose lock the caller holds. Returns
+  // false if inodeNumber is not a directory.
+  bool indexDirectory(int inodeNumber);
+  // Read all entries, including free (inum == -1) slots, of a directory
+  int readDirectory(int inodeNumber, inode_t &inode, std::vector<dir_ent_t> &entries);
+  // Write one block of a directory's entries, padding it with free slots
+  void writeDirectoryBlock(inode_t &inode, std::vector<dir_ent_t> &entries, int blockIndex);
+
+  super_t super;
+  std::vector<InodeStripe *> stripes;
+
+  // guards the bitmaps, reservedBlocks, dirtyInodeBlocks and changes to
+  // inodes. Taken last, and never held while waiting for the disk.
+  pthread_mutex_t metadataLock;
+  pthread_mutex_t metadataWriteLock;
+  BitmapAllocator inodeBitmap;
+  // data block bits are relative to the start of the data region
+  BitmapAllocator dataBitmap;
+  std::vector<inode_t> inodes;
+  // indexes of dirty blocks in the inode region, written in order
+  std::set<int> dirtyInodeBlocks;
+  // data block bits allocated by open write sessions
+  std::set<int> reservedBlocks;
+
+  pthread_rwlock_t cacheLock;
+  std::unordered_map<int, DirectoryIndex> directoryIndexes;
+
+  /**
+   * The dentry cache used by resolvePath. Positive entries map a path to
+   * an inode number, and dentryPaths maps it back so unlink can drop
+   * the entry for the inode it frees. Negative entries hold the error a
+   * path resolved to; create and unlink can change any of them, so both
+   * drop all negative entries. Paths with "." or ".." components are
+   * never cached, which keeps one path per inode.
+   *
+   * resolvePath walks a path without holding cacheLock and adds what it
+   * found afterwards, unless namespaceGeneration shows that a create or
+   * unlink ran in between.
+   */
+  unsigned long namespaceGeneration;
+  std::unordered_map<std::string, int> dentries;
+  std::unordered_map<std::string, int> negativeDentries;
+  std::unordered_map<int, std::string> dentryPaths;
 };  
 
 #endif
@@ -13,8 +13,11 @@ class MyServerSocket {
    * if it cannot bind, it will throw a socket exception.
    *
    * @param port the port to bind to
+   * @param backlog how many connections can wait to be accepted
+   * @param reusePort share the port with other listeners that set it,
+   *        see SO_REUSEPORT
    */
-  MyServerSocket(int port);
+  MyServerSocket(int port, int backlog = 10, bool reusePort = false);
   MyServerSocket() { serverFd = -1; }
   
   /**
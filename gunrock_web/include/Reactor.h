@@ -0,0 +1,101 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <deque>
+#include <set>
+#include <string>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+#include "MyServerSocket.h"
+#include "MySocket.h"
+
+// A client connection owned by the reactor. At any moment exactly one
+// party owns it: epoll while it waits to become readable or writable, or
+// the one thread that is reading, serving or writing it.
+struct ReactorConnection {
+  enum State { BUSY, READING, WRITING };
+
+  int fd;
+  MySocket *socket;
+  // the request being parsed, NULL between requests
+  HTTPRequest *request;
+  // bytes read from the socket that haven't been parsed yet
+  std::string input;
+  // The response being written. Headers and an in memory body go out
+  // first, then a file body or the body's chunks. written counts bytes of
+  // the first part, fileSent of the file, chunkSent of the current chunk.
+  HTTPResponse *response;
+  std::string head;
+  size_t written;
+  size_t fileSent;
+  std::string chunk;
+  size_t chunkSent;
+  int served;
+  bool peerClosed;
+  bool closeAfterWrite;
+  State state;
+  time_t lastActive;
+};
+
+/**
+ * Event driven alternative to the blocking accept loop and worker queue.
+ *
+ * One thread runs the event loop: it accepts connections and reads and
+ * parses requests as bytes arrive, using edge triggered, one shot epoll
+ * registrations on non-blocking sockets. Complete requests go to the
+ * worker threads, which serve them and write the response without
+ * blocking, handing the connection back to epoll when the socket is
+ * full. A connection waiting for its next request costs a file
+ * descriptor and a little memory, not a thread.
+ */
+class Reactor {
+ public:
+  // serve fills in the response for a request, the reactor takes care of
+  // the Connection header and of writing the response out.
+  Reactor(MyServerSocket *server, int keepAliveSeconds, int maxRequests,
+          void (*serve)(MySocket *client, HTTPRequest *request, HTTPResponse *response));
+  ~Reactor();
+
+  // Runs the event loop, never returns. A server can have several
+  // Reactors, each with its own listening socket and event loop thread.
+  void run();
+  // Serves complete requests, never returns. Call from each worker thread.
+  void work();
+
+ private:
+  void acceptConnections();
+  void onReadable(ReactorConnection *conn);
+  // Parses buffered input and hands a complete request to the workers,
+  // or waits for more input.
+  void advance(ReactorConnection *conn);
+  // Queues the connection for a worker.
+  void dispatch(ReactorConnection *conn);
+  void serve(ReactorConnection *conn);
+  // Writes as much of the pending response as the socket takes. Pulling
+  // the body can block, so this only runs on worker threads.
+  void flush(ReactorConnection *conn);
+  // Gives the connection back to epoll until it is readable or writable.
+  void arm(ReactorConnection *conn, ReactorConnection::State state);
+  void close(ReactorConnection *conn);
+  void closeIdleConnections();
+
+  MyServerSocket *server;
+  int epollFd;
+  int keepAliveSeconds;
+  int maxRequests;
+  void (*serveRequest)(MySocket *client, HTTPRequest *request, HTTPResponse *response);
+
+  // guards connections, each connection's state, and ready
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  std::set<ReactorConnection *> connections;
+  // connections with a complete request or a response to carry on
+  // writing, waiting for a worker
+  std::deque<ReactorConnection *> ready;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef _REQUEST_QUEUE_H_
+#define _REQUEST_QUEUE_H_
+
+#include <deque>
+#include <list>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "MySocket.h"
+
+// A connection waiting in a RequestQueue, with whatever the scheduling
+// policy learned about it before it was queued.
+struct QueuedClient {
+  MySocket *client;
+  long cost;
+  std::string address;
+  unsigned long sequence;
+};
+
+/**
+ * The bounded buffer between the thread that accepts connections and
+ * the worker threads that handle them.
+ *
+ * put blocks while the queue holds `capacity` connections and take
+ * blocks while it is empty. Subclasses only decide which waiting
+ * connection a worker gets next, the locking lives here and goes
+ * through the dthread wrappers.
+ */
+class RequestQueue {
+ public:
+  RequestQueue(int capacity);
+  virtual ~RequestQueue();
+
+  void put(MySocket *client);
+  // put, unless the queue is full: then it returns false right away
+  bool offer(MySocket *client);
+  MySocket *take();
+
+  // how many connections are waiting for a worker right now
+  int waiting();
+
+  // Build the queue for a -s scheduling policy name (FIFO, SFF or FAIR),
+  // or return NULL for an unknown name. SFF ranks connections with
+  // estimateCost, which may peek at the request but must not consume it,
+  // and must not wait: it also runs with the queue lock held.
+  static RequestQueue *create(std::string policy, int capacity, long (*estimateCost)(MySocket *client));
+
+ protected:
+  // Hook for work that should happen before put takes the lock, like
+  // peeking at the request. Runs on the accepting thread.
+  virtual void prepare(QueuedClient &entry);
+
+  // Called with the queue lock held.
+  virtual void push(const QueuedClient &entry) = 0;
+  virtual QueuedClient pop() = 0;
+
+ private:
+  bool add(MySocket *client, bool wait);
+
+  int capacity;
+  int count;
+  unsigned long sequence;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+};
+
+// First come, first served.
+class FifoRequestQueue : public RequestQueue {
+ public:
+  FifoRequestQueue(int capacity);
+
+ protected:
+  virtual void push(const QueuedClient &entry);
+  virtual QueuedClient pop();
+
+ private:
+  std::deque<QueuedClient> clients;
+};
+
+/**
+ * Smallest file first: the connection whose response is expected to be
+ * smallest goes next, ties in arrival order. Large transfers can wait
+ * indefinitely while smaller requests keep arriving.
+ *
+ * A connection is often accepted before its request arrives, so those
+ * whose cost was unknown (LONG_MAX) are estimated again every time a
+ * worker takes one, and go after the rest until their request shows up.
+ */
+class SffRequestQueue : public RequestQueue {
+ public:
+  SffRequestQueue(int capacity, long (*estimateCost)(MySocket *client));
+
+ protected:
+  virtual void prepare(QueuedClient &entry);
+  virtual void push(const QueuedClient &entry);
+  virtual QueuedClient pop();
+
+ private:
+  // orders the heap so the cheapest, then oldest, connection is on top
+  struct MoreExpensive {
+    bool operator()(const QueuedClient &a, const QueuedClient &b) const {
+      return a.cost != b.cost ? a.cost > b.cost : a.sequence > b.sequence;
+    }
+  };
+
+  long (*estimateCost)(MySocket *client);
+  std::priority_queue<QueuedClient, std::vector<QueuedClient>, MoreExpensive> clients;
+  // connections with no estimate yet, oldest first
+  std::deque<QueuedClient> unknown;
+};
+
+/**
+ * Fair share: connections are grouped by client address and workers
+ * take from each address in turn, so one client with many connections
+ * gets no more of the workers than a client with one.
+ */
+class FairShareRequestQueue : public RequestQueue {
+ public:
+  FairShareRequestQueue(int capacity);
+
+ protected:
+  virtual void prepare(QueuedClient &entry);
+  virtual void push(const QueuedClient &entry);
+  virtual QueuedClient pop();
+
+ private:
+  std::map<std::string, std::deque<QueuedClient> > clientsByAddress;
+  // addresses with waiting connections, the next one to serve first
+  std::list<std::string> turns;
+};
+
+#endif
@@ -12,6 +12,22 @@
 
 #define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
 
+// Inode formats, kept in the super block. Images from before there was a
+// choice have 0 there.
+#define UFS_FORMAT_DIRECT (0)
+#define UFS_FORMAT_INDIRECT (1)
+
+// In the indirect format the first UFS_NUM_DIRECT pointers of an inode
+// point to data blocks, the next one to a single indirect block full of
+// data block pointers, and the last one to a double indirect block full
+// of single indirect block pointers.
+#define UFS_NUM_DIRECT (DIRECT_PTRS - 2)
+#define UFS_SINGLE_INDIRECT (DIRECT_PTRS - 2)
+#define UFS_DOUBLE_INDIRECT (DIRECT_PTRS - 1)
+#define UFS_PTRS_PER_BLOCK ((int) (UFS_BLOCK_SIZE / sizeof(unsigned int)))
+// the indirect format can address more, but sizes are ints
+#define MAX_INDIRECT_FILE_SIZE (0x7fffffff / UFS_BLOCK_SIZE * UFS_BLOCK_SIZE)
+
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
 typedef struct {
@@ -38,6 +54,7 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int inode_format;      // UFS_FORMAT_DIRECT or UFS_FORMAT_INDIRECT
 } super_t;
 
 
@@ -8,7 +8,8 @@
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-x]\n");
+    fprintf(stderr, "  -x: use indirect blocks, for files larger than %d bytes\n", MAX_FILE_SIZE);
     exit(1);
 }
 
@@ -18,8 +19,9 @@ int main(int argc, char *argv[]) {
     int num_inodes = 32;
     int num_data = 32;
     int visual = 0;
+    int inode_format = UFS_FORMAT_DIRECT;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:vx")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -33,6 +35,9 @@ int main(int argc, char *argv[]) {
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'x':
+	    inode_format = UFS_FORMAT_INDIRECT;
+	    break;
 	default:
 	    usage();
 	}
@@ -56,6 +61,11 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
+    // a journal left over from the old image must not be replayed onto this one
+    char journal_file[strlen(image_file) + sizeof(".journal")];
+    sprintf(journal_file, "%s.journal", image_file);
+    unlink(journal_file);
+
     assert(num_inodes >= 32);
     assert(num_data >= 32);
 
@@ -65,6 +75,7 @@ int main(int argc, char *argv[]) {
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
+    s.inode_format = inode_format;
 
     // inode bitmap
     int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
@@ -103,6 +114,7 @@ int main(int argc, char *argv[]) {
     printf("total blocks        %d\n", total_blocks);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
     printf("  data blocks       %d\n", num_data);
+    printf("  inode format      %s\n", inode_format == UFS_FORMAT_INDIRECT ? "indirect" : "direct");
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
@@ -152,7 +164,7 @@ int main(int argc, char *argv[]) {
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
+	itable.inodes[0].direct[i] = (inode_format == UFS_FORMAT_INDIRECT) ? 0 : -1;
 
     rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
@@ -6,33 +6,31 @@
 #include <assert.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <sstream>
 
+#include <stdlib.h>
+
 using namespace std;
 
 HTTPClientResponse::HTTPClientResponse(MySocket *sock) {
     m_sock = sock;
     m_status_code = 0;
+    m_keep_alive = false;
 }
 
 
 string HTTPClientResponse::readResponse() {
   string full_response;
+  size_t delimiter;
 
-  while (true) {
-    string response;
+  // read until we have all of the headers
+  while ((delimiter = full_response.find("\r\n\r\n")) == string::npos) {
     try {
-      response = m_sock->read();
+      full_response += m_sock->read();
     } catch (...) {
-      break;
+      return "";
     }
-
-    full_response += response;
-  }
-
-  size_t delimiter = full_response.find("\r\n\r\n");
-  if (delimiter == string::npos) {
-    return "";
   }
 
   m_body = full_response.substr(delimiter+4);
@@ -40,13 +38,66 @@ string HTTPClientResponse::readResponse() {
   stringstream header_stream(header_string);
 
   string line;
+  bool http10 = false;
   while (getline(header_stream, line)) {
+    if (line.size() > 0 && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
     if (line.find("HTTP/1.1 ") == 0 || line.find("HTTP/1.0") == 0) {
       stringstream header_line(line);
       string http;
       header_line >> http >> m_status_code >> m_status_message;
+      http10 = http == "HTTP/1.0";
+      continue;
+    }
+
+    size_t colon = line.find(':');
+    if (colon == string::npos) {
+      continue;
+    }
+    // header names are case insensitive, keep them in lower case
+    string key = line.substr(0, colon);
+    transform(key.begin(), key.end(), key.begin(), ::tolower);
+    size_t value = line.find_first_not_of(' ', colon + 1);
+    m_headers[key] = value == string::npos ? "" : line.substr(value);
+  }
+
+  string connection = header("connection");
+  transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+  m_keep_alive = http10 ? connection == "keep-alive" : connection != "close";
+
+  if (m_headers.find("content-length") == m_headers.end()) {
+    // without a length the body runs until the server closes the connection
+    m_keep_alive = false;
+    while (true) {
+      try {
+        m_body += m_sock->read();
+      } catch (...) {
+        break;
+      }
     }
+    return m_body;
   }
-  
+
+  size_t length = strtoul(header("content-length").c_str(), NULL, 10);
+  while (m_body.size() < length) {
+    try {
+      m_body += m_sock->read();
+    } catch (...) {
+      m_keep_alive = false;
+      break;
+    }
+  }
+  if (m_body.size() > length) {
+    // we never pipeline, so anything extra is not a response we asked for
+    m_body.resize(length);
+    m_keep_alive = false;
+  }
+
   return m_body;
 }
+
+string HTTPClientResponse::header(string key) {
+  map<string, string>::iterator iter = m_headers.find(key);
+  return iter == m_headers.end() ? "" : iter->second;
+}
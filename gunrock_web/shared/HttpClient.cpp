@@ -8,24 +8,36 @@
 using namespace std;
 
 HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls) {
-  if (use_tls) {
-    connection = new MySslSocket(inet_addr, port);
-  } else {
-    connection = new MySocket(inet_addr, port);
-  }
-  
+  this->inet_addr = inet_addr;
+  this->port = port;
+  this->use_tls = use_tls;
+  this->reused = false;
+  connection = NULL;
+  connect();
+
   stringstream host;
   host << inet_addr << ":" << port;
   headers["Host"] = host.str();
   headers["User-Agent"] = string("Gunrock/1.0");
   headers["Accept"] = string("*/*");
-  headers["Connection"] = string("close");
+  headers["Connection"] = string("keep-alive");
 }
 
 HttpClient::~HttpClient() {
   delete connection;
 }
 
+void HttpClient::connect() {
+  delete connection;
+  connection = NULL;
+  if (use_tls) {
+    connection = new MySslSocket(inet_addr.c_str(), port);
+  } else {
+    connection = new MySocket(inet_addr.c_str(), port);
+  }
+  reused = false;
+}
+
 void HttpClient::set_header(string key, string value) {
   headers[key] = value;
 }
@@ -60,7 +72,10 @@ void HttpClient::write_request(string path, string method, string body) {
   if (body.size() > 0) {
     request << body;
   }
-  
+
+  if (connection == NULL) {
+    connect();
+  }
   connection->write(request.str());
 }
 
@@ -69,25 +84,54 @@ void HttpClient::write_request(string path, string method, string body) {
 HTTPClientResponse *HttpClient::read_response() {
   HTTPClientResponse *response = new HTTPClientResponse(connection);
   response->readResponse();
+  if (response->keepAlive()) {
+    reused = true;
+  } else {
+    // the next request opens a new connection
+    delete connection;
+    connection = NULL;
+  }
+  return response;
+}
+
+HTTPClientResponse *HttpClient::send(string path, string method, string body) {
+  // The server may have taken the request before the connection dropped,
+  // which only GET, PUT and DELETE can shrug off. A POST appends, so it
+  // isn't sent twice.
+  bool retry = reused && (method == "GET" || method == "PUT" || method == "DELETE");
+  try {
+    write_request(path, method, body);
+  } catch (SocketWriteError &) {
+    if (!retry) {
+      throw;
+    }
+    connect();
+    return send(path, method, body);
+  }
+
+  HTTPClientResponse *response = read_response();
+  if (response->status() == 0 && retry) {
+    // Most likely the server closed the idle connection before it saw
+    // our request.
+    delete response;
+    connect();
+    return send(path, method, body);
+  }
   return response;
 }
 
 HTTPClientResponse *HttpClient::get(string path) {
-  write_request(path, "GET", "");
-  return read_response();
+  return send(path, "GET", "");
 }
 
 HTTPClientResponse *HttpClient::post(string path, string body) {
-  write_request(path, "POST", body);
-  return read_response();
+  return send(path, "POST", body);
 }
 
 HTTPClientResponse *HttpClient::put(string path, string body) {
-  write_request(path, "PUT", body);
-  return read_response();
+  return send(path, "PUT", body);
 }
 
 HTTPClientResponse *HttpClient::del(string path) {
-  write_request(path, "DELETE", "");
-  return read_response();
+  return send(path, "DELETE", "");
 }
@@ -1,10 +1,14 @@
 #include "MySocket.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
 #include <string>
 
 #include <iostream>
@@ -80,6 +84,63 @@ void MySocket::write_bytes(const void *buffer, int len) {
     }
 }
 
+void MySocket::write(const string &head, const string &body, bool more) {
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = (void *) head.data();
+    iov[0].iov_len = head.size();
+    iov[1].iov_base = (void *) body.data();
+    iov[1].iov_len = body.size();
+    struct iovec *next = iov;
+    int count = 2;
+
+    while(count > 0) {
+        if(next->iov_len == 0) {
+            next++;
+            count--;
+            continue;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = next;
+        msg.msg_iovlen = count;
+        ssize_t bytesWritten = sendmsg(sockFd, &msg, more ? MSG_MORE : 0);
+        if(bytesWritten <= 0) {
+	  throw SocketWriteError();
+        }
+
+        // skip past whatever went out, a short write can end mid buffer
+        while(count > 0 && (size_t) bytesWritten >= next->iov_len) {
+            bytesWritten -= next->iov_len;
+            next++;
+            count--;
+        }
+        if(count > 0) {
+            next->iov_base = (char *) next->iov_base + bytesWritten;
+            next->iov_len -= bytesWritten;
+        }
+    }
+}
+
+void MySocket::sendFile(int fd, off_t offset, size_t length) {
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    while(length > 0) {
+        ssize_t bytesWritten = sendfile(sockFd, fd, &offset, length);
+        if(bytesWritten <= 0) {
+	  // an error, or the file got shorter than we said it was
+	  throw SocketWriteError();
+        }
+        length -= bytesWritten;
+    }
+}
+
 string MySocket::read() {
     char buffer[4096];
     if(sockFd<0) {
@@ -95,6 +156,60 @@ string MySocket::read() {
     return string(buffer, ret);
 }
 
+string MySocket::peek(int maxBytes, int timeoutMs) {
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    struct pollfd pfd;
+    pfd.fd = sockFd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, timeoutMs) <= 0) {
+      return "";
+    }
+
+    string buffer(maxBytes, '\0');
+    int ret = recv(sockFd, &buffer[0], maxBytes, MSG_PEEK | MSG_DONTWAIT);
+    if(ret <= 0) {
+      return "";
+    }
+    buffer.resize(ret);
+    return buffer;
+}
+
+bool MySocket::waitReadable(int timeoutMs) {
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    struct pollfd pfd;
+    pfd.fd = sockFd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeoutMs) > 0;
+}
+
+string MySocket::peerAddress(void) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(sockFd<0 || getpeername(sockFd, (struct sockaddr *) &addr, &len) != 0) {
+      return "";
+    }
+
+    char str[INET6_ADDRSTRLEN];
+    const void *src;
+    if(addr.ss_family == AF_INET) {
+      src = &((struct sockaddr_in *) &addr)->sin_addr;
+    } else if(addr.ss_family == AF_INET6) {
+      src = &((struct sockaddr_in6 *) &addr)->sin6_addr;
+    } else {
+      return "";
+    }
+    if(inet_ntop(addr.ss_family, src, str, sizeof(str)) == NULL) {
+      return "";
+    }
+    return string(str);
+}
+
 void MySocket::close(void) {
     if(sockFd<0) return;
     
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <sstream>
 
+#include <unistd.h>
+
 #include <openssl/conf.h>
 #include <openssl/opensslconf.h>
 
@@ -97,6 +99,23 @@ string MySslSocket::read() {
   return result;
 }
 
+void MySslSocket::write(const string &head, const string &body, bool more) {
+  write(head + body);
+}
+
+void MySslSocket::sendFile(int fd, off_t offset, size_t length) {
+  char buffer[16384];
+  while (length > 0) {
+    ssize_t ret = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+    if (ret <= 0) {
+      throw SocketWriteError();
+    }
+    write(string(buffer, ret));
+    offset += ret;
+    length -= ret;
+  }
+}
+
 void MySslSocket::close() {
   if(NULL != ctx)
     SSL_CTX_free(ctx);
@@ -13,6 +13,11 @@ class HTTPClientResponse {
   int status() { return m_status_code; }
   bool success() { return m_status_code >= 200 && m_status_code < 300; }
   std::string body() { return m_body; }
+  // the value of a response header, by its lower case name, or "" if the
+  // server didn't send it
+  std::string header(std::string key);
+  // true if the server left the connection open for another request
+  bool keepAlive() { return m_keep_alive; }
   
  protected:
   MySocket *m_sock;
@@ -20,6 +25,7 @@ class HTTPClientResponse {
   std::map<std::string, std::string> m_headers;
   int m_status_code;
   std::string m_status_message;
+  bool m_keep_alive;
 };
 
 #endif
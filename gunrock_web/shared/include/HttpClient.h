@@ -19,6 +19,9 @@ class HttpClient {
    *
    * Note: this call will block while establishing a connection.
    *
+   * Requests share the connection for as long as the server keeps it
+   * open, and the client reconnects when the server closes it.
+   *
    * @param inetAddr either ip address, or the domain name
    * @param port the port to connect to
    */
@@ -98,6 +101,17 @@ class HttpClient {
   HTTPClientResponse *read_response();
   
  private:
+  void connect();
+  // write a request and read its response, sending a GET, PUT or DELETE
+  // again on a fresh connection if the server had already closed the one
+  // we reused
+  HTTPClientResponse *send(std::string path, std::string method, std::string body);
+
+  std::string inet_addr;
+  int port;
+  bool use_tls;
+  // true once a response has come back on the current connection
+  bool reused;
   MySocket *connection;
   std::map<std::string, std::string> headers;
 };
@@ -4,6 +4,8 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/types.h>
+
 class SocketNotConnected : public std::runtime_error {
  public:
   SocketNotConnected() : std::runtime_error("socket not connected") {}
@@ -51,7 +53,39 @@ class MySocket {
 
   virtual std::string read();
   virtual void write(std::string data);
+
+  /*
+   * writes head and then body with gathering writes, so callers don't
+   * have to copy them into one string first. With more set the kernel
+   * holds back a partial packet because more data follows right away.
+   */
+  virtual void write(const std::string &head, const std::string &body, bool more = false);
+
+  /*
+   * sends length bytes of the open file fd, starting at offset, straight
+   * from the page cache with sendfile(2)
+   */
+  virtual void sendFile(int fd, off_t offset, size_t length);
   virtual void close(void);
+
+  /*
+   * returns up to maxBytes of data that has already arrived without
+   * consuming it, so a later read still sees it. Waits at most timeoutMs
+   * for the first bytes and returns an empty string if none arrive.
+   */
+  virtual std::string peek(int maxBytes, int timeoutMs);
+
+  /*
+   * waits at most timeoutMs for data to arrive or the other end to hang
+   * up, and returns whether either happened
+   */
+  virtual bool waitReadable(int timeoutMs);
+
+  /*
+   * the address of the other end of the connection ("192.168.0.1"), or
+   * an empty string if it is not known
+   */
+  std::string peerAddress(void);
   
  protected:
   void call_connect(const char *inetAddr, int port);
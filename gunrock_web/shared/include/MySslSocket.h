@@ -21,6 +21,9 @@ class MySslSocket: public MySocket {
 
   std::string read();
   void write(std::string data);
+  // TLS has to encrypt in user space, so these copy through write
+  void write(const std::string &head, const std::string &body, bool more = false);
+  void sendFile(int fd, off_t offset, size_t length);
   void close(void);
   
  protected: